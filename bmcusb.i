@@ -28,6 +28,8 @@ eCIUsbCmndSetDac             = 0xF7;
 BMCUSB_ENDPOINT = 2;
 BMCUSB_VENDOR = 0x1781;
 BMCUSB_MULTIDRIVER = 0x0ED8;
+BMCUSB_NCHANNELS = 160;   /* number of channels in a frame */
+BMCUSB_DAC_MAX = 0xFFFF;  /* DAC counts for full stroke */
 
 func bmcusb_probe
 /* DOCUMENT bmcusb_probe;
@@ -52,28 +54,93 @@ func bmcusb_probe
   BMCUSB_DEVICES = descr(sel);
 }
 
-func bmcusb_open(j)
+func bmcusb_open(j, serial=)
 /* DOCUMENT dev = bmcusb_open(j);
          or dev = bmcusb_open();
+         or dev = bmcusb_open(serial=str);
 
      This function opens the j-th BMC device and returns a handle to it.  By
      default, the first available device is opened.  The list of available
      devices is based on the last call to bmcusb_probe.  If the list is empty,
      bmcusb_probe is automatically called.  You can also call bmcusb_probe
-     before bmcusb_open to refresh the list.
+     before bmcusb_open to refresh the list.  If keyword SERIAL is specified,
+     the BMC device with this serial number is opened (no probing is needed
+     in this case).  The global variable BMCUSB_ENDPOINT is updated with the
+     address of the output endpoint of the device (see bmcusb_endpoint).
 
-   SEE ALSO: bmcusb_probe.
+   SEE ALSO: bmcusb_probe, usb_open_by_id.
  */
 {
-  extern BMCUSB_DEVICES;
-  if (is_void(BMCUSB_DEVICES)) {
-    bmcusb_probe;
+  extern BMCUSB_DEVICES, BMCUSB_ENDPOINT;
+  if (! is_void(serial)) {
+    dev = usb_open_by_id(BMCUSB_VENDOR, BMCUSB_MULTIDRIVER, serial=serial);
+  } else {
+    if (is_void(BMCUSB_DEVICES)) {
+      bmcusb_probe;
+    }
+    if (is_void(j)) {
+      j = 1;
+    }
+    dev = usb_open_device(BMCUSB_DEVICES(j).path);
+  }
+  if (! is_void(dev)) {
+    BMCUSB_ENDPOINT = bmcusb_endpoint(dev);
+  }
+  return dev;
+}
+
+func bmcusb_endpoint(dev)
+/* DOCUMENT ep = bmcusb_endpoint(dev);
+
+     This function yields the address of the bulk output endpoint to which
+     frames are sent for the BMC device DEV.  The endpoint is found from the
+     endpoint descriptors of the device, the default endpoint (2) is
+     returned if they are not available.
+
+   SEE ALSO: bmcusb_send_frame, bmcusb_frame_pipe.
+ */
+{
+  ep = dev.endpoints;
+  if (! is_void(ep)) {
+    j = where((! ep(2,)) & (ep(3,) == USB_TRANSFER_TYPE_BULK));
+    if (is_array(j)) return ep(1, j(1));
+  }
+  return 2;
+}
+
+func bmcusb_watch(j)
+/* DOCUMENT bmcusb_watch;
+         or bmcusb_watch, j;
+
+     This subroutine opens the j-th BMC device (the first one by default)
+     and stores its handle into the global variable BMCUSB_DEVICE.  A hotplug
+     callback is registered so that BMCUSB_DEVICE is set to nil when the
+     device is disconnected and automatically re-opened as soon as a BMC
+     device is reconnected.
+
+   SEE ALSO: bmcusb_open, usb_hotplug_register.
+ */
+{
+  extern BMCUSB_DEVICE, _BMCUSB_WATCH;
+  BMCUSB_DEVICE = bmcusb_open(j);
+  if (is_void(_BMCUSB_WATCH)) {
+    _BMCUSB_WATCH = usb_hotplug_register(BMCUSB_VENDOR, BMCUSB_MULTIDRIVER,
+                                         _bmcusb_on_hotplug);
   }
-  if (is_void(j)) {
-    j = 1;
+}
+
+func _bmcusb_on_hotplug(event, bus, port, address, vendor, product)
+{
+  extern BMCUSB_DEVICE, BMCUSB_DEVICES;
+  BMCUSB_DEVICES = []; // force probing again
+  if (event > 0) {
+    if (is_void(BMCUSB_DEVICE)) {
+      BMCUSB_DEVICE = usb_open_device(bus, port);
+    }
+  } else if (! is_void(BMCUSB_DEVICE) && BMCUSB_DEVICE.bus == bus &&
+             BMCUSB_DEVICE.address == address) {
+    BMCUSB_DEVICE = [];
   }
-  return usb_open_device(BMCUSB_DEVICES(j).bus,
-                         BMCUSB_DEVICES(j).port);
 }
 
 func bmcusb_control(dev, request, send, value, index, data, lenght, timeout)
@@ -102,6 +169,76 @@ func _bmcusb_set(dev, value)
   bmcusb_control, dev, eCIUsbCmndSetControlBits, 1n, 0, value;
 }
 
+func bmcusb_send_frame(dev, act, timeout)
+/* DOCUMENT ret = bmcusb_send_frame(dev, act);
+         or ret = bmcusb_send_frame(dev, act, timeout);
+
+     Send the actuator commands ACT to the BMC device DEV.  ACT is a vector
+     of at most BMCUSB_NCHANNELS normalized commands (float or double) in the
+     range [0,1].  Clamping, conversion to DAC counts and packing are done by
+     compiled code.  TIMEOUT is the timeout in milliseconds (1000 by
+     default).  The result is the number of bytes sent or an error code.
+
+   SEE ALSO: usb_send_frame.
+ */
+{
+  if (is_void(timeout)) timeout = 1000; // one second default timeout
+  return usb_send_frame(dev, BMCUSB_ENDPOINT, act, BMCUSB_NCHANNELS,
+                        BMCUSB_DAC_MAX, timeout);
+}
+
+func bmcusb_frame_pipe(dev, timeout)
+/* DOCUMENT pipe = bmcusb_frame_pipe(dev);
+         or pipe = bmcusb_frame_pipe(dev, timeout);
+
+     Create a double-buffered frame pipe for the BMC device DEV.  Frames
+     submitted with usb_frame_submit are sent asynchronously between
+     deasserting and asserting the frame-sync bit, so that the next frame
+     is transferred while the current one is latched.  TIMEOUT is the
+     timeout in milliseconds (1000 by default).  For instance:
+
+       pipe = bmcusb_frame_pipe(dev);
+       usb_start_event_thread;
+       for (;;) {
+         ...
+         usb_frame_submit, pipe, act; // returns immediately
+       }
+
+   SEE ALSO: usb_frame_pipe, bmcusb_send_frame, bmcusb_setFrameSync.
+ */
+{
+  if (is_void(timeout)) timeout = 1000; // one second default timeout
+  sync = [[0x40, eCIUsbCmndSetControlBits, 0x0004, 0, 0],  // deassert
+          [0x40, eCIUsbCmndSetControlBits, 0x0084, 0, 0]]; // assert
+  return usb_frame_pipe(dev, BMCUSB_ENDPOINT, BMCUSB_NCHANNELS,
+                        BMCUSB_DAC_MAX, sync, timeout);
+}
+
+func bmcusb_set_batch(dev, values, timeout)
+/* DOCUMENT ret = bmcusb_set_batch(dev, values);
+         or ret = bmcusb_set_batch(dev, values, timeout);
+
+     Send a sequence of control bits VALUES (e.g., reset, HV and frame-sync
+     commands) to the BMC device DEV with a single batched control transfer.
+     The result is an array of result codes, one for each value.  TIMEOUT is
+     the timeout in milliseconds (1000 by default).
+
+   SEE ALSO: usb_control_batch, bmcusb_control.
+ */
+{
+  if (is_void(timeout)) timeout = 1000; // one second default timeout
+  n = numberof(values);
+  setup = array(int, 5, n);
+  setup(1,) = 0x40; // request type
+  setup(2,) = eCIUsbCmndSetControlBits;
+  setup(3,) = values(*);
+  ret = usb_control_batch(dev, setup, [], timeout);
+  if (am_subroutine() && anyof(ret < 0)) {
+    usb_error, "usb_control_batch failed", ret(where(ret < 0)(1));
+  }
+  return ret;
+}
+
 func bmcusb_reset(dev, assert)
 {
   _bmcusb_set, dev, (assert ? 0x0082 : 0x0002);
@@ -0,0 +1,322 @@
+/*
+ * usb-bench.c --
+ *
+ * Stand-alone benchmark of libusb, to be compared with the results of
+ * usb_bench (in "usb-bench.i") to separate the overheads of the Yorick
+ * plug-in from those of the USB library and hardware.
+ *
+ *-----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2014 Éric Thiébaut <eric.thiebaut@univ-lyon1.fr>.
+ *
+ * The MIT License (MIT):
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#define TRUE  1
+#define FALSE 0
+
+static const char* progname = "usb-bench";
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1E-9*(double)ts.tv_nsec;
+}
+
+static void fatal(const char* reason, int code)
+{
+  fprintf(stderr, "%s: %s [%s]\n", progname, reason,
+          libusb_error_name(code));
+  exit(1);
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/* Write a line of results with the same format as usb_bench in Yorick.  T
+   is the array of N times per call in seconds, it is sorted in place. */
+static void write_result(const char* name, long size, double* t, long n)
+{
+  double tmin, tmed, tavg, tmax, tstd, s1, s2;
+  long i;
+
+  for (i = 0; i < n; ++i) {
+    t[i] *= 1E6; /* microseconds */
+  }
+  qsort(t, n, sizeof(double), compare_doubles);
+  s1 = s2 = 0.0;
+  for (i = 0; i < n; ++i) {
+    s1 += t[i];
+  }
+  tavg = s1/n;
+  for (i = 0; i < n; ++i) {
+    s2 += (t[i] - tavg)*(t[i] - tavg);
+  }
+  tstd = (n > 1 ? sqrt(s2/n) : 0.0);
+  tmin = t[0];
+  tmax = t[n - 1];
+  tmed = ((n & 1) != 0 ? t[n/2] : (t[n/2 - 1] + t[n/2])/2);
+  fprintf(stdout, "  %-22s %8ld %8ld %10.2f %10.2f %10.2f %10.2f %10.2f "
+          "%10.3f\n", name, size, n, tmin, tmed, tavg, tmax, tstd,
+          (tavg > 0.0 ? size/tavg : 0.0));
+}
+
+static void LIBUSB_CALL on_completion(struct libusb_transfer* transfer)
+{
+  *(int*)transfer->user_data = TRUE;
+}
+
+static void bench_bulk(libusb_context* ctx, libusb_device_handle* handle,
+                       int endpoint, long size, long n, int depth)
+{
+  struct libusb_transfer** transfers;
+  const char* dir = ((endpoint & LIBUSB_ENDPOINT_IN) ? "in" : "out");
+  unsigned char* buf;
+  double* t;
+  double t0, t1;
+  char name[64];
+  int* completed;
+  int ret, transferred;
+  long i, j;
+
+  buf = (unsigned char*)malloc(size*depth);
+  t = (double*)malloc(n*sizeof(double));
+  transfers = (struct libusb_transfer**)malloc(depth*sizeof(void*));
+  completed = (int*)malloc(depth*sizeof(int));
+  if (buf == NULL || t == NULL || transfers == NULL || completed == NULL) {
+    fatal("insufficient memory", LIBUSB_ERROR_NO_MEM);
+  }
+  for (i = 0; i < size*depth; ++i) {
+    buf[i] = (unsigned char)rand();
+  }
+
+  /* Blocking transfers. */
+  for (i = 0; i < n; ++i) {
+    t0 = now();
+    ret = libusb_bulk_transfer(handle, endpoint, buf, size, &transferred,
+                               1000);
+    t[i] = now() - t0;
+    if (ret != 0) {
+      fatal("libusb_bulk_transfer failed", ret);
+    }
+  }
+  sprintf(name, "bulk-sync-%s", dir);
+  write_result(name, size, t, n);
+
+  /* Asynchronous transfers with DEPTH transfers in flight. */
+  for (j = 0; j < depth; ++j) {
+    transfers[j] = libusb_alloc_transfer(0);
+    if (transfers[j] == NULL) {
+      fatal("libusb_alloc_transfer failed", LIBUSB_ERROR_NO_MEM);
+    }
+    libusb_fill_bulk_transfer(transfers[j], handle, endpoint, buf + j*size,
+                              size, on_completion, &completed[j], 1000);
+    completed[j] = FALSE;
+    ret = libusb_submit_transfer(transfers[j]);
+    if (ret != 0) {
+      fatal("libusb_submit_transfer failed", ret);
+    }
+  }
+  t0 = now();
+  for (i = 0; i < n; ++i) {
+    j = i%depth;
+    while (! completed[j]) {
+      libusb_handle_events_completed(ctx, &completed[j]);
+    }
+    if (transfers[j]->status != LIBUSB_TRANSFER_COMPLETED) {
+      fatal("asynchronous transfer failed", LIBUSB_ERROR_IO);
+    }
+    t1 = now();
+    t[i] = t1 - t0;
+    t0 = t1;
+    completed[j] = FALSE;
+    ret = libusb_submit_transfer(transfers[j]);
+    if (ret != 0) {
+      fatal("libusb_submit_transfer failed", ret);
+    }
+  }
+  for (j = 0; j < depth; ++j) {
+    while (! completed[j]) {
+      libusb_handle_events_completed(ctx, &completed[j]);
+    }
+    libusb_free_transfer(transfers[j]);
+  }
+  sprintf(name, "bulk-async-%s", dir);
+  write_result(name, size, t, n);
+
+  free(completed);
+  free(transfers);
+  free(t);
+  free(buf);
+}
+
+static void usage(FILE* output)
+{
+  fprintf(output, "usage: %s [OPTIONS] VENDOR:PRODUCT\n", progname);
+  fprintf(output, "options:\n");
+  fprintf(output, "  -i ENDPOINT   Input bulk endpoint.\n");
+  fprintf(output, "  -o ENDPOINT   Output bulk endpoint (only use with a "
+          "test device).\n");
+  fprintf(output, "  -s SIZE,...   Transfer sizes in bytes "
+          "[64,...,65536].\n");
+  fprintf(output, "  -n COUNT      Number of samples per test [1000].\n");
+  fprintf(output, "  -q DEPTH      Number of asynchronous transfers in "
+          "flight [4].\n");
+  fprintf(output, "  -I INTERFACE  Interface to claim [0].\n");
+  fprintf(output, "  -h            Print this help and exit.\n");
+}
+
+int main(int argc, char* argv[])
+{
+  libusb_context* ctx;
+  libusb_device_handle* handle;
+  unsigned char status[2];
+  long sizes[32];
+  long nsizes, n, i, k;
+  double* t;
+  double t0;
+  unsigned int vendor, product;
+  int in, out, depth, interface, ret;
+  char* str;
+  char* end;
+
+  /* Parse arguments. */
+  in = out = -1;
+  n = 1000;
+  depth = 4;
+  interface = 0;
+  nsizes = 0;
+  for (k = 6; k <= 16; ++k) {
+    sizes[nsizes++] = 1L << k;
+  }
+  for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "-h") == 0) {
+      usage(stdout);
+      return 0;
+    }
+    if (argv[i][1] == '\0' || argv[i][2] != '\0' || i + 1 >= argc) {
+      usage(stderr);
+      return 1;
+    }
+    str = argv[++i];
+    switch (argv[i - 1][1]) {
+    case 'i':
+      in = (int)strtol(str, NULL, 0);
+      break;
+    case 'o':
+      out = (int)strtol(str, NULL, 0);
+      break;
+    case 'n':
+      n = strtol(str, NULL, 0);
+      break;
+    case 'q':
+      depth = (int)strtol(str, NULL, 0);
+      break;
+    case 'I':
+      interface = (int)strtol(str, NULL, 0);
+      break;
+    case 's':
+      for (nsizes = 0; nsizes < 32 && *str != '\0'; ++nsizes) {
+        sizes[nsizes] = strtol(str, &end, 0);
+        str = (*end == ',' ? end + 1 : end);
+      }
+      break;
+    default:
+      usage(stderr);
+      return 1;
+    }
+  }
+  if (i != argc - 1 ||
+      sscanf(argv[i], "%x:%x", &vendor, &product) != 2 ||
+      n < 1 || depth < 1) {
+    usage(stderr);
+    return 1;
+  }
+
+  /* Open the device. */
+  ret = libusb_init(&ctx);
+  if (ret != 0) {
+    fatal("libusb_init failed", ret);
+  }
+  handle = libusb_open_device_with_vid_pid(ctx, vendor, product);
+  if (handle == NULL) {
+    fatal("device not found", LIBUSB_ERROR_NOT_FOUND);
+  }
+  if ((in >= 0 || out >= 0) &&
+      (ret = libusb_claim_interface(handle, interface)) != 0) {
+    fatal("libusb_claim_interface failed", ret);
+  }
+  t = (double*)malloc(n*sizeof(double));
+  if (t == NULL) {
+    fatal("insufficient memory", LIBUSB_ERROR_NO_MEM);
+  }
+
+  /* Run the benchmarks. */
+  fprintf(stdout, "# %-22s %8s %8s %10s %10s %10s %10s %10s %10s\n",
+          "test", "size", "count", "min", "median", "mean", "max", "std",
+          "rate");
+  for (i = 0; i < n; ++i) {
+    t0 = now();
+    t[i] = now() - t0;
+  }
+  write_result("clock", 0, t, n);
+  for (i = 0; i < n; ++i) {
+    t0 = now();
+    ret = libusb_control_transfer(handle, 0x80, 0x00, 0, 0, status, 2,
+                                  1000);
+    t[i] = now() - t0;
+    if (ret < 0) {
+      fatal("GET_STATUS failed", ret);
+    }
+  }
+  write_result("control", 2, t, n);
+  for (k = 0; k < nsizes; ++k) {
+    if (in >= 0) {
+      bench_bulk(ctx, handle, in | LIBUSB_ENDPOINT_IN, sizes[k], n, depth);
+    }
+    if (out >= 0) {
+      bench_bulk(ctx, handle, out & ~LIBUSB_ENDPOINT_IN, sizes[k], n, depth);
+    }
+  }
+
+  free(t);
+  if (in >= 0 || out >= 0) {
+    libusb_release_interface(handle, interface);
+  }
+  libusb_close(handle);
+  libusb_exit(ctx);
+  return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * usb-bench.i --
+ *
+ * Benchmarks for the Yorick interface to libusb.
+ *
+ *-----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2014 Éric Thiébaut <eric.thiebaut@univ-lyon1.fr>.
+ * All rights reserved.
+ */
+
+require, "usb.i";
+
+func usb_bench(dev, in=, out=, sizes=, n=, depth=, file=)
+/* DOCUMENT usb_bench;
+         or usb_bench, dev, in=, out=, sizes=, n=, depth=, file=;
+
+     Measure the performances of the USB plug-in.  Results are written as a
+     table with one line per test and the following columns:
+
+       test     - name of the test
+       size     - number of bytes transferred per call
+       count    - number of samples
+       min      - minimum time per call (in microseconds)
+       median   - median time per call (in microseconds)
+       mean     - mean time per call (in microseconds)
+       max      - maximum time per call (in microseconds)
+       std      - standard deviation of the time per call (in microseconds)
+       rate     - throughput (in megabytes per second)
+
+     Lines starting with a '#' are comments.  The table is written to the
+     standard output unless keyword FILE is set with the name of the output
+     file or with an open text file.
+
+     Without any device, only the interpreter overhead is measured.  If an
+     USB device DEV is specified, the round-trip time of control transfers
+     (with a standard GET_STATUS request) and the argument parsing overhead
+     of bulk transfers are measured.  Keywords IN and OUT may be set with
+     the addresses of input and output bulk endpoints of DEV to measure the
+     throughput of blocking, asynchronous and (for input) streamed bulk
+     transfers.  Beware that random data are sent to the output endpoint,
+     so only use OUT with a loopback or test device.
+
+     Keyword SIZES is a list of transfer sizes in bytes (by default powers of
+     2 from 64 to 65536), keyword N is the number of samples per test (1000
+     by default) and keyword DEPTH is the number of transfers queued by the
+     asynchronous and streaming tests (4 by default).
+
+     DEV may be a simulated device (see usb_mock_config) to measure the
+     overheads of the plug-in alone, the asynchronous and streaming tests
+     are skipped in that case.
+
+   SEE ALSO: usb_clock, usb_enable_stats, usb_mock_config.
+ */
+{
+  if (is_void(n)) n = 1000;
+  if (is_void(depth)) depth = 4;
+  if (is_void(sizes)) sizes = 2^indgen(6:16);
+  if (is_void(file)) {
+    f = [];
+  } else if (structof(file) == string) {
+    f = open(file, "w");
+  } else {
+    f = file;
+  }
+  _usb_bench_header, f;
+
+  /* Interpreter overhead. */
+  t = array(double, n);
+  for (i = 1; i <= n; ++i) {
+    t0 = usb_clock();
+    t(i) = usb_clock() - t0;
+  }
+  _usb_bench_write, f, "clock", 0, t;
+  for (i = 1; i <= n; ++i) {
+    t0 = usb_clock();
+    usb_error_name, 0;
+    t(i) = usb_clock() - t0;
+  }
+  _usb_bench_write, f, "builtin", 0, t;
+  if (is_void(dev)) return;
+
+  /* Argument parsing overhead of transfers (zero-length transfers are not
+     sent to the device). */
+  buf = array(char, max(sizes));
+  ep = (is_void(in) ? (is_void(out) ? 0x81 : out) : in);
+  xfer = 0;
+  for (i = 1; i <= n; ++i) {
+    t0 = usb_clock();
+    usb_bulk_transfer, dev, ep, buf, 0, xfer, 0;
+    t(i) = usb_clock() - t0;
+  }
+  _usb_bench_write, f, "bulk-noop", 0, t;
+  ubuf = usb_buffer(buf);
+  for (i = 1; i <= n; ++i) {
+    t0 = usb_clock();
+    usb_bulk_transfer, dev, ep, ubuf, 0, xfer, 0;
+    t(i) = usb_clock() - t0;
+  }
+  _usb_bench_write, f, "bulk-noop-buffer", 0, t;
+
+  /* Round-trip time of control transfers (GET_STATUS). */
+  status = array(char, 2);
+  for (i = 1; i <= n; ++i) {
+    t0 = usb_clock();
+    ret = usb_control_transfer(dev, 0x80, 0x00, 0, 0, status, 2, 1000);
+    t(i) = usb_clock() - t0;
+    if (ret < 0) usb_error, "GET_STATUS failed", ret;
+  }
+  _usb_bench_write, f, "control", 2, t;
+
+  /* Throughput of bulk transfers. */
+  for (k = 1; k <= numberof(sizes); ++k) {
+    size = sizes(k);
+    if (! is_void(in)) {
+      _usb_bench_bulk, f, dev, in, buf, size, n, depth;
+    }
+    if (! is_void(out)) {
+      buf(1:size) = char(random_n(size)*100);
+      _usb_bench_bulk, f, dev, out, buf, size, n, depth;
+    }
+  }
+  if (! is_void(in) && ! dev.mock) {
+    for (k = 1; k <= numberof(sizes); ++k) {
+      _usb_bench_stream, f, dev, in, sizes(k), n, depth;
+    }
+  }
+}
+
+func _usb_bench_bulk(f, dev, ep, buf, size, n, depth)
+{
+  dir = ((ep & 0x80) ? "in" : "out");
+  t = array(double, n);
+  xfer = 0;
+  for (i = 1; i <= n; ++i) {
+    t0 = usb_clock();
+    ret = usb_bulk_transfer(dev, ep, buf, size, xfer, 1000);
+    t(i) = usb_clock() - t0;
+    if (ret < 0) usb_error, "usb_bulk_transfer failed", ret;
+  }
+  _usb_bench_write, f, "bulk-sync-" + dir, size, t;
+  if (dev.mock) return;
+
+  /* Asynchronous transfers with DEPTH transfers in flight, the time per call
+     is the time between successive completions.  Each queued transfer has
+     its own buffer (a copy of BUF) as transfers are done in place. */
+  queue = save();
+  bufs = save();
+  keys = swrite(format="tr%d", indgen(depth));
+  for (j = 1; j <= depth; ++j) {
+    save, bufs, keys(j), usb_buffer(buf(1:size));
+    save, queue, keys(j), usb_submit_transfer(dev, ep, bufs(keys(j)), size,
+                                              1000);
+  }
+  t0 = usb_clock();
+  for (i = 1; i <= n; ++i) {
+    key = keys((i - 1)%depth + 1);
+    ret = usb_wait_transfer(queue(noop(key)));
+    if (ret < 0) usb_error, "usb_wait_transfer failed", ret;
+    t1 = usb_clock();
+    t(i) = t1 - t0;
+    t0 = t1;
+    save, queue, noop(key), usb_submit_transfer(dev, ep, bufs(noop(key)),
+                                                size, 1000);
+  }
+  queue = bufs = [];
+  _usb_bench_write, f, "bulk-async-" + dir, size, t;
+}
+
+func _usb_bench_stream(f, dev, ep, size, n, depth)
+{
+  t = array(double, n);
+  s = usb_stream_start(dev, ep, size, depth);
+  t0 = usb_clock();
+  for (i = 1; i <= n; ++i) {
+    data = usb_stream_read(s, 1000);
+    if (is_void(data)) error, "timeout while streaming";
+    t1 = usb_clock();
+    t(i) = t1 - t0;
+    t0 = t1;
+  }
+  usb_stream_stop, s;
+  _usb_bench_write, f, "stream-in", size, t;
+}
+
+func _usb_bench_header(f)
+{
+  format = "# %-22s %8s %8s %10s %10s %10s %10s %10s %10s\n";
+  if (is_void(f)) {
+    write, format=format, "test", "size", "count", "min", "median", "mean",
+      "max", "std", "rate";
+  } else {
+    write, f, format=format, "test", "size", "count", "min", "median", "mean",
+      "max", "std", "rate";
+  }
+}
+
+func _usb_bench_write(f, name, size, t)
+{
+  t = 1e6*t; // microseconds
+  n = numberof(t);
+  tavg = avg(t);
+  rate = (tavg > 0 ? size/tavg : 0.0); // bytes/µs = MB/s
+  tstd = (n > 1 ? t(rms) : 0.0);
+  format = "  %-22s %8d %8d %10.2f %10.2f %10.2f %10.2f %10.2f %10.3f\n";
+  if (is_void(f)) {
+    write, format=format, name, long(size), n, min(t), median(t), tavg,
+      max(t), tstd, rate;
+  } else {
+    write, f, format=format, name, long(size), n, min(t), median(t), tavg,
+      max(t), tstd, rate;
+  }
+}
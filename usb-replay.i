@@ -0,0 +1,169 @@
+/*
+ * usb-replay.i --
+ *
+ * Loading and replaying of USB traffic captured by the Yorick interface to
+ * libusb (see usb_capture_start).
+ *
+ *-----------------------------------------------------------------------------
+ *
+ * Copyright (c) 2014 Éric Thiébaut <eric.thiebaut@univ-lyon1.fr>.
+ * All rights reserved.
+ */
+
+require, "usb.i";
+
+func usb_capture_load(name)
+/* DOCUMENT cap = usb_capture_load(name);
+
+     Load the USB traffic saved by usb_capture_dump into file NAME.  The
+     result is an object with the following members:
+
+       cap.count        - number of records
+       cap.payload_max  - maximum number of payload bytes per record
+       cap.lost         - number of records lost because the ring was full
+       cap.time         - start time of the transfers (see usb_clock)
+       cap.latency      - duration of the transfers (in seconds)
+       cap.length       - requested number of bytes
+       cap.result       - result as returned by libusb synchronous API
+       cap.transferred  - number of bytes actually transferred
+       cap.timeout      - timeout (in milliseconds)
+       cap.payload      - number of payload bytes stored in cap.data
+       cap.value        - wValue setup field (control transfers)
+       cap.index        - wIndex setup field (control transfers)
+       cap.bus          - bus number of the device
+       cap.address      - address of the device
+       cap.type         - transfer type (USB_TRANSFER_TYPE_...)
+       cap.endpoint     - endpoint address
+       cap.request_type - bmRequestType setup field (control transfers)
+       cap.request      - bRequest setup field (control transfers)
+       cap.async        - whether the transfer was asynchronous
+       cap.data         - PAYLOAD_MAX-by-COUNT array of payload bytes (only
+                          if PAYLOAD_MAX is non-zero)
+
+     All members but cap.data are scalars or vectors of COUNT values.
+
+   SEE ALSO: usb_capture_dump, usb_replay.
+ */
+{
+  f = open(name, "rb");
+  i86_primitives, f; /* little-endian */
+  magic = array(char, 8);
+  _read, f, 0, magic;
+  if (strchar(magic)(1) != "YUSBCAP") {
+    error, "not an USB capture file";
+  }
+  hdr = array(int, 6);
+  _read, f, 8, hdr;
+  if (hdr(1) != 1) {
+    error, "unsupported version of USB capture file";
+  }
+  n = hdr(2);
+  payload_max = hdr(3);
+  cap = save(count = n, payload_max = payload_max, lost = hdr(4));
+  if (n <= 0) {
+    return cap;
+  }
+  names = ["time", "latency", "length", "result", "transferred", "timeout",
+           "payload", "value", "index", "bus", "address", "type", "endpoint",
+           "request_type", "request", "async"];
+  address = 32;
+  for (k = 1; k <= numberof(names); ++k) {
+    if (k <= 2) {
+      value = array(double, n);
+    } else if (k <= 7) {
+      value = array(int, n);
+    } else if (k <= 9) {
+      value = array(short, n);
+    } else {
+      value = array(char, n);
+    }
+    _read, f, address, value;
+    address += sizeof(value);
+    if (k >= 8) {
+      /* Unsigned values. */
+      value = (k <= 9 ? (long(value) & 0xffff) : long(value));
+    }
+    save, cap, noop(names(k)), value;
+  }
+  if (payload_max > 0) {
+    data = array(char, payload_max, n);
+    _read, f, address, data;
+    save, cap, data = data;
+  }
+  close, f;
+  return cap;
+}
+
+func usb_replay(dev, cap, realtime=, verbose=)
+/* DOCUMENT res = usb_replay(dev, cap, realtime=, verbose=);
+
+     Replay the USB traffic CAP (as loaded by usb_capture_load) against the
+     device DEV.  The transfers are performed synchronously and in the same
+     order as they were captured.  The outgoing data are those stored in the
+     capture payloads (zero-padded if the payloads were truncated).  If
+     keyword REALTIME is true, the original delays between the start of
+     successive transfers are reproduced (by busy waiting) as far as
+     possible.  Isochronous transfers are skipped.
+
+     The result is an object with members RES.latency (duration of the
+     replayed transfers, in seconds), RES.result (their results as for
+     usb_control_transfer or usb_bulk_transfer) and RES.mismatches (number
+     of results which differ from the recorded ones).  If keyword VERBOSE
+     is true, a line is printed for each mismatch.
+
+     Beware that replaying the traffic sends commands to DEV, only do this
+     with the device for which the traffic was captured or with a test
+     device.
+
+   SEE ALSO: usb_capture_load, usb_capture_start.
+ */
+{
+  n = cap.count;
+  latency = array(double, n);
+  result = array(long, n);
+  if (cap.payload_max > 0) data = cap.data;
+  xfer = 0;
+  t1 = usb_clock();
+  for (i = 1; i <= n; ++i) {
+    type = cap.type(i);
+    endpoint = cap.endpoint(i);
+    length = cap.length(i);
+    timeout = cap.timeout(i);
+    buf = array(char, max(length, 1));
+    m = cap.payload(i);
+    if (m > 0) {
+      buf(1:m) = data(1:m, i);
+    }
+    if (realtime) {
+      t = t1 + (cap.time(i) - cap.time(1));
+      while (usb_clock() < t);
+    }
+    t0 = usb_clock();
+    if (type == USB_TRANSFER_TYPE_CONTROL) {
+      ret = usb_control_transfer(dev, cap.request_type(i), cap.request(i),
+                                 cap.value(i), cap.index(i), buf, length,
+                                 timeout);
+    } else if (type == USB_TRANSFER_TYPE_BULK) {
+      ret = usb_bulk_transfer(dev, endpoint, buf, length, xfer, timeout);
+    } else if (type == USB_TRANSFER_TYPE_INTERRUPT) {
+      ret = usb_interrupt_transfer(dev, endpoint, buf, length, xfer,
+                                   timeout);
+    } else {
+      continue;
+    }
+    latency(i) = usb_clock() - t0;
+    result(i) = ret;
+  }
+  skip = (cap.type == USB_TRANSFER_TYPE_ISOCHRONOUS);
+  bad = ((result != cap.result) & (! skip));
+  if (verbose && anyof(bad)) {
+    for (i = 1; i <= n; ++i) {
+      if (bad(i)) {
+        write, format="transfer %d (type %d, endpoint 0x%02x): "+
+          "result %d instead of %d\n", i, cap.type(i), cap.endpoint(i),
+          result(i), cap.result(i);
+      }
+    }
+  }
+  return save(latency = latency, result = result, mismatches = sum(bad));
+}
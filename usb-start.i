@@ -1 +1 @@
-autoload, "usb.i", usb_probe_devices, usb_open_device, usb_get_string, usb_claim_interface, usb_release_interface, usb_control_transfer, usb_bulk_transfer, usb_interrupt_transfer, usb_error_name, usb_error_description, usb_error, usb_debug;
+autoload, "usb.i", usb_probe_devices, usb_refresh_devices, usb_hotplug_supported, usb_new_context, usb_mock_config, usb_hotplug_register, usb_hotplug_deregister, usb_hotplug_dispatch, usb_open_device, usb_open_by_id, usb_set_spin, usb_set_chunking, usb_set_recovery, usb_enable_stats, usb_reset_stats, usb_capture_start, usb_capture_stop, usb_capture_dump, usb_capture_status, usb_trace_start, usb_trace_stop, usb_trace_dump, usb_trace_status, usb_get_string, usb_claim_interface, usb_release_interface, usb_control_transfer, usb_control_batch, usb_device_group, usb_multi_submit, usb_bulk_transfer, usb_interrupt_transfer, usb_prepare_transfer, usb_send_frame, usb_frame_pipe, usb_frame_submit, usb_frame_wait, usb_buffer, usb_buffer_store, usb_pack, usb_unpack, usb_submit_transfer, usb_wait_transfer, usb_test_transfer, usb_cancel_transfer, usb_handle_events, usb_stream_start, usb_iso_stream_start, usb_stream_read, usb_stream_stop, usb_start_event_thread, usb_stop_event_thread, usb_event_thread, usb_set_io_thread_params, usb_attach_events, usb_detach_events, usb_events_attached, usb_completions, usb_error_name, usb_error_description, usb_error, usb_debug, usb_clock;
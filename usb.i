@@ -13,8 +13,9 @@ if (is_func(plug_in)) plug_in, "yusb";
 
 local usb_descriptor;
 extern _usb_probe_devices;
-func usb_probe_devices(nil)
+func usb_probe_devices(nil, strings=, context=)
 /* DOCUMENT desc = usb_probe_devices();
+         or desc = usb_probe_devices(strings=1);
      Query the descriptors of current USB devices.  If there are no USB
      devices, the result is nil; otherwise, the result is an array of
      usb_descriptor structures:
@@ -26,26 +27,50 @@ func usb_probe_devices(nil)
        desc(i).product      - product identifier of i-th USB device
        desc(i).manufacturer - manufacturer identifier of i-th USB device
        desc(i).serial       - serial number of i-th USB device
+       desc(i).iproduct     - index of the product string of i-th USB device
+       desc(i).speed        - speed of i-th USB device (USB_SPEED_...)
+       desc(i).path         - port path of i-th USB device ("BUS-PORT.PORT...")
+       desc(i).manufacturer_string - manufacturer of i-th USB device
+       desc(i).product_string      - product name of i-th USB device
+       desc(i).serial_string       - serial number of i-th USB device
+
+     All devices are queried in a single pass over the cached list of USB
+     devices.  The string descriptors (manufacturer_string, product_string
+     and serial_string) are only retrieved if keyword STRINGS is true, they
+     are empty if the device cannot be opened.  As this requires to open
+     each device, the strings are fetched only once per device and cached
+     by the plug-in until the device is disconnected.
+
+     Keyword CONTEXT may be set with a libusb context (see usb_new_context)
+     to use the cached list of devices of this context instead of the
+     default one.
 
      Beware that the returned list is only correct while no USB devices are
-     connected nor disconnected.  See usb_open_device for an example of usage.
+     connected nor disconnected (see usb_refresh_devices).  See
+     usb_open_device for an example of usage.
 
      When called as a subroutine, a comprehensive list of USB devices is
-     printed to standard output, like 'lsusb' Unix command but without the
-     string description of each device.  Note that the "Device" number is the
-     port number plus one.
+     printed to standard output, like 'lsusb' Unix command (with the string
+     description of each device if keyword STRINGS is true).  Note that the
+     "Device" number is the port number plus one.
 
-  SEE ALSO: usb_open_device.
+  SEE ALSO: usb_open_device, usb_refresh_devices.
  */
 {
-  list = _usb_probe_devices();
+  local info;
+  list = _usb_probe_devices(info, strings, context);
   if (is_void(list)) {
     return;
   }
   n = dimsof(list)(3);
   if (am_subroutine()) {
-    write, format="Bus %03d Device %03d: ID %04x:%04x\n",
-      list(1,), list(2,) + 1, list(4,), list(5,);
+    if (strings) {
+      write, format="Bus %03d Device %03d: ID %04x:%04x %s %s\n",
+        list(1,), list(2,) + 1, list(4,), list(5,), info(2,), info(3,);
+    } else {
+      write, format="Bus %03d Device %03d: ID %04x:%04x\n",
+        list(1,), list(2,) + 1, list(4,), list(5,);
+    }
   } else {
     out = array(usb_descriptor, n);
     out.bus = list(1,);
@@ -55,6 +80,14 @@ func usb_probe_devices(nil)
     out.product = list(5,);
     out.manufacturer = list(6,);
     out.serial = list(7,);
+    out.speed = list(8,);
+    out.iproduct = list(9,);
+    out.path = info(1,);
+    if (strings) {
+      out.manufacturer_string = info(2,);
+      out.product_string = info(3,);
+      out.serial_string = info(4,);
+    }
     return out;
   }
 }
@@ -66,15 +99,235 @@ struct usb_descriptor {
   int product;
   int manufacturer;
   int serial;
+  int iproduct;
+  int speed;
+  string path;
+  string manufacturer_string;
+  string product_string;
+  string serial_string;
 }
 
+local USB_SPEED_UNKNOWN, USB_SPEED_LOW, USB_SPEED_FULL, USB_SPEED_HIGH;
+local USB_SPEED_SUPER;
+/* DOCUMENT USB_SPEED_UNKNOWN, USB_SPEED_LOW, USB_SPEED_FULL,
+            USB_SPEED_HIGH, USB_SPEED_SUPER;
+     Constants for the speed of USB devices: low speed (1.5 Mbit/s), full
+     speed (12 Mbit/s), high speed (480 Mbit/s) and super speed (5000
+     Mbit/s).
+
+  SEE ALSO: usb_probe_devices.
+ */
+
+extern usb_refresh_devices;
+extern usb_hotplug_supported;
+/* DOCUMENT n = usb_refresh_devices();
+         or n = usb_refresh_devices(ctx);
+         or bool = usb_hotplug_supported();
+
+     The plug-in keeps a cached list of the connected USB devices which is
+     used by usb_probe_devices and usb_open_device.  If hotplug
+     notifications are supported (usb_hotplug_supported() is true), the
+     cached list is only refreshed when a device is connected or
+     disconnected; otherwise, the list is refreshed by every call.
+
+     The function usb_refresh_devices forces the re-enumeration of the USB
+     devices and returns the number of connected devices.  Argument CTX is
+     a libusb context (see usb_new_context), the default context is used if
+     CTX is nil.
+
+  SEE ALSO: usb_probe_devices, usb_open_device.
+ */
+
+extern usb_new_context;
+/* DOCUMENT ctx = usb_new_context();
+         or ctx = usb_new_context(backend);
+     Create a new libusb context.  By default, all USB devices are opened in
+     a single libusb context, so their event handling and the internal locks
+     of libusb are shared.  Independent groups of devices (for instance,
+     several deformable mirrors and a camera driven by the same Yorick
+     process) can be opened in their own context by usb_open_device or
+     usb_open_by_id with their own event thread (see
+     usb_start_event_thread).  A context is automatically released when no
+     longer in use (that is when all devices opened in it have been
+     closed).
+
+     Optional argument BACKEND is "libusb" (the default) for real devices
+     or "mock" for a context with simulated devices (see usb_mock_config).
+     The backend of the default context is chosen when the plug-in is first
+     used according to the environment variable YUSB_BACKEND ("libusb" if
+     unset).
+
+     A context CTX has the following members:
+       ctx.devices      - number of connected USB devices
+       ctx.hotplug      - whether hotplug notifications are supported
+       ctx.event_thread - whether the event thread of CTX is running
+       ctx.mock         - whether devices of CTX are simulated
+
+     The functions accepting a context also accept nil to specify the
+     default context.
+
+   SEE ALSO: usb_open_device, usb_open_by_id, usb_start_event_thread,
+             usb_handle_events, usb_mock_config.
+ */
+
+func usb_mock_config(nil, latency=, throughput=, error_rate=, error_code=,
+                     devices=)
+/* DOCUMENT usb_mock_config, latency=, throughput=, error_rate=,
+                             error_code=, devices=;
+
+     Configure the simulated devices of mock contexts (see
+     usb_new_context).  Keyword LATENCY is the duration (in seconds) of any
+     transfer, keyword THROUGHPUT is the throughput (in bytes per second) of
+     the simulated devices, the duration of a transfer of N bytes being
+     LATENCY + N/THROUGHPUT (0 for unlimited throughput).  Keyword
+     ERROR_RATE is the probability that a transfer fails with the error
+     code ERROR_CODE (USB_ERROR_IO by default).  Keyword DEVICES is the
+     number of simulated devices listed by the mock contexts (it only
+     applies when the list of devices is loaded or refreshed, see
+     usb_refresh_devices).  Unspecified parameters are left unchanged; by
+     default, there is one simulated device, no latency, unlimited
+     throughput and no errors.
+
+     The simulated devices emulate a BMC Multi-DM (see "bmcusb.i"): they
+     have the same vendor and product identifiers, accept frames on any OUT
+     endpoint and answer the firmware version, status bits and control bits
+     requests.  The last data sent to an OUT endpoint are looped back and
+     returned by reads from IN endpoints.  Only synchronous transfers are
+     supported (i.e., usb_control_transfer, usb_bulk_transfer,
+     usb_interrupt_transfer, usb_send_frame and prepared transfers).
+     Member DEV.mock of a device DEV is true for a simulated device.
+
+     For instance, to measure the overheads of the plug-in without any
+     hardware:
+
+       ctx = usb_new_context("mock");
+       dev = usb_open_by_id(BMCUSB_VENDOR, BMCUSB_MULTIDRIVER, context=ctx);
+       usb_bench, dev, out=2;
+
+   SEE ALSO: usb_new_context, usb_bench.
+ */
+{
+  _usb_mock_config, latency, throughput, error_rate, error_code, devices;
+}
+extern _usb_mock_config;
+
+local USB_HOTPLUG_PERIOD;
+extern _usb_hotplug_register;
+extern _usb_hotplug_deregister;
+extern _usb_hotplug_events;
+func usb_hotplug_register(vendor, product, callback)
+/* DOCUMENT id = usb_hotplug_register(vendor, product, callback);
+         or usb_hotplug_deregister, id;
+         or usb_hotplug_dispatch;
+
+     The function usb_hotplug_register registers the Yorick function
+     CALLBACK to be called when an USB device with vendor identifier VENDOR
+     and product identifier PRODUCT is connected or disconnected.  If VENDOR
+     and/or PRODUCT is nil, any vendor and/or product matches.  The returned
+     value is an identifier which can be used to unregister the callback with
+     usb_hotplug_deregister.  The callback is called as:
+
+       CALLBACK, event, bus, port, address, vendor, product;
+
+     where EVENT is +1 if the device has been connected, -1 if it has been
+     disconnected, and the other arguments identify the device and can be
+     directly used to (re)open it with usb_open_device.
+
+     Hotplug events are queued by the plug-in and delivered to the callbacks
+     by the subroutine usb_hotplug_dispatch.  While callbacks are registered,
+     usb_hotplug_dispatch is automatically called every USB_HOTPLUG_PERIOD
+     seconds (0.01 by default) when Yorick is idle.
+
+   EXAMPLE
+     func on_dm_event(event, bus, port, address, vendor, product)
+     {
+       extern dm;
+       dm = (event > 0 ? usb_open_device(bus, port) : []);
+     }
+     usb_hotplug_register, BMCUSB_VENDOR, BMCUSB_MULTIDRIVER, on_dm_event;
+
+  SEE ALSO: usb_hotplug_supported, usb_open_device, after.
+ */
+{
+  extern _usb_hotplug_callbacks;
+  if (! is_func(callback)) error, "expecting a function for CALLBACK";
+  id = _usb_hotplug_register(vendor, product);
+  if (is_void(_usb_hotplug_callbacks)) _usb_hotplug_callbacks = save();
+  save, _usb_hotplug_callbacks, swrite(format="_%d", id), callback;
+  _usb_hotplug_schedule;
+  return id;
+}
+
+func usb_hotplug_deregister(id)
+{
+  extern _usb_hotplug_callbacks;
+  _usb_hotplug_deregister, id;
+  key = swrite(format="_%d", id);
+  if (is_obj(_usb_hotplug_callbacks, key) >= 0) {
+    save, _usb_hotplug_callbacks, noop(key), [];
+  }
+}
+
+func usb_hotplug_dispatch
+{
+  extern _usb_hotplug_callbacks;
+  list = _usb_hotplug_events();
+  n = (is_void(list) ? 0 : dimsof(list)(3));
+  for (i = 1; i <= n; ++i) {
+    key = swrite(format="_%d", list(1,i));
+    if (is_obj(_usb_hotplug_callbacks, key) >= 0) {
+      callback = _usb_hotplug_callbacks(noop(key));
+      if (is_func(callback)) {
+        callback, list(2,i), list(3,i), list(4,i), list(5,i),
+          list(6,i), list(7,i);
+      }
+    }
+  }
+}
+
+func _usb_hotplug_schedule
+/* DOCUMENT _usb_hotplug_schedule;
+     Private routine to periodically dispatch hotplug events while some
+     callbacks are registered.
+ */
+{
+  extern _usb_hotplug_scheduled;
+  if (! _usb_hotplug_scheduled) {
+    _usb_hotplug_scheduled = 1n;
+    after, USB_HOTPLUG_PERIOD, _usb_hotplug_poll;
+  }
+}
+
+func _usb_hotplug_poll
+{
+  extern _usb_hotplug_scheduled, _usb_hotplug_callbacks;
+  _usb_hotplug_scheduled = 0n;
+  usb_hotplug_dispatch;
+  n = _usb_hotplug_callbacks(*);
+  for (i = 1; i <= n; ++i) {
+    if (is_func(_usb_hotplug_callbacks(noop(i)))) {
+      _usb_hotplug_schedule;
+      break;
+    }
+  }
+}
+if (is_void(USB_HOTPLUG_PERIOD)) USB_HOTPLUG_PERIOD = 0.01;
+
 extern usb_open_device;
 /* DOCUMENT dev = usb_open_device(bus, port);
-     Open the USB device with specified bus and port numbers and return a
+         or dev = usb_open_device(path);
+         or dev = usb_open_device(ctx, bus, port);
+         or dev = usb_open_device(ctx, path);
+     Open the USB device with specified bus and port numbers (or with the
+     specified port path, e.g. "1-2.3", see usb_probe_devices) and return a
      handle for it.  An empty result is returned if no device is currently
-     connected to the given bus and port.  Use usb_list_devices to figure out
-     a list of connected USB devices.  There is no need to close the device,
-     this is automatically done when the device is no longer in use in Yorick.
+     connected to the given bus and port.  Unlike bus and port numbers which
+     may change when the system is rebooted, the port path only depends on
+     the physical location of the device.  Optional first argument CTX is a
+     libusb context (see usb_new_context) in which to open the device.  Use
+     usb_list_devices to figure out a list of connected USB devices.  There
+     is no need to close the device, this is automatically done when the
+     device is no longer in use in Yorick.
 
      The device may be used as a structure object to query some information:
        dev.bus          - bus number of i-th USB device
@@ -84,6 +337,23 @@ extern usb_open_device;
        dev.product      - product identifier of i-th USB device
        dev.manufacturer - manufacturer identifier of i-th USB device
        dev.serial       - serial number of i-th USB device
+       dev.path         - port path of i-th USB device
+       dev.manufacturer_string - manufacturer name (nil if none)
+       dev.product_string      - product name (nil if none)
+       dev.serial_string       - serial number as a string (nil if none)
+       dev.config       - [VALUE, INTERFACES, ATTRIBUTES, MAX_POWER] of the
+                          active configuration (MAX_POWER in mA), nil if
+                          not available
+       dev.speed        - bus speed of the device (USB_SPEED_...)
+       dev.endpoints    - 7-by-N array describing the N endpoints of the
+                          active configuration (nil if not available), each
+                          column is [ADDRESS, IN, TYPE, MAX_PACKET_SIZE,
+                          INTERVAL, INTERFACE, ALTSETTING] with IN true for
+                          input endpoints and TYPE the transfer type
+                          (USB_TRANSFER_TYPE_...)
+       dev.stats        - transfer statistics (see usb_enable_stats)
+       dev.histogram    - histogram of transfer latencies
+       dev.errors       - counts of transfer errors
 
    EXAMPLE
      // Get available USB devices:
@@ -104,14 +374,301 @@ extern usb_open_device;
      }
 
 
-   SEE ALSO: usb_probe_devices.
+   SEE ALSO: usb_probe_devices, usb_open_by_id.
 */
 
+extern _usb_open_by_id;
+func usb_open_by_id(vendor, product, serial=, context=)
+/* DOCUMENT dev = usb_open_by_id(vendor, product);
+         or dev = usb_open_by_id(vendor, product, serial=str, context=ctx);
+     Open the first USB device with given vendor and product identifiers
+     and, if keyword SERIAL is specified, with the given serial number
+     string.  An empty result is returned if no such device is currently
+     connected.  The devices are found by means of an index of the cached
+     list of USB devices, the serial number of each candidate device is only
+     read the first time it is needed.  This is the recommended way to open
+     a specific device among several identical ones.  Keyword CONTEXT may
+     be set with a libusb context (see usb_new_context) in which to open the
+     device.
+
+   SEE ALSO: usb_open_device, usb_probe_devices.
+ */
+{
+  return _usb_open_by_id(vendor, product, serial, context);
+}
+
+extern usb_set_spin;
+/* DOCUMENT usb_set_spin, dev, flag;
+         or usb_set_spin, dev, flag, cpu;
+
+     Enable (if FLAG is true) or disable the spin mode for the USB device
+     DEV.  In spin mode, the synchronous transfers of DEV
+     (usb_control_transfer, usb_bulk_transfer, usb_interrupt_transfer and
+     usb_send_frame) are submitted asynchronously and their completion is
+     busy-polled instead of sleeping in the kernel until the transfer
+     completes.  This saves the wake-up latency of the scheduler at the
+     expense of keeping a CPU core busy during the transfers.  The timeout
+     of the transfers is still honored.  Optional argument CPU is the index
+     of the CPU to which the interpreter thread is pinned while spin mode is
+     enabled for DEV (this is only supported on Linux); all devices pinning
+     the interpreter must specify the same CPU, an error is thrown
+     otherwise.  The achieved latencies can be measured by the statistics
+     of the device (see usb_enable_stats).
+
+     DEV.spin yields [FLAG, CPU] with CPU = -1 if the interpreter is not
+     pinned.
+
+   SEE ALSO: usb_enable_stats, usb_control_transfer, usb_bulk_transfer,
+            usb_set_chunking.
+ */
+
+extern usb_set_recovery;
+/* DOCUMENT usb_set_recovery, dev, policy, retries;
+         or usb_set_recovery, dev, policy, retries, budget;
+
+     Set the recovery policy of the USB device DEV.  When a synchronous
+     transfer of DEV (usb_control_transfer, usb_bulk_transfer,
+     usb_interrupt_transfer, usb_send_frame or a prepared transfer) fails
+     with a stall (USB_ERROR_PIPE, except for control transfers), a timeout
+     (USB_ERROR_TIMEOUT) or an I/O error (USB_ERROR_IO) and no data have been
+     transferred, it is transparently retried at most RETRIES times.  If
+     BUDGET is specified and strictly positive, no more retries are made
+     once BUDGET milliseconds have elapsed since the first attempt, so that
+     the recovery has a bounded latency.  POLICY is a combination (bitwise
+     or) of:
+
+       USB_RECOVER_CLEAR_HALT - clear the halt condition of the endpoint
+                                before the first retry (see
+                                libusb_clear_halt);
+       USB_RECOVER_RESET      - reset the device before the next retries,
+                                or before the first one if clearing the halt
+                                condition is not enabled or failed;
+       USB_RECOVER_RECLAIM    - claim again the interfaces claimed by
+                                usb_claim_interface after a reset.
+
+     With POLICY = 0, failed transfers are simply retried.  Recovery is
+     disabled with RETRIES = 0 (the default).  A transient stall then costs a
+     single retry instead of closing and reopening the device.  Asynchronous
+     transfers, chunks of large bulk transfers (see usb_set_chunking) and
+     streams are not retried (chunked transfers are retried as a whole).
+
+     DEV.recovery yields [POLICY, RETRIES, BUDGET].  Recovery events are
+     always counted, DEV.recovery_stats yields:
+
+       [retries, clear_halts, resets, reclaims, recovered, unrecovered, time]
+
+     that is the number of retries, of recovery actions of each kind, of
+     transfers which succeeded after being retried and of transfers which
+     failed despite the retries, and the total time spent in recovery
+     actions (in seconds).  These statistics are reset by usb_reset_stats.
+
+   SEE ALSO: usb_claim_interface, usb_bulk_transfer, usb_enable_stats.
+ */
+
+local USB_RECOVER_CLEAR_HALT, USB_RECOVER_RESET, USB_RECOVER_RECLAIM;
+/* DOCUMENT USB_RECOVER_CLEAR_HALT, USB_RECOVER_RESET, USB_RECOVER_RECLAIM;
+     Recovery actions for failed transfers.
+
+  SEE ALSO: usb_set_recovery.
+ */
+
+extern usb_set_chunking;
+/* DOCUMENT usb_set_chunking, dev, size;
+         or usb_set_chunking, dev, size, depth;
+         or usb_set_chunking, dev, [], [];
+
+     Enable chunking of large bulk transfers for the USB device DEV if SIZE
+     is strictly positive, disable it if SIZE is zero.  When chunking is
+     enabled, the synchronous bulk transfers of DEV (see usb_bulk_transfer)
+     of more than SIZE bytes are split into chunks of SIZE bytes, DEPTH of
+     them (4 by default, at most 32) being kept in flight as asynchronous
+     transfers so that the bus is kept busy.  The chunks are read or written
+     in place and the result is the same as for a single transfer: the
+     number of transferred bytes is stored in the TRANSFERRED variable and
+     the returned value is 0 or the error code of the first failed chunk.
+     The transfer stops at the first failed chunk or, for reads, at the
+     first short chunk (then the chunks already in flight are cancelled and
+     their data, if any, is not accounted for).  The TIMEOUT applies to
+     each chunk.
+
+     SIZE should be a multiple of the maximum packet size of the endpoint
+     (e.g. 512 bytes for high-speed bulk endpoints), typical values are in
+     the range 16-64 kB.  If SIZE and/or DEPTH are nil, values suitable for
+     the speed of the device are chosen (for instance, 64 kB and 4 chunks in
+     flight for a high-speed device).  Chunking is not available for
+     simulated devices.  DEV.chunking yields [SIZE, DEPTH].
+
+   SEE ALSO: usb_bulk_transfer, usb_stream_start, usb_set_spin.
+ */
+
+extern usb_enable_stats;
+extern usb_reset_stats;
+/* DOCUMENT usb_enable_stats, dev, flag;
+         or usb_reset_stats, dev;
+
+     The subroutine usb_enable_stats enables (if FLAG is true) or disables
+     the collection of transfer statistics for the USB device DEV.  The
+     statistics are reset when enabled.  The subroutine usb_reset_stats
+     resets the statistics of DEV. By default, statistics are disabled and
+     their collection has a negligible cost when disabled.
+
+     All transfers (control, bulk, interrupt, synchronous or asynchronous)
+     are accounted.  Latencies are measured with a monotonic clock, for an
+     asynchronous transfer it is the time elapsed between its submission
+     and its completion.  The statistics are available as members of DEV:
+
+       dev.stats = [count, bytes, failures, timeouts, min, mean, max,
+                    hits, misses]
+
+     where COUNT is the number of transfers, BYTES the number of bytes
+     transferred, FAILURES the number of failed transfers (including
+     timeouts), TIMEOUTS the number of timeouts and MIN, MEAN and MAX are
+     the minimum, mean and maximum latencies in seconds.  HITS and MISSES
+     are the number of asynchronous transfers (see usb_submit_transfer and
+     usb_control_batch) respectively taken from the pool of preallocated
+     transfers of DEV and requiring a new allocation because the pool was
+     empty.  The pool (initially of 8 transfers) grows as needed and
+     transfers are returned to the pool as soon as they complete, so MISSES
+     should stop increasing after a few iterations of a real-time loop.
+     HITS and MISSES are counted even though statistics are disabled.
+
+       dev.pool = [available, total]
+
+     yields the number of transfers available in the pool of DEV and the
+     total number of transfers owned by the pool.
+
+       dev.histogram
+
+     is a vector of 24 counts, the first one is the number of transfers with
+     a latency below one microsecond, the K-th one (with 1 < K < 24) is the
+     number of transfers with a latency in [2^(K-2),2^(K-1)) microseconds
+     and the last one is the number of slower transfers.
+
+       dev.errors
+
+     is a vector of 13 counts, DEV.errors(-CODE) is the number of transfers
+     which failed with error CODE (e.g. USB_ERROR_TIMEOUT, USB_ERROR_PIPE,
+     etc.) and DEV.errors(0) (i.e., the last entry) counts other errors.
+
+   EXAMPLE
+     usb_enable_stats, dev, 1;
+     ... // run the loop
+     s = dev.stats;
+     write, format="%d transfers, latency = %.1f/%.1f/%.1f µs\n",
+       long(s(1)), 1e6*s(5), 1e6*s(6), 1e6*s(7);
+
+  SEE ALSO: usb_open_device, usb_capture_start.
+ */
+
+func usb_capture_start(capacity, payload=)
+/* DOCUMENT usb_capture_start, capacity, payload=;
+         or usb_capture_stop;
+         or n = usb_capture_dump(name);
+         or st = usb_capture_status();
+
+     The subroutine usb_capture_start starts logging all control, bulk and
+     interrupt transfers (synchronous or asynchronous, of all devices) into
+     an in-memory ring of CAPACITY records.  Each record stores the start
+     time (see usb_clock), the device bus and address, the transfer type,
+     the endpoint, the setup fields of control transfers, the requested
+     length, the result, the number of transferred bytes, the latency and
+     the timeout of a transfer.  Keyword PAYLOAD may be set with the maximum
+     number of data bytes to also store for each transfer (none by
+     default).  The memory for the records is allocated once, when the
+     ring is full the oldest records are overwritten.  Restarting the
+     capture discards the records not yet dumped.
+
+     The subroutine usb_capture_stop stops logging transfers, the records
+     are kept until dumped or until the capture is restarted.
+
+     The function usb_capture_dump writes the records logged since the
+     previous dump into the binary file NAME and returns the number of
+     written records.  The records are handed over to a second ring with a
+     simple swap, so that transfers performed by other threads are never
+     delayed by the writing of the file.  The file can be loaded by
+     usb_capture_load and replayed against a device by usb_replay (see
+     "usb-replay.i").
+
+     The function usb_capture_status returns [ENABLED, CAPACITY, PAYLOAD,
+     COUNT, LOST] where COUNT is the number of records not yet dumped and
+     LOST is the number of records overwritten since the last dump.
+
+   EXAMPLE
+     usb_capture_start, 100000, payload=64;
+     ... // run the loop
+     usb_capture_dump, "traffic.cap";
+
+  SEE ALSO: usb_enable_stats, usb_capture_load, usb_replay, usb_clock,
+            usb_trace_start.
+ */
+{
+  _usb_capture_start, capacity, payload;
+}
+extern _usb_capture_start;
+extern usb_capture_stop;
+extern usb_capture_dump;
+extern usb_capture_status;
+
+extern usb_trace_start;
+extern usb_trace_stop;
+extern usb_trace_dump;
+extern usb_trace_status;
+/* DOCUMENT usb_trace_start;
+         or usb_trace_start, capacity;
+         or usb_trace_stop;
+         or n = usb_trace_dump(name);
+         or st = usb_trace_status();
+
+     The subroutine usb_trace_start starts recording a trace of the calls to
+     the USB library: synchronous transfers (usb_control_transfer,
+     usb_bulk_transfer, usb_interrupt_transfer, usb_send_frame and prepared
+     transfers), opening of devices and enumeration of devices.  Each event
+     has a name, a start time, a duration, an argument (the endpoint of data
+     transfers, the request of control transfers, (BUS << 8) | ADDRESS when
+     opening a device), the requested length and the result of the call.
+     Every thread records its events in its own ring of CAPACITY events
+     (65536 if CAPACITY is omitted or nil) without any locking, when a ring
+     is full the oldest events are overwritten (and counted as lost).
+     Restarting the trace discards the events not yet dumped.  When tracing
+     is disabled, each tracing point only costs a single test; tracing
+     points can be removed at compile time by defining the macro
+     YUSB_NO_TRACE (e.g. by adding -DYUSB_NO_TRACE to PKG_CFLAGS in the
+     Makefile).
+
+     The subroutine usb_trace_stop stops recording events, the events
+     already recorded are kept until dumped or until the trace is
+     restarted.
+
+     The function usb_trace_dump writes the events recorded since the last
+     dump into the file NAME in the Chrome trace format (JSON), which can be
+     displayed by chrome://tracing or https://ui.perfetto.dev, and returns the
+     number of written events.  Times are in microseconds since the start of
+     the trace.  Dumping is best done while tracing is stopped or idle since
+     the oldest events may be overwritten while they are written.
+
+     The function usb_trace_status returns [ENABLED, CAPACITY, COUNT, LOST,
+     THREADS] with COUNT the number of events not yet dumped, LOST the number
+     of overwritten events and THREADS the number of threads which have
+     recorded events.
+
+   EXAMPLE:
+     usb_trace_start, 100000;
+     ... // run the loop
+     usb_trace_stop;
+     usb_trace_dump, "loop.json";
+
+   SEE ALSO: usb_capture_start, usb_enable_stats, usb_clock.
+ */
+
 extern usb_get_string;
 /* DOCUMENT str_or_err = usb_get_string(dev, idx);
      Attempt to retrieve the string descriptor corresponding to index IDX for
      USB device DEV.  In case of failure, an error code (that is an integer)
-     is returned intead of a string.
+     is returned intead of a string.  The string descriptors are only read
+     from the device on first access (or when the device is probed with
+     strings, see usb_probe_devices) and are then cached, so that repeated
+     queries (including DEV.manufacturer_string, DEV.product_string
+     and DEV.serial_string) do not issue any control transfers.
 */
 
 extern usb_claim_interface;
@@ -143,7 +700,8 @@ extern usb_control_transfer;
      INDEX is the index field for the setup packet.
 
      DATA is a suitably-sized data buffer for either input or output
-     (depending on direction bits within TYPE).
+     (depending on direction bits within TYPE).  DATA may be a transfer
+     buffer object (see usb_buffer).
 
      LENGTH is the length field for the setup packet. The DATA buffer should
      be at least this size.
@@ -162,6 +720,95 @@ extern usb_control_transfer;
             usb_interrupt_transfer.
  */
 
+extern usb_control_batch;
+/* DOCUMENT res = usb_control_batch(dev, setup, data, timeout);
+
+     Perform a batch of USB control transfers with a single call.  The
+     transfers are submitted back-to-back (asynchronously) and the function
+     returns when all of them have completed.  This is much faster than
+     calling usb_control_transfer for each of them.
+
+   ARGUMENTS:
+     DEV is a handle for the USB device to communicate with.
+
+     SETUP is a 5-by-N integer array, the J-th column of SETUP is:
+
+       [type, request, value, index, length]
+
+     with the fields of the setup packet of the J-th control transfer
+     (their meaning is explained in usb_control_transfer).
+
+     DATA is a suitably-sized data buffer (or nil if all lengths are zero).
+     The data for the J-th transfer is stored at byte offset
+     sum(SETUP(5,1:J-1)) in DATA.  For input transfers, received data are
+     written in DATA at the same offset.  DATA may be a transfer buffer
+     object (see usb_buffer).
+
+     TIMEOUT is the timeout (in milliseconds) of each transfer.  For an
+     unlimited timeout, use value 0.
+
+   RETURNS:
+     An array of N integers, the J-th one is the number of bytes actually
+     transferred by the J-th transfer or, if strictly negative, its error
+     code.  If the submission of a transfer fails, the remaining ones are
+     not submitted and their result is USB_ERROR_INTERRUPTED.  If called as
+     a subroutine, an error is thrown in case of failure of any transfer.
+
+  SEE ALSO: usb_control_transfer, usb_buffer.
+ */
+
+extern usb_device_group;
+extern usb_multi_submit;
+/* DOCUMENT grp = usb_device_group(dev1, dev2, ...);
+         or res = usb_multi_submit(grp, endpoints, data, timeout);
+
+     The function usb_device_group creates a group of USB devices to be
+     driven together, for instance the deformable mirrors of the same
+     adaptive optics system.  GRP.count is the number of devices in the
+     group and GRP(I) yields its I-th device.
+
+     The function usb_multi_submit sends (or receives) data to (or from) all
+     the devices of the group GRP with a single call.  The bulk (or
+     interrupt) transfers for all the devices are prepared first, then
+     submitted back-to-back (asynchronously) so that all the devices are
+     served within microseconds of each other, and the function returns
+     when all of them have completed.  The total latency is thus that of the
+     slowest device, not the sum of the latencies of the devices.
+
+   ARGUMENTS:
+     GRP is a group of N devices created by usb_device_group.
+
+     ENDPOINTS is the address of the endpoint to use for all the devices,
+     or a vector of N endpoint addresses, one per device.
+
+     DATA is an array (or a transfer buffer, see usb_buffer) whose size in
+     bytes is a multiple of N.  The data are split in N equal contiguous
+     parts, the I-th one is transferred to (or from) the I-th device.  For
+     instance, DATA can be an array of frames with its last dimension equal
+     to N.
+
+     TIMEOUT is the timeout (in milliseconds) of each transfer.  For an
+     unlimited timeout, use value 0.
+
+   RETURNS:
+     An array of N integers, the I-th one is the number of bytes actually
+     transferred with the I-th device or, if strictly negative, its error
+     code.  The group fails as a whole: as soon as one transfer fails (for
+     instance because it timed out), the transfers still in flight are
+     cancelled and their result is USB_ERROR_INTERRUPTED.  If called as a
+     subroutine, an error is thrown in case of failure of any transfer.
+
+     Devices may belong to different contexts but waiting for transfers of
+     several contexts is done by waiting for the events of each context in
+     turn for at most 1 ms.  This does not keep a CPU busy but may delay the
+     detection of the completion of the group by about 1 ms per context.
+     Simulated devices (see usb_mock_config) cannot be part of a group
+     passed to usb_multi_submit.
+
+  SEE ALSO: usb_bulk_transfer, usb_control_batch, usb_send_frame,
+            usb_buffer.
+ */
+
 extern usb_bulk_transfer;
 /* DOCUMENT usb_bulk_transfer(dev, endpoint, data, length,
                               transferred, timeout);
@@ -193,7 +840,8 @@ extern usb_bulk_transfer;
      ENDPOINT is the address of a valid endpoint to communicate with.
 
      DATA is a suitably-sized data buffer for either input or output
-     (depending on ENDPOINT).
+     (depending on ENDPOINT).  DATA may be a transfer buffer object (see
+     usb_buffer).
 
      LENGTH is, for bulk writes, the number of bytes from data to be sent, for
      bulk reads, the maximum number of bytes to receive into the data buffer.
@@ -210,6 +858,8 @@ extern usb_bulk_transfer;
      bytes will be transferred but the value stored into the TRANSFERRED
      variable is still the total number of transferred bytes so far.
 
+     Large transfers can be automatically split and pipelined (see
+     usb_set_chunking).
 
    RETURNS:
      On success, 0 is returned and the TRANSFERRED variable is set with the
@@ -219,7 +869,7 @@ extern usb_bulk_transfer;
      as a subroutine, an error is thrown in case of failure.
 
   SEE ALSO: usb_open_device, usb_claim_interface; usb_control_transfer,
-            usb_interrupt_transfer.
+            usb_interrupt_transfer, usb_set_chunking.
  */
 
 extern usb_interrupt_transfer;
@@ -252,7 +902,8 @@ extern usb_interrupt_transfer;
      address of a valid endpoint to communicate with.
 
      DATA is a suitably-sized data buffer for either input or output
-     (depending on ENDPOINT).
+     (depending on ENDPOINT).  DATA may be a transfer buffer object (see
+     usb_buffer).
 
      LENGTH is, for interrupt writes, the number of bytes from data to be
      sent, for interrupt reads, the maximum number of bytes to receive into
@@ -282,6 +933,513 @@ extern usb_interrupt_transfer;
             usb_interrupt_transfer.
  */
 
+extern usb_prepare_transfer;
+/* DOCUMENT xfer = usb_prepare_transfer(dev, endpoint, data, length, timeout);
+         or xfer = usb_prepare_transfer(dev, endpoint, data, length, timeout,
+                                        type);
+
+     Prepare a synchronous bulk (the default) or interrupt (if TYPE is
+     USB_TRANSFER_TYPE_INTERRUPT) transfer for device DEV.  The arguments
+     DEV, ENDPOINT, DATA, LENGTH and TIMEOUT have the same meaning as for
+     usb_bulk_transfer, they are validated and bound once for all to the
+     returned object.  The transfer is then performed by calling the object
+     as a function:
+
+         n = xfer();
+
+     which yields the number of transferred bytes or a strictly negative
+     error code.  In case of a timeout, the number of bytes transferred so
+     far is returned if it is not zero.  This is the fastest way to
+     repeatedly transfer data with the same endpoint and buffer since there
+     is no argument parsing and no variable reference to update.  Spin mode
+     and statistics of the device (see usb_set_spin and usb_enable_stats)
+     are honored.
+
+     The prepared transfer holds references on the device and on DATA, so
+     they remain valid as long as XFER exists.  The contents of DATA may be
+     changed in place (e.g. with usb_buffer_store), but assigning a new
+     value to the variable which was used to create XFER does not change
+     the bound buffer; using a transfer buffer object (see usb_buffer) for
+     DATA is therefore recommended.  Members XFER.device, XFER.data,
+     XFER.endpoint, XFER.length, XFER.timeout and XFER.type yield the bound
+     parameters, XFER.status yields the result of the last transfer (0 or an
+     error code).
+
+  SEE ALSO: usb_bulk_transfer, usb_interrupt_transfer, usb_buffer.
+ */
+
+extern usb_send_frame;
+/* DOCUMENT ret = usb_send_frame(dev, endpoint, act, nchannels,
+                                 dacmax, timeout);
+
+     Send a frame of actuator commands to a deformable mirror driver (or a
+     similar device) with a single bulk transfer.  The commands ACT are
+     normalized values (float or double), they are clamped to [0,1], scaled
+     to DAC counts in the range [0,DACMAX] (DACMAX is at most 0xFFFF),
+     rounded and packed as 16-bit unsigned little-endian integers.  The frame
+     has NCHANNELS channels (numberof(ACT) if nil), unused channels are set
+     to zero.  ENDPOINT is the output endpoint and TIMEOUT is the timeout in
+     milliseconds (0 for no limit).
+
+     On success, the returned value is the number of bytes actually
+     transferred (2*NCHANNELS if the whole frame has been sent).  On
+     failure, a strictly negative value is returned which is the error code.
+     If called as a subroutine, an error is thrown in case of failure.
+
+  SEE ALSO: usb_bulk_transfer, usb_frame_pipe, bmcusb_send_frame.
+ */
+
+extern usb_frame_pipe;
+extern usb_frame_submit;
+extern usb_frame_wait;
+/* DOCUMENT pipe = usb_frame_pipe(dev, endpoint, nchannels, dacmax,
+                                  sync, timeout);
+         or ret = usb_frame_submit(pipe, act);
+         or ret = usb_frame_wait(pipe);
+         or ret = usb_frame_wait(pipe, timeout);
+
+     A frame pipe uploads frames of actuator commands to a deformable mirror
+     driver without waiting for the transfers to complete.  Arguments DEV,
+     ENDPOINT, NCHANNELS, DACMAX and TIMEOUT have the same meaning as for
+     usb_send_frame (NCHANNELS cannot be nil).  SYNC is nil or a 5-by-2
+     array of integers with the setup of the control transfers which
+     respectively deassert and assert the frame-sync bit of the device (each
+     column is [type, request, value, index, 0] as for usb_control_batch).
+     If SYNC is specified, each frame is sent between deasserting and
+     asserting the frame-sync bit, so that frames are latched by the device
+     only when completely received.
+
+     usb_frame_submit encodes the commands ACT (as usb_send_frame does) and
+     returns immediately.  The pipe has two frame buffers: if no frame is in
+     flight, the new frame is sent at once and 0 is returned; otherwise, the
+     new frame is queued to be sent as soon as the current one has been
+     latched and 1 is returned.  If a frame was already queued, it is
+     replaced by the new one and 2 is returned.  A strictly negative result
+     is the error code of a previously submitted frame (the new frame is
+     nevertheless submitted).  If called as a subroutine, an error is
+     thrown in case of failure.
+
+     usb_frame_wait waits until all submitted frames have been sent or
+     TIMEOUT milliseconds have expired (no limit if TIMEOUT is nil or
+     omitted).  The returned value is 0 on success or an error code.
+
+     Unless the event thread is running (see usb_start_event_thread), the
+     transfers of the pipe only progress when USB events are processed
+     (e.g. by usb_frame_wait or usb_handle_events).
+
+     A frame pipe PIPE has the following members:
+       pipe.pending   - number of frames in flight or queued (0, 1 or 2)
+       pipe.sent      - number of frames sent so far
+       pipe.dropped   - number of queued frames replaced by newer ones
+       pipe.status    - last error code (0 if none)
+       pipe.sync      - whether frame-sync is used
+       pipe.nchannels - number of channels per frame
+       pipe.endpoint  - endpoint address
+       pipe.device    - the USB device
+
+  SEE ALSO: usb_send_frame, usb_control_batch, usb_start_event_thread,
+            bmcusb_frame_pipe.
+ */
+
+extern usb_buffer;
+extern usb_buffer_store;
+/* DOCUMENT buf = usb_buffer(arr);
+         or buf = usb_buffer(dev, size);
+         or usb_buffer_store, buf, data;
+         or usb_buffer_store, buf, data, offset;
+
+     Create a transfer buffer object BUF which can be used in place of the
+     DATA argument of all transfer functions.  Transfer buffers are to be
+     created once and reused for many transfers: their address and size are
+     directly available to the plug-in which saves the argument parsing and
+     type checking of DATA at every call.
+
+     With a single argument, the array ARR (which must be a non-scalar
+     numerical array) is registered as a transfer buffer: transfers are
+     directly done to/from the memory of ARR which is kept alive while BUF
+     exists.  To avoid copies, ARR should be modified in place, e.g.
+     ARR(..) = ..., not re-assigned.
+
+     With two arguments, a buffer of SIZE bytes is allocated for the device
+     DEV.  Where supported by the USB library and the operating system, the
+     memory is allocated by the kernel so that data can be directly DMA'ed
+     to/from the buffer.  Calling BUF() yields a copy of the contents of the
+     buffer as an array of char's.
+
+     The subroutine usb_buffer_store copies the contents of the numerical
+     array DATA (in its native binary layout) into the buffer BUF at offset
+     OFFSET (0 by default) in bytes.  When called as a function, the number
+     of copied bytes is returned.
+
+     A buffer object may be used as a structure object to query some
+     information:
+       buf.size   - size of the buffer in bytes
+       buf.devmem - true if the memory has been allocated by the kernel
+       buf.array  - registered array (nil if none)
+
+  SEE ALSO: usb_bulk_transfer, usb_control_transfer, usb_submit_transfer,
+            usb_pack.
+ */
+
+extern usb_pack;
+extern usb_unpack;
+/* DOCUMENT usb_pack, buf, format, val1, val2, ...;
+         or n = usb_pack(buf, format, val1, val2, ...);
+         or usb_unpack, data, format, var1, var2, ...;
+         or n = usb_unpack(data, format, var1, var2, ...);
+
+     The subroutine usb_pack encodes the values VAL1, VAL2, ... according to
+     FORMAT and writes them from the start of BUF, a transfer buffer (see
+     usb_buffer) or a numerical array which is modified in place.  This
+     builds device payloads (headers, little-endian DAC words, etc.) with no
+     temporary arrays nor conversions in interpreted code.  When called as a
+     function, the number of packed bytes is returned.
+
+     The subroutine usb_unpack decodes the contents of DATA (an array or a
+     transfer buffer) according to FORMAT and stores the decoded values in
+     the variables VAR1, VAR2, ...  When called as a function, the number
+     of decoded bytes is returned.
+
+     FORMAT is a string made of items, each item is a code which may be
+     preceded by a repeat count:
+
+       x - skip a byte (left unchanged by usb_pack)
+       b - signed 8-bit integer      B - unsigned 8-bit integer
+       h - signed 16-bit integer     H - unsigned 16-bit integer
+       i - signed 32-bit integer     I - unsigned 32-bit integer
+       q - signed 64-bit integer     Q - unsigned 64-bit integer
+       f - single precision float    d - double precision float
+
+     The characters '<', '>' and '=' select little-endian, big-endian and
+     native byte order for the next items, little-endian is the default.
+     Spaces are ignored.  For example, ">H 2x <*H" is an unsigned 16-bit
+     big-endian header, 2 ignored bytes and a number of unsigned 16-bit
+     little-endian words.
+
+     Except for "x", each item is associated with the next value or
+     variable.  When packing, an item with no repeat count (or with "*")
+     encodes all the elements of its value, an item with a repeat count N
+     encodes the N elements of its value or repeats a scalar value N times.
+     Integer codes saturate the values to their range and round
+     floating-point values to the nearest integer (NaN's yield 0).  When
+     unpacking, an item with no repeat count yields a scalar, an item with
+     a repeat count N yields a vector of N elements and an item with "*"
+     consumes all the remaining elements.  Integer codes of at most 16 bits
+     and "i" yield int's, "I", "q" and "Q" yield long's, "f" yields float's
+     and "d" yields double's.
+
+     An error is thrown before anything is written if the packed data do
+     not fit in BUF, or if DATA is too short or the variables do not match
+     the format.
+
+   EXAMPLE:
+     buf = usb_buffer(dev, 2*nchannels + 4);
+     usb_pack, buf, ">H H *H", 0xA55A, nchannels, dac;
+     usb_bulk_transfer, dev, ep, buf, buf.size, xfer, 100;
+
+   SEE ALSO: usb_buffer, usb_send_frame, usb_bulk_transfer.
+ */
+
+extern usb_submit_transfer;
+/* DOCUMENT tr = usb_submit_transfer(dev, endpoint, data, length, timeout);
+         or tr = usb_submit_transfer(dev, endpoint, data, length, timeout,
+                                     type);
+
+     Submit an asynchronous USB transfer and return immediately with a
+     transfer object TR which can be used to query the progress of the
+     transfer.  The direction of the transfer is inferred from the direction
+     bits of the endpoint address.  Arguments DEV, ENDPOINT, DATA, LENGTH and
+     TIMEOUT are the same as for usb_bulk_transfer.  Optional argument TYPE
+     is the type of transfer: USB_TRANSFER_TYPE_BULK (the default) or
+     USB_TRANSFER_TYPE_INTERRUPT.
+
+     The transfer is directly performed in (or from) the contents of the
+     DATA array, which must therefore be an array variable and which should
+     not be modified by the caller until the transfer has completed.  The
+     transfer object keeps a reference on DATA and on the device DEV so that
+     they stay alive while the transfer is in flight.
+
+     Completion of the transfer requires that USB events are processed, this
+     is automatically done by usb_wait_transfer and usb_test_transfer or can
+     be explicitly done by calling usb_handle_events.
+
+     The transfer object may be used as a structure object to query some
+     information:
+       tr.pending     - true if transfer has not yet completed
+       tr.status      - result of the transfer (0 or an error code), only
+                        meaningful once the transfer has completed
+       tr.transferred - number of transferred bytes, only meaningful once
+                        the transfer has completed
+       tr.length      - number of bytes to transfer
+       tr.endpoint    - endpoint address
+       tr.device      - USB device
+
+     Destroying a pending transfer object (i.e., when it is no longer
+     referenced) cancels the transfer and waits for its completion.
+
+   EXAMPLE
+     tr = usb_submit_transfer(dev, endpoint, buf, sizeof(buf), 1000);
+     ... // do something else
+     ret = usb_wait_transfer(tr);
+     if (ret != USB_SUCCESS) usb_error, "transfer failed", ret;
+     nbytes = tr.transferred;
+
+  SEE ALSO: usb_wait_transfer, usb_test_transfer, usb_cancel_transfer,
+            usb_handle_events, usb_bulk_transfer, usb_interrupt_transfer.
+ */
+
+extern usb_wait_transfer;
+/* DOCUMENT ret = usb_wait_transfer(tr);
+         or ret = usb_wait_transfer(tr, timeout);
+
+     Wait for the completion of the asynchronous USB transfer TR and return
+     its status: 0 on success, a strictly negative error code on failure.  If
+     the transfer timed out with some data transferred, USB_ERROR_TIMEOUT is
+     returned and TR.transferred gives the number of bytes actually
+     transferred.  If optional argument TIMEOUT is specified and not nil, it
+     is the maximum number of milliseconds to wait, if the transfer has not
+     completed by then, USB_ERROR_TIMEOUT is returned and TR.pending is still
+     true.  If called as a subroutine, an error is thrown in case of failure
+     (but not for a timeout with partially transferred data).
+
+  SEE ALSO: usb_submit_transfer, usb_test_transfer.
+ */
+
+extern usb_test_transfer;
+/* DOCUMENT bool = usb_test_transfer(tr);
+     Process pending USB events without blocking and return whether the
+     asynchronous USB transfer TR has completed.
+
+  SEE ALSO: usb_submit_transfer, usb_wait_transfer.
+ */
+
+extern usb_cancel_transfer;
+/* DOCUMENT ret = usb_cancel_transfer(tr);
+     Request cancellation of the asynchronous USB transfer TR.  The
+     cancellation is asynchronous: it is only effective when TR.pending
+     becomes false (e.g., after calling usb_wait_transfer), in which case
+     TR.status is USB_ERROR_INTERRUPTED unless the transfer completed
+     before being cancelled.  The returned value is 0 on success or
+     USB_ERROR_NOT_FOUND if the transfer is not in progress.  If called as a
+     subroutine, an error is thrown in case of other failures.
+
+  SEE ALSO: usb_submit_transfer, usb_wait_transfer.
+ */
+
+extern usb_handle_events;
+/* DOCUMENT ret = usb_handle_events(timeout);
+         or ret = usb_handle_events(timeout, ctx);
+     Process pending USB events, waiting at most TIMEOUT milliseconds for
+     events to occur.  Optional argument CTX is the libusb context (see
+     usb_new_context) whose events are to be processed, the default context
+     is assumed if CTX is omitted or nil.  If TIMEOUT is 0, the call is
+     non-blocking; if TIMEOUT is nil, the call blocks until some events are
+     processed.  This is needed to complete asynchronous transfers.  The
+     returned value is 0 on success or a strictly negative error code.  If
+     called as a subroutine, an error is thrown in case of failure.
+
+  SEE ALSO: usb_submit_transfer, usb_wait_transfer.
+ */
+
+extern usb_start_event_thread;
+extern usb_stop_event_thread;
+extern usb_event_thread;
+/* DOCUMENT usb_start_event_thread;
+         or usb_start_event_thread, ctx;
+         or usb_stop_event_thread;
+         or usb_stop_event_thread, ctx;
+         or bool = usb_event_thread();
+         or bool = usb_event_thread(ctx);
+
+     The subroutine usb_start_event_thread starts a thread dedicated to the
+     processing of USB events, so that asynchronous transfers complete
+     without the need to call usb_handle_events, usb_test_transfer or
+     usb_wait_transfer.  The subroutine usb_stop_event_thread stops this
+     thread.  The function usb_event_thread() yields whether the event
+     thread is running.  Starting an already running thread or stopping a
+     non-running thread has no effects.  The event thread is automatically
+     stopped when Yorick quits.  Each libusb context has its own event
+     thread, argument CTX is the context (see usb_new_context), the default
+     context is assumed if CTX is nil.
+
+     When the event thread is running, the completion of an asynchronous
+     transfer TR can be cheaply checked with TR.pending or by comparing
+     successive values of usb_completions().
+
+  SEE ALSO: usb_submit_transfer, usb_completions, usb_attach_events,
+            usb_set_io_thread_params.
+ */
+
+func usb_set_io_thread_params(nil, priority=, policy=, cpu=, mlock=, context=)
+/* DOCUMENT usb_set_io_thread_params, priority=, policy=, cpu=, mlock=,
+                                      context=;
+
+     Set the scheduling parameters of the I/O thread which processes USB
+     events (see usb_start_event_thread).  Keyword PRIORITY is the
+     scheduling priority, keyword POLICY is the scheduling policy (one of
+     USB_SCHED_FIFO, USB_SCHED_RR or USB_SCHED_OTHER); if only PRIORITY is
+     specified, the real-time policy USB_SCHED_FIFO is assumed for a
+     strictly positive priority; if only POLICY is specified, the current
+     priority is kept (bounded to the range allowed by the policy).  Keyword
+     CPU is the index (starting at 0) of the processor the thread is bound
+     to, a negative value lets the thread run again on any processor; CPU
+     affinity is only supported on Linux.  Unspecified parameters are left
+     unchanged.
+
+     The parameters are remembered by the context (keyword CONTEXT, the
+     default context if nil) and applied to the event thread immediately if
+     it is running, or as soon as it is started.
+
+     If keyword MLOCK is true, all the memory pages of the process, current
+     and future, are locked in memory (see mlockall(2)) so that the
+     transfer buffers and the stack of the I/O thread can never be paged
+     out; if MLOCK is false, the pages are unlocked.
+
+     Real-time scheduling and locking memory usually require privileges
+     (e.g. CAP_SYS_NICE and CAP_IPC_LOCK or suitable limits in
+     /etc/security/limits.conf), an error is thrown if the operation is not
+     permitted.
+
+  SEE ALSO: usb_start_event_thread, usb_set_spin.
+ */
+{
+  _usb_set_io_thread_params, context, policy, priority, cpu, mlock;
+}
+extern _usb_set_io_thread_params;
+
+local USB_SCHED_OTHER, USB_SCHED_FIFO, USB_SCHED_RR;
+/* DOCUMENT USB_SCHED_OTHER, USB_SCHED_FIFO, USB_SCHED_RR;
+     Scheduling policies for the I/O thread: the default time-sharing
+     policy, and the first-in first-out and round-robin real-time policies.
+
+  SEE ALSO: usb_set_io_thread_params.
+ */
+
+extern usb_attach_events;
+extern usb_detach_events;
+extern usb_events_attached;
+/* DOCUMENT usb_attach_events;
+         or usb_attach_events, ctx;
+         or usb_detach_events;
+         or usb_detach_events, ctx;
+         or bool = usb_events_attached();
+         or bool = usb_events_attached(ctx);
+
+     The subroutine usb_attach_events registers the USB events of the libusb
+     context CTX (the default context if CTX is nil, see usb_new_context)
+     with Yorick's event loop.  USB events, including the completion
+     callbacks of asynchronous transfers and streams, are then processed by
+     Yorick whenever it is idle (e.g. while waiting for keyboard input or
+     between the callbacks scheduled by 'after') without blocking the
+     interactive session nor the graphics.  The subroutine usb_detach_events
+     undoes this.  The function usb_events_attached yields whether the
+     events of CTX are attached to Yorick's event loop.
+
+     Unlike the event thread (see usb_start_event_thread), the completion
+     callbacks are called by the interpreter thread.  A helper thread polls
+     the file descriptors of libusb (and takes care of libusb timeouts) and
+     notifies Yorick when there are events to process.
+
+  SEE ALSO: usb_start_event_thread, usb_handle_events, after.
+ */
+
+extern usb_completions;
+/* DOCUMENT n = usb_completions();
+     Get the total number of asynchronous USB transfers completed so far.
+
+  SEE ALSO: usb_submit_transfer, usb_start_event_thread.
+ */
+
+extern usb_stream_start;
+extern usb_iso_stream_start;
+extern usb_stream_read;
+extern usb_stream_stop;
+/* DOCUMENT s = usb_stream_start(dev, endpoint, bufsize, nbufs);
+         or s = usb_iso_stream_start(dev, endpoint, packet_size,
+                                     npackets, nbufs);
+         or data = usb_stream_read(s);
+         or data = usb_stream_read(s, timeout);
+         or data = usb_stream_read(s, timeout, lengths);
+         or data = usb_stream_read(s, timeout, lengths, status);
+         or usb_stream_stop, s;
+
+     Manage continuous streaming from an input bulk or isochronous endpoint.
+
+     The function usb_stream_start starts streaming from input endpoint
+     ENDPOINT of USB device DEV and returns a stream object S.  The plug-in
+     keeps NBUFS asynchronous transfers of BUFSIZE bytes always queued on the
+     endpoint so that it is never idle.  Received data are stored in a ring
+     of NBUFS buffers owned by the plug-in until they are read.  If BUFSIZE
+     and/or NBUFS are nil, they are chosen according to the speed of the
+     device (see DEV.speed) with BUFSIZE a multiple of the maximum packet
+     size of the endpoint (see DEV.endpoints).
+
+     The function usb_stream_read returns the contents of the oldest filled
+     buffer as an array of char's (whose length is the number of received
+     bytes) and recycles the buffer.  If no data is available, it waits at
+     most TIMEOUT milliseconds (forever if TIMEOUT is nil or not specified)
+     and returns nil if no data arrived in time.  An error is thrown if the
+     stream is no longer active and all received data have been read.
+     Optional arguments LENGTHS and STATUS are variables to store the actual
+     lengths and the status (0 or an error code) of the packets in the
+     returned buffer (see below).
+
+     The function usb_iso_stream_start starts streaming from an input
+     isochronous endpoint.  Each buffer consists in NPACKETS packets of
+     PACKET_SIZE bytes (if PACKET_SIZE is nil, the maximum packet size of the
+     endpoint is used) and NBUFS isochronous transfers are kept queued.  For
+     isochronous streams, usb_stream_read returns a PACKET_SIZE-by-NPACKETS
+     array of char's and the LENGTHS and STATUS variables are set with arrays
+     of NPACKETS integers.  For bulk streams, they are set with a single
+     value.  For instance:
+
+       s = usb_iso_stream_start(dev, 0x82, [], 32, 8);
+       data = usb_stream_read(s, 100, len, status);
+       for (k = 1; k <= numberof(len); ++k) {
+         if (status(k) == USB_SUCCESS && len(k) > 0) {
+           packet = data(1:len(k), k);
+           ...
+         }
+       }
+
+     The subroutine usb_stream_stop cancels all queued transfers and waits
+     for them to complete.  Buffers already received can still be read.
+     Streaming is also stopped when the stream object is destroyed.
+
+     The stream object may be used as a structure object to query some
+     information:
+       s.received - number of buffers received so far
+       s.bytes    - number of bytes received so far
+       s.ready    - number of filled buffers waiting to be read
+       s.overruns - number of buffers dropped because the ring was full
+       s.errors   - number of transfers which failed
+       s.status   - last error code
+       s.active   - number of transfers in flight
+       s.bufsize  - size of buffers (in bytes)
+       s.nbufs    - number of buffers
+       s.npackets - number of packets per buffer (0 for bulk streams)
+       s.packet_size - size of isochronous packets (0 for bulk streams)
+       s.type     - USB_TRANSFER_TYPE_BULK or USB_TRANSFER_TYPE_ISOCHRONOUS
+       s.endpoint - endpoint address
+       s.device   - USB device
+
+     Unless the event thread is running (see usb_start_event_thread), USB
+     events are only processed by usb_stream_read (and other functions
+     calling usb_handle_events), so the stream must be read often enough to
+     avoid overruns.
+
+  SEE ALSO: usb_bulk_transfer, usb_submit_transfer, usb_start_event_thread.
+ */
+
+local USB_TRANSFER_TYPE_CONTROL, USB_TRANSFER_TYPE_ISOCHRONOUS;
+local USB_TRANSFER_TYPE_BULK, USB_TRANSFER_TYPE_INTERRUPT;
+/* DOCUMENT USB_TRANSFER_TYPE_CONTROL, USB_TRANSFER_TYPE_ISOCHRONOUS,
+            USB_TRANSFER_TYPE_BULK, USB_TRANSFER_TYPE_INTERRUPT;
+     Constants for the different types of USB transfers.
+
+  SEE ALSO: usb_submit_transfer.
+ */
+
 local USB_SUCCESS, USB_ERROR_IO, USB_ERROR_INVALID_PARAM, USB_ERROR_ACCESS;
 local USB_ERROR_NO_DEVICE, USB_ERROR_NOT_FOUND, USB_ERROR_BUSY;
 local USB_ERROR_TIMEOUT, USB_ERROR_OVERFLOW, USB_ERROR_PIPE;
@@ -322,6 +1480,16 @@ extern usb_debug;
    SEE ALSO: usb_probe_devices, usb_open_device.
  */
 
+extern usb_clock;
+/* DOCUMENT t = usb_clock();
+     Get the time in seconds given by the monotonic clock used for the
+     transfer statistics.  The origin of time is arbitrary but fixed, so
+     only differences of times are meaningful.  The resolution is at least
+     one microsecond.
+
+  SEE ALSO: usb_enable_stats, timer.
+ */
+
 extern _usb_init;
 /* DOCUMENT _usb_init;
      Initialize internals and define constants.  Automatically called,
@@ -30,9 +30,22 @@
  * -----------------------------------------------------------------------------
  */
 
+#ifdef __linux__
+#  define _GNU_SOURCE /* for CPU affinity */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <pstdlib.h>
 #include <yapi.h>
@@ -42,6 +55,15 @@
 #define TRUE  1
 #define FALSE 0
 
+/* Features depending on the version of the USB library. */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+#  define HAVE_LIBUSB_HOTPLUG 1
+#endif
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#  define HAVE_LIBUSB_DEV_MEM 1
+#  define HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER 1
+#endif
+
 /* Define some macros to get rid of some GNU extensions when not compiling
    with GCC. */
 #if ! (defined(__GNUC__) && __GNUC__ > 1)
@@ -54,13 +76,159 @@
 PLUG_API void y_error(const char *) __attribute__ ((noreturn));
 static void push_string(const char* str);
 
-/* For now there is a single libusb context for a given Yorick session. */
-static libusb_context* ctx = NULL;
-static libusb_device** dev_list = NULL;
-static ssize_t dev_count = 0;
+/* Information about the devices in the cached list (in the same order).
+   String descriptors are fetched on demand and kept across refreshes of the
+   list for devices with the same bus, address, vendor and product. */
+#define DEV_STRINGS 3 /* manufacturer, product and serial number */
+typedef struct _dev_info dev_info_t;
+struct _dev_info {
+  libusb_device* device;
+  struct libusb_device_descriptor descriptor;
+  int bus;
+  int port;
+  int address;
+  int speed;
+  int fetched; /* string descriptors have been fetched */
+  char* strings[DEV_STRINGS];
+  char path[64]; /* port path */
+};
+
+/* A libusb context with its cached list of devices and its optional event
+   thread.  There is a default context for a given Yorick session, more
+   contexts can be created with usb_new_context so that independent groups
+   of devices do not share the same event handling and locks.  The device
+   table (DEV_LIST, DEV_INFO and the hash tables) is only rebuilt by the
+   interpreter, while owning DEV_MUTEX; other threads must own DEV_MUTEX to
+   read the table. */
+typedef struct _context context_t;
+struct _context {
+  libusb_context* ctx;
+  libusb_device** dev_list;
+  ssize_t dev_count;
+  pthread_mutex_t dev_mutex; /* protects the device table */
+
+  /* The list of devices is cached and only refreshed when it is stale.  If
+     hotplug notifications are supported, the list becomes stale when a
+     device arrives or leaves; otherwise, it is always considered as
+     stale. */
+  volatile int dev_list_stale;
+  int hotplug_supported;
+  int mock; /* simulated devices (see usb_new_context) */
+#ifdef HAVE_LIBUSB_HOTPLUG
+  libusb_hotplug_callback_handle hotplug_handle;
+#endif
+
+  dev_info_t* dev_info;
+  ssize_t dev_info_count;
+
+  /* Hash tables to quickly find devices by vendor/product identifiers and
+     by port path.  Entries are indices in the device list plus one (zero
+     for empty slots), collisions are resolved by linear probing. */
+  int* id_index;
+  int* path_index;
+  unsigned int index_mask;
+
+  /* Optional thread dedicated to processing USB events (see
+     usb_start_event_thread). */
+  pthread_t event_thread;
+  int event_thread_started;
+  volatile int event_thread_quit;
+  int io_policy;   /* scheduling policy of the event thread */
+  int io_priority; /* scheduling priority of the event thread */
+  int io_cpu;      /* CPU of the event thread, -1 for any */
+  int io_params;   /* scheduling parameters have been set */
+
+  /* Integration in Yorick's event loop (see usb_attach_events). */
+  int watching;
+  int notify_pipe[2]; /* helper thread -> interpreter */
+  int watch_pipe[2];  /* to wake up the helper thread */
+  pthread_t watch_thread;
+  pthread_mutex_t watch_mutex;
+  pthread_cond_t watch_cond;
+  volatile int watch_pending;
+  volatile int watch_quit;
+};
+#define WATCHER_MAX_FDS 64
+
+static context_t default_context;
 
 static void initialize();
-#define INITIALIZE if (ctx != NULL) ; else initialize()
+#define INITIALIZE if (default_context.ctx != NULL) ; else initialize()
+
+static void get_time(struct timespec* ts);
+
+static void stop_event_thread(context_t* uc);
+static void detach_events(context_t* uc);
+static int pin_interpreter(int cpu);
+static void load_mock_devices(context_t* uc);
+static void fetch_dev_strings(context_t* uc, ssize_t i);
+
+/* Simulated device (see MOCK BACKEND). */
+typedef struct _mock_device mock_device_t;
+
+/* Description of an endpoint of the active configuration of a device. */
+typedef struct _endpoint_info endpoint_info_t;
+struct _endpoint_info {
+  int address;
+  int type;            /* transfer type */
+  int max_packet_size; /* maximum packet size (in bytes) */
+  int interval;        /* polling interval (bInterval) */
+  int interface;       /* interface number */
+  int altsetting;      /* alternate setting */
+};
+
+/* Recovery policies (see ERROR RECOVERY). */
+#define RECOVER_CLEAR_HALT (1 << 0)
+#define RECOVER_RESET      (1 << 1)
+#define RECOVER_RECLAIM    (1 << 2)
+
+/* Number of asynchronous transfers completed so far.  Completion callbacks
+   of a given context are only called by the thread holding its event lock,
+   but the callbacks of different contexts (each with its own event thread)
+   may run concurrently, so the counter is atomically incremented. */
+static volatile unsigned long completion_count = 0;
+#if defined(__GNUC__)
+#  define COUNT_COMPLETION() __sync_fetch_and_add(&completion_count, 1UL)
+#else
+static pthread_mutex_t completion_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define COUNT_COMPLETION() count_completion()
+static void count_completion(void)
+{
+  pthread_mutex_lock(&completion_mutex);
+  completion_count += 1;
+  pthread_mutex_unlock(&completion_mutex);
+}
+#endif
+
+/* Tracing points (see TRACING).  When tracing is disabled, a tracing point
+   costs a single, well predicted, branch; tracing points can also be
+   compiled out by defining YUSB_NO_TRACE. */
+#ifdef YUSB_NO_TRACE
+#  define TRACE_START(t0) ((void)&(t0))
+#  define TRACE_EVENT(name, t0, arg, length, result) ((void)&(t0))
+#else
+#  if defined(__GNUC__)
+#    define TRACE_UNLIKELY(expr) __builtin_expect((expr) != 0, 0)
+#  else
+#    define TRACE_UNLIKELY(expr) (expr)
+#  endif
+static volatile int trace_enabled = FALSE;
+static void trace_event(const char* name, const struct timespec* t0,
+                        int arg, int length, int result);
+#  if defined(__GNUC__)
+#    define TRACE_BARRIER() __sync_synchronize()
+#  else
+#    define TRACE_BARRIER()
+#  endif
+#  define TRACE_START(t0)                                       \
+  do { if (TRACE_UNLIKELY(trace_enabled)) get_time(&(t0)); } while (0)
+#  define TRACE_EVENT(name, t0, arg, length, result)            \
+  do {                                                          \
+    if (TRACE_UNLIKELY(trace_enabled)) {                        \
+      trace_event(name, &(t0), arg, length, result);            \
+    }                                                           \
+  } while (0)
+#endif
 
 #define _JOIN(a,b) a ## b
 #define JOIN2(a,b) _JOIN(a,b)
@@ -115,13 +283,15 @@ void Y_usb_error_description(int argc)
   push_string(get_error_description(ygets_i(0)));
 }
 
+/* The message is formatted in a local buffer (y_error copies it), so that
+   this is reentrant. */
 static void failure(const char* reason, int code)
 {
-  static char msg[256];
+  char msg[256];
   if (reason == NULL || reason[0] == 0) {
     y_error(get_error_description(code));
   } else {
-    sprintf(msg, "%s [%s]",  reason, get_error_name(code));
+    sprintf(msg, "%.200s [%s]",  reason, get_error_name(code));
     y_error(msg);
   }
 }
@@ -131,51 +301,333 @@ static void push_string(const char* str)
   ypush_q(NULL)[0] = p_strcpy(str);
 }
 
-static void free_dev_list(void)
+static void free_dev_list(context_t* uc)
 {
-  if (dev_count > 0) {
-    dev_count = 0;
-    libusb_free_device_list(dev_list, 1);
+  if (uc->dev_count > 0) {
+    uc->dev_count = 0;
+    libusb_free_device_list(uc->dev_list, 1);
   }
+  uc->dev_list_stale = TRUE;
 }
 
-static void load_device_list(void)
+/* Format the port path of a device as "BUS-PORT.PORT...". */
+static void format_port_path(char* buf, libusb_device* dev)
 {
-  INITIALIZE;
-  free_dev_list(); /* in case of interrupts */
-  dev_count = libusb_get_device_list(ctx, &dev_list);
-  if (dev_count < 0) {
+  uint8_t ports[8];
+  int k, n;
+  n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+  buf += sprintf(buf, "%d", (int)libusb_get_bus_number(dev));
+  for (k = 0; k < n; ++k) {
+    buf += sprintf(buf, (k == 0 ? "-%d" : ".%d"), (int)ports[k]);
+  }
+}
+
+static unsigned int hash_id(int vendor, int product)
+{
+  return ((unsigned int)vendor*40503U) ^ ((unsigned int)product*2654435769U);
+}
+
+static unsigned int hash_path(const char* str)
+{
+  unsigned int h = 2166136261U;
+  while (*str != '\0') {
+    h = (h ^ (unsigned char)*str++)*16777619U;
+  }
+  return h;
+}
+
+static void free_dev_index(context_t* uc)
+{
+  if (uc->id_index != NULL) {
+    p_free(uc->id_index);
+    uc->id_index = NULL;
+  }
+  if (uc->path_index != NULL) {
+    p_free(uc->path_index);
+    uc->path_index = NULL;
+  }
+  uc->index_mask = 0;
+}
+
+static void insert_index(int* table, unsigned int mask, unsigned int h, int i)
+{
+  h &= mask;
+  while (table[h] != 0) {
+    h = (h + 1) & mask;
+  }
+  table[h] = i + 1;
+}
+
+static void build_dev_index(context_t* uc)
+{
+  const dev_info_t* info;
+  unsigned int size;
+  ssize_t i;
+
+  free_dev_index(uc);
+  for (size = 16; size < 2*uc->dev_info_count; size *= 2)
+    ;
+  uc->id_index = (int*)p_malloc(size*sizeof(int));
+  uc->path_index = (int*)p_malloc(size*sizeof(int));
+  memset(uc->id_index, 0, size*sizeof(int));
+  memset(uc->path_index, 0, size*sizeof(int));
+  uc->index_mask = size - 1;
+  for (i = 0; i < uc->dev_info_count; ++i) {
+    info = &uc->dev_info[i];
+    insert_index(uc->id_index, uc->index_mask,
+                 hash_id(info->descriptor.idVendor,
+                         info->descriptor.idProduct), i);
+    insert_index(uc->path_index, uc->index_mask, hash_path(info->path), i);
+  }
+}
+
+/* Find the next device in the list matching vendor and product identifiers.
+   SLOT is the position in the hash table (initialized to -1 before the first
+   call).  Returns the index of the device in the list, -1 if no more
+   devices match. */
+static ssize_t find_by_id(context_t* uc, int vendor, int product, long* slot)
+{
+  const dev_info_t* info = uc->dev_info;
+  unsigned int h, mask = uc->index_mask;
+  int i;
+  if (uc->id_index == NULL) {
+    return -1;
+  }
+  h = (*slot < 0 ? hash_id(vendor, product) : (unsigned int)*slot + 1);
+  for (h &= mask; (i = uc->id_index[h]) != 0; h = (h + 1) & mask) {
+    if (info[i - 1].descriptor.idVendor == vendor &&
+        info[i - 1].descriptor.idProduct == product) {
+      *slot = h;
+      return i - 1;
+    }
+  }
+  return -1;
+}
+
+static ssize_t find_by_path(context_t* uc, const char* path)
+{
+  unsigned int h, mask = uc->index_mask;
+  int i;
+  if (uc->path_index == NULL) {
+    return -1;
+  }
+  h = hash_path(path);
+  for (h &= mask; (i = uc->path_index[h]) != 0; h = (h + 1) & mask) {
+    if (strcmp(uc->dev_info[i - 1].path, path) == 0) {
+      return i - 1;
+    }
+  }
+  return -1;
+}
+
+static void free_dev_info(dev_info_t* info, ssize_t count)
+{
+  ssize_t i;
+  int k;
+  if (info != NULL) {
+    for (i = 0; i < count; ++i) {
+      for (k = 0; k < DEV_STRINGS; ++k) {
+        if (info[i].strings[k] != NULL) {
+          p_free(info[i].strings[k]);
+        }
+      }
+    }
+    p_free(info);
+  }
+}
+
+/* Rebuild the table of device information after the list of devices has
+   been refreshed, retrieving the strings of already known devices. */
+static void update_dev_info(context_t* uc)
+{
+  dev_info_t* old_info = uc->dev_info;
+  dev_info_t* new_info;
+  libusb_device** list = uc->dev_list;
+  ssize_t old_count = uc->dev_info_count;
+  ssize_t count = uc->dev_count;
+  ssize_t i, j;
+  int k;
+
+  uc->dev_info = NULL;
+  uc->dev_info_count = 0;
+  new_info = (dev_info_t*)p_malloc((count > 0 ? count : 1)*
+                                   sizeof(dev_info_t));
+  memset(new_info, 0, (count > 0 ? count : 1)*sizeof(dev_info_t));
+  for (i = 0; i < count; ++i) {
+    dev_info_t* item = &new_info[i];
+    item->device = list[i];
+    item->bus = libusb_get_bus_number(list[i]);
+    item->port = libusb_get_port_number(list[i]);
+    item->address = libusb_get_device_address(list[i]);
+    item->speed = libusb_get_device_speed(list[i]);
+    format_port_path(item->path, list[i]);
+    if (libusb_get_device_descriptor(list[i], &item->descriptor) != 0) {
+      memset(&item->descriptor, 0, sizeof(item->descriptor));
+    }
+    for (j = 0; j < old_count; ++j) {
+      dev_info_t* prev = &old_info[j];
+      if (prev->fetched && prev->bus == item->bus &&
+          prev->address == item->address &&
+          prev->descriptor.idVendor == item->descriptor.idVendor &&
+          prev->descriptor.idProduct == item->descriptor.idProduct) {
+        item->fetched = TRUE;
+        for (k = 0; k < DEV_STRINGS; ++k) {
+          item->strings[k] = prev->strings[k];
+          prev->strings[k] = NULL;
+        }
+        break;
+      }
+    }
+  }
+  uc->dev_info = new_info;
+  uc->dev_info_count = count;
+  free_dev_info(old_info, old_count);
+  build_dev_index(uc);
+}
+
+static void load_device_list(context_t* uc)
+{
+  struct timespec t0;
+
+  if (uc->mock) {
+    if (uc->dev_list_stale) {
+      uc->dev_list_stale = FALSE;
+      pthread_mutex_lock(&uc->dev_mutex);
+      load_mock_devices(uc);
+      pthread_mutex_unlock(&uc->dev_mutex);
+    }
+    return;
+  }
+  if (uc->hotplug_supported) {
+    if (! uc->event_thread_started) {
+      /* Deliver pending hotplug notifications. */
+      struct timeval tv;
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
+      libusb_handle_events_timeout_completed(uc->ctx, &tv, NULL);
+    }
+    if (! uc->dev_list_stale) {
+      return;
+    }
+  }
+  pthread_mutex_lock(&uc->dev_mutex);
+  free_dev_list(uc); /* in case of interrupts */
+  uc->dev_list_stale = FALSE;
+  TRACE_START(t0);
+  uc->dev_count = libusb_get_device_list(uc->ctx, &uc->dev_list);
+  TRACE_EVENT("get_device_list", t0, 0, 0, (int)uc->dev_count);
+  if (uc->dev_count < 0) {
+    uc->dev_count = 0;
+    uc->dev_list_stale = TRUE;
+    pthread_mutex_unlock(&uc->dev_mutex);
     y_error("failed to get USB devices list");
   }
+  update_dev_info(uc);
+  pthread_mutex_unlock(&uc->dev_mutex);
 }
 
-/* must only be called on exit, so interrupts do not matter here */
-static void finalize(void)
+#ifdef HAVE_LIBUSB_HOTPLUG
+static int LIBUSB_CALL on_hotplug(libusb_context* context,
+                                  libusb_device* device,
+                                  libusb_hotplug_event event,
+                                  void* user_data)
+{
+  ((context_t*)user_data)->dev_list_stale = TRUE;
+  return 0; /* keep the callback registered */
+}
+#endif
+
+/* Initialize a libusb context, with simulated devices if MOCK is true.
+   Return 0 on success or a libusb error code. */
+static int init_context(context_t* uc, int mock)
+{
+  int code = libusb_init(&uc->ctx);
+  if (code != 0) {
+    uc->ctx = NULL;
+    return code;
+  }
+  if (uc->ctx == NULL) {
+    y_error("*** ASSERTION FAILED *** NULL context on libusb_init success");
+  }
+  if (pthread_mutex_init(&uc->dev_mutex, NULL) != 0) {
+    libusb_exit(uc->ctx);
+    uc->ctx = NULL;
+    return LIBUSB_ERROR_OTHER;
+  }
+  uc->dev_list_stale = TRUE;
+  uc->io_cpu = -1;
+  uc->mock = mock;
+  libusb_set_debug(uc->ctx, LIBUSB_LOG_LEVEL_NONE);
+#ifdef HAVE_LIBUSB_HOTPLUG
+  if (! mock && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+      libusb_hotplug_register_callback(uc->ctx,
+                                       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                       LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                       LIBUSB_HOTPLUG_NO_FLAGS,
+                                       LIBUSB_HOTPLUG_MATCH_ANY,
+                                       LIBUSB_HOTPLUG_MATCH_ANY,
+                                       LIBUSB_HOTPLUG_MATCH_ANY,
+                                       on_hotplug, uc,
+                                       &uc->hotplug_handle) == 0) {
+    uc->hotplug_supported = TRUE;
+  }
+#endif
+  return 0;
+}
+
+/* Release all resources of a libusb context. */
+static void destroy_context(context_t* uc)
 {
   /* in case of interrupts copy address in a temporary variable */
-  libusb_context* tmp = ctx;
-  ctx = NULL;
-  free_dev_list();
-  if (tmp != NULL) {
-    libusb_exit(tmp);
+  libusb_context* tmp = uc->ctx;
+  if (tmp == NULL) {
+    return;
   }
+  detach_events(uc);
+  stop_event_thread(uc);
+#ifdef HAVE_LIBUSB_HOTPLUG
+  if (uc->hotplug_supported) {
+    uc->hotplug_supported = FALSE;
+    libusb_hotplug_deregister_callback(tmp, uc->hotplug_handle);
+  }
+#endif
+  pthread_mutex_lock(&uc->dev_mutex);
+  free_dev_list(uc);
+  free_dev_info(uc->dev_info, uc->dev_info_count);
+  uc->dev_info = NULL;
+  uc->dev_info_count = 0;
+  free_dev_index(uc);
+  pthread_mutex_unlock(&uc->dev_mutex);
+  pthread_mutex_destroy(&uc->dev_mutex);
+  uc->ctx = NULL;
+  libusb_exit(tmp);
+}
+
+/* must only be called on exit, so interrupts do not matter here */
+static void finalize(void)
+{
+  destroy_context(&default_context);
 }
 
 static void initialize(void)
 {
-  if (ctx == NULL) {
-    int code = libusb_init(&ctx);
+  if (default_context.ctx == NULL) {
+    const char* backend = getenv("YUSB_BACKEND");
+    int mock, code;
+    if (backend == NULL || backend[0] == '\0' ||
+        strcmp(backend, "libusb") == 0) {
+      mock = FALSE;
+    } else if (strcmp(backend, "mock") == 0) {
+      mock = TRUE;
+    } else {
+      y_error("unknown USB backend in environment variable YUSB_BACKEND");
+      return;
+    }
+    code = init_context(&default_context, mock);
     if (code != 0) {
-      if (ctx != NULL) {
-        y_error("*** ASSERTION FAILED *** non NULL context on libusb_init failure");
-      }
       failure(NULL, code);
     }
-    if (ctx == NULL) {
-      y_error("*** ASSERTION FAILED *** NULL context on libusb_init success");
-    }
     ycall_on_quit(finalize);
-    libusb_set_debug(ctx, LIBUSB_LOG_LEVEL_NONE);
     libusb_setlocale("en");
   }
 }
@@ -203,6 +655,23 @@ void Y__usb_init(int argc)
 #undef ERROR_ENTRY
 #define ERROR_ENTRY(a,b) define_global_int("USB_"#a, LIBUSB_##a);
   ERROR_TABLE;
+  define_global_int("USB_TRANSFER_TYPE_CONTROL", LIBUSB_TRANSFER_TYPE_CONTROL);
+  define_global_int("USB_TRANSFER_TYPE_ISOCHRONOUS",
+                    LIBUSB_TRANSFER_TYPE_ISOCHRONOUS);
+  define_global_int("USB_TRANSFER_TYPE_BULK", LIBUSB_TRANSFER_TYPE_BULK);
+  define_global_int("USB_TRANSFER_TYPE_INTERRUPT",
+                    LIBUSB_TRANSFER_TYPE_INTERRUPT);
+  define_global_int("USB_RECOVER_CLEAR_HALT", RECOVER_CLEAR_HALT);
+  define_global_int("USB_RECOVER_RESET", RECOVER_RESET);
+  define_global_int("USB_RECOVER_RECLAIM", RECOVER_RECLAIM);
+  define_global_int("USB_SCHED_OTHER", SCHED_OTHER);
+  define_global_int("USB_SCHED_FIFO", SCHED_FIFO);
+  define_global_int("USB_SCHED_RR", SCHED_RR);
+  define_global_int("USB_SPEED_UNKNOWN", LIBUSB_SPEED_UNKNOWN);
+  define_global_int("USB_SPEED_LOW", LIBUSB_SPEED_LOW);
+  define_global_int("USB_SPEED_FULL", LIBUSB_SPEED_FULL);
+  define_global_int("USB_SPEED_HIGH", LIBUSB_SPEED_HIGH);
+  define_global_int("USB_SPEED_SUPER", LIBUSB_SPEED_SUPER);
   ypush_nil();
 }
 
@@ -215,439 +684,5966 @@ void Y_usb_debug(int argc)
   }
   level = ygets_i(0);
   INITIALIZE;
-  libusb_set_debug(ctx, level);
+  libusb_set_debug(default_context.ctx, level);
   ypush_nil();
 }
 
-static const char*
-get_string(libusb_device_handle* handle, int index)
+void Y_usb_clock(int argc)
 {
-  static char str[STRING_DESCRIPTOR_SIZE];
-  int code;
-  if (index <= 0) {
-    return "unknown";
-  }
-  code = get_string_descriptor(handle, index, str, sizeof(str));
-  if (code != 0) {
-    libusb_close(handle);
-    failure(NULL, code);
+  struct timespec ts;
+  if (argc != 1 || ! yarg_nil(0)) {
+    y_error("expecting exactly one nil argument");
   }
-  str[sizeof(str)/sizeof(str[0]) - 1] = 0;
-  return str;
+  get_time(&ts);
+  ypush_double((double)ts.tv_sec + 1E-9*(double)ts.tv_nsec);
 }
 
+/* Print a summary of the devices of the default context.  The strings are
+   read from the cache of the device list (see fetch_dev_strings). */
 void Y_usb_summary(int argc)
 {
+  const dev_info_t* info;
   ssize_t i;
-  libusb_device_handle* handle;
+  int k;
+  static const char* labels[DEV_STRINGS] = {
+    "  Manufacturer -------> %s\n",
+    "  Product ------------> %s\n",
+    "  Serial Number ------> %s\n"
+  };
 
-  load_device_list();
-  for (i = 0; i < dev_count; ++i) {
-    int code;
-    struct libusb_device_descriptor desc;
-    libusb_device* dev = dev_list[i];
-    uint8_t bus_number = libusb_get_bus_number(dev);
-    uint8_t port_number = libusb_get_port_number(dev);
-    uint8_t device_address = libusb_get_device_address(dev);
+  INITIALIZE;
+  load_device_list(&default_context);
+  for (i = 0; i < default_context.dev_info_count; ++i) {
+    fetch_dev_strings(&default_context, i);
+    info = &default_context.dev_info[i];
     fprintf(stdout, "USB Device %ld:\n", (long)i);
-    fprintf(stdout, "  Bus Number ---------> %d\n", (int)bus_number);
-    fprintf(stdout, "  Port Number --------> %d\n", (int)port_number);
-    fprintf(stdout, "  Device Address -----> %d\n", (int)device_address);
-    code = libusb_get_device_descriptor(dev, &desc);
-    if (code != 0) {
-      failure(NULL, code);
-    }
+    fprintf(stdout, "  Bus Number ---------> %d\n", info->bus);
+    fprintf(stdout, "  Port Number --------> %d\n", info->port);
+    fprintf(stdout, "  Device Address -----> %d\n", info->address);
     fprintf(stdout, "  Vendor ID ----------> 0x%04x\n",
-            (unsigned int)desc.idVendor);
+            (unsigned int)info->descriptor.idVendor);
     fprintf(stdout, "  Product ID ---------> 0x%04x\n",
-            (unsigned int)desc.idProduct);
-    code = libusb_open(dev, &handle);
-    if (code == 0) {
-      fprintf(stdout, "  Manufacturer -------> %s\n",
-              get_string(handle, desc.iManufacturer));
-      fprintf(stdout, "  Product ------------> %s\n",
-              get_string(handle, desc.idProduct));
-      fprintf(stdout, "  Serial Number ------> %s\n",
-              get_string(handle, desc.iSerialNumber));
-      libusb_close(handle);
-    }
-  }
-  free_dev_list();
+            (unsigned int)info->descriptor.idProduct);
+    for (k = 0; k < DEV_STRINGS; ++k) {
+      fprintf(stdout, labels[k],
+              (info->strings[k] != NULL ? info->strings[k] : "unknown"));
+    }
+  }
   ypush_nil();
 }
 
 /*--------------------------------------------------------------------------*/
+/* LIBUSB CONTEXTS */
 
-typedef struct _ydev_instance ydev_instance_t;
-struct _ydev_instance {
-  libusb_device* device;
-  libusb_device_handle* handle;
-  struct libusb_device_descriptor descriptor;
-  int bus;
-  int port;
-  int address;
-};
-
-static void ydev_free(void *);
-static void ydev_print(void *);
-/*static void ydev_eval(void *, int);*/
-static void ydev_extract(void *, char *);
+static void yctx_free(void *);
+static void yctx_print(void *);
+static void yctx_extract(void *, char *);
 
-static y_userobj_t ydev_class = {
-  "USB Device",
-  ydev_free,
-  ydev_print,
-  /*ydev_eval*/NULL,
-  ydev_extract,
+static y_userobj_t yctx_class = {
+  "USB Context",
+  yctx_free,
+  yctx_print,
+  NULL,
+  yctx_extract,
   NULL
 };
 
-static void ydev_free(void *self)
+static void yctx_free(void *self)
 {
-  ydev_instance_t *obj = (ydev_instance_t *)self;
-  if (obj->handle != NULL) {
-    libusb_close(obj->handle);
-  }
-  if (obj->device != NULL) {
-    libusb_unref_device(obj->device);
-  }
+  destroy_context((context_t*)self);
 }
 
-static void ydev_print(void *self)
+static void yctx_print(void *self)
 {
-  ydev_instance_t *obj = (ydev_instance_t *)self;
-  char buf[256];
-  y_print(ydev_class.type_name, 0);
-  sprintf(buf, ": bus=%d, port=%d, address=%d, vendor=0x%04x, product=0x%04x, manufacturer=0x%04x, serial=0x%04x", obj->bus, obj->port, obj->address, obj->descriptor.idVendor, obj->descriptor.idProduct, obj->descriptor.iManufacturer, obj->descriptor.iSerialNumber);
+  context_t* uc = (context_t*)self;
+  char buf[128];
+  y_print(yctx_class.type_name, 0);
+  sprintf(buf, ": backend=%s, hotplug=%d, event_thread=%d",
+          (uc->mock ? "mock" : "libusb"), uc->hotplug_supported,
+          uc->event_thread_started);
   y_print(buf, 1);
 }
 
-static void ydev_extract(void *addr, char *member)
+static void yctx_extract(void *addr, char *member)
 {
-  ydev_instance_t *obj = (ydev_instance_t *)addr;
+  context_t* uc = (context_t*)addr;
   int c = (member != NULL ? member[0] : '\0');
-  if (c == 'b' && strcmp(member, "bus") == 0) {
-    ypush_int(obj->bus);
-  } else if (c == 'p' && strcmp(member, "port") == 0) {
-    ypush_int(obj->port);
-  } else if (c == 'a' && strcmp(member, "address") == 0) {
-    ypush_int(obj->address);
-  } else if (c == 'v' && strcmp(member, "vendor") == 0) {
-    ypush_int(obj->descriptor.idVendor);
-  } else if (c == 'p' && strcmp(member, "product") == 0) {
-    ypush_int(obj->descriptor.idProduct);
-  } else if (c == 'm' && strcmp(member, "manufacturer") == 0) {
-    ypush_int(obj->descriptor.iManufacturer);
-  } else if (c == 's' && strcmp(member, "serial") == 0) {
-    ypush_int(obj->descriptor.iSerialNumber);
+  if (c == 'd' && strcmp(member, "devices") == 0) {
+    load_device_list(uc);
+    ypush_long(uc->dev_info_count);
+  } else if (c == 'e' && strcmp(member, "event_thread") == 0) {
+    ypush_int(uc->event_thread_started);
+  } else if (c == 'h' && strcmp(member, "hotplug") == 0) {
+    ypush_int(uc->hotplug_supported);
+  } else if (c == 'm' && strcmp(member, "mock") == 0) {
+    ypush_int(uc->mock);
   } else {
     y_error("bad member name");
   }
 }
 
-/* Get an USB device from the stack. */
-static ydev_instance_t* get_device(int iarg)
+/* Check whether the IARG-th argument is a libusb context. */
+static int is_context(int iarg)
 {
-  return (ydev_instance_t*)yget_obj(iarg, &ydev_class);
+  return (yarg_typeid(iarg) == Y_OPAQUE &&
+          yget_obj(iarg, NULL) == yctx_class.type_name);
 }
 
-void Y_usb_open_device(int argc)
+/* Get a libusb context from the stack, nil is for the default context. */
+static context_t* get_context(int iarg)
 {
-  ydev_instance_t *obj = NULL;
-  libusb_device* dev;
-  int bus, port;
-  int i, ret;
-
-  if (argc != 2) {
-    y_error("expecting exactly 2 arguments");
+  if (yarg_nil(iarg)) {
+    INITIALIZE;
+    return &default_context;
   }
-  bus = ygets_i(1);
-  port = ygets_i(0);
+  return (context_t*)yget_obj(iarg, &yctx_class);
+}
 
-  load_device_list();
-  for (i = 0; i < dev_count; ++i) {
-    dev = dev_list[i];
-    if (libusb_get_bus_number(dev) == bus &&
-        libusb_get_port_number(dev) == port) {
-      obj = (ydev_instance_t *)ypush_obj(&ydev_class, sizeof(ydev_instance_t));
-      obj->device = libusb_ref_device(dev);
-      ret = libusb_open(obj->device, &obj->handle);
-      if (ret < 0) {
-        obj->handle = NULL;
-        failure("failed to open device", ret);
-      }
-      obj->bus = bus;
-      obj->port = port;
-      obj->address = libusb_get_device_address(dev);
-      ret = libusb_get_device_descriptor(dev, &obj->descriptor);
-      if (ret != 0) {
-        free_dev_list();
-        failure("unable to get device descriptor", ret);
-      }
-      break;
-    }
+/* Get the optional libusb context argument of a built-in function called
+   with ARGC arguments, no argument is the same as nil. */
+static context_t* get_optional_context(int argc)
+{
+  if (argc > 1) {
+    y_error("expecting at most one argument");
   }
-  free_dev_list();
-  if (obj == NULL) {
-    ypush_nil();
+  if (argc < 1) {
+    INITIALIZE;
+    return &default_context;
   }
+  return get_context(0);
 }
 
-void Y__usb_probe_devices(int argc)
+void Y_usb_new_context(int argc)
 {
-  struct libusb_device_descriptor desc;
-  libusb_device* dev;
-  long dims[3];
-  int* data;
-  int i, ret;
+  context_t* uc;
+  int ret;
 
-  if (argc != 1 || ! yarg_nil(0)) {
-    y_error("expecting exactly one nil argument");
+  const char* backend;
+  int mock;
+
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
   }
-  load_device_list();
-  if (dev_count > 0) {
-    dims[0] = 2;
-    dims[1] = 7;
-    dims[2] = dev_count;
-    data = ypush_i(dims);
-    for (i = 0; i < dev_count; ++i) {
-      dev = dev_list[i];
-      ret = libusb_get_device_descriptor(dev, &desc);
-      if (ret != 0) {
-        free_dev_list();
-        failure("unable to get device descriptor", ret);
-      }
-      data[0] = libusb_get_bus_number(dev);
-      data[1] = libusb_get_port_number(dev);
-      data[2] = libusb_get_device_address(dev);
-      data[3] = desc.idVendor;
-      data[4] = desc.idProduct;
-      data[5] = desc.iManufacturer;
-      data[6] = desc.iSerialNumber;
-      data += 7;
-    }
+  backend = (yarg_nil(0) ? NULL : ygets_q(0));
+  if (backend == NULL || strcmp(backend, "libusb") == 0) {
+    mock = FALSE;
+  } else if (strcmp(backend, "mock") == 0) {
+    mock = TRUE;
   } else {
-    ypush_nil();
+    y_error("unknown USB backend");
+    return;
+  }
+  INITIALIZE; /* for ycall_on_quit and libusb_setlocale */
+  uc = (context_t*)ypush_obj(&yctx_class, sizeof(context_t));
+  ret = init_context(uc, mock);
+  if (ret != 0) {
+    failure("failed to create libusb context", ret);
   }
-  free_dev_list();
 }
 
-void Y_usb_get_string(int argc)
+/*--------------------------------------------------------------------------*/
+
+/* Transfer statistics.  Latencies are measured with a monotonic clock.  Bin
+   K > 0 of the histogram counts latencies in [2^(K-1),2^K) microseconds, bin
+   0 counts latencies below 1 microsecond and the last bin counts all
+   latencies above.  Error counts are indexed by minus the error code, the
+   last entry is for other errors. */
+#define LATENCY_BINS 24
+#define ERROR_BINS   13
+typedef struct _transfer_stats transfer_stats_t;
+struct _transfer_stats {
+  unsigned long count;    /* number of transfers */
+  unsigned long bytes;    /* number of transferred bytes */
+  unsigned long failures; /* number of failed transfers */
+  double lat_min, lat_max, lat_sum; /* latencies (in seconds) */
+  unsigned long histogram[LATENCY_BINS];
+  unsigned long errors[ERROR_BINS];
+  unsigned long retries;     /* number of retried transfers */
+  unsigned long clear_halts; /* number of halt conditions cleared */
+  unsigned long resets;      /* number of device resets */
+  unsigned long reclaims;    /* number of interfaces claimed again */
+  unsigned long recovered;   /* transfers successful after retries */
+  unsigned long unrecovered; /* transfers failed despite retries */
+  double recovery_time;      /* time spent in recovery (in seconds) */
+};
+
+/* Pool of transfers (without isochronous packets) owned by a device and
+   recycled by the asynchronous transfers of this device to avoid allocating
+   a new transfer for every submission.  Transfers are acquired by the
+   interpreter thread and may be released by the completion callbacks, so
+   the pool is protected by a mutex.  The pool grows as needed but never
+   shrinks (the array of available transfers is always large enough to store
+   all the transfers owned by the pool). */
+#define TRANSFER_POOL_SIZE 8
+typedef struct _transfer_pool transfer_pool_t;
+struct _transfer_pool {
+  struct libusb_transfer** available;
+  int count; /* number of available transfers */
+  int total; /* number of transfers owned by the pool */
+  unsigned long hits;   /* number of acquisitions served by the pool */
+  unsigned long misses; /* number of acquisitions requiring an allocation */
+  int mutex_initialized;
+  pthread_mutex_t mutex;
+};
+
+typedef struct _ydev_instance ydev_instance_t;
+struct _ydev_instance {
+  context_t* context;
+  void* context_use; /* to keep a context, other than the default one, alive */
+  libusb_device* device;
+  libusb_device_handle* handle;
+  struct libusb_device_descriptor descriptor;
+  int bus;
+  int port;
+  int address;
+  char path[64]; /* port path */
+  char** strings; /* cached string descriptors (256 entries or NULL) */
+  struct libusb_config_descriptor* config; /* cached active configuration */
+  endpoint_info_t* endpoints; /* endpoints of the active configuration */
+  int nendpoints; /* number of endpoints, -1 if not yet parsed */
+  int speed; /* bus speed of the device */
+  mock_device_t* mock; /* simulated device, NULL for a real one */
+  int chunk_size;  /* size of chunks of large bulk transfers, 0 if none */
+  int chunk_depth; /* number of chunks in flight */
+  int recovery; /* recovery policy (see usb_set_recovery) */
+  int retries;  /* maximum number of retries per transfer */
+  unsigned int recovery_budget; /* maximum time of retries (ms), 0 if none */
+  unsigned int claimed; /* bitmask of claimed interfaces */
+  int spin;     /* spin mode (see usb_set_spin) */
+  int spin_cpu; /* CPU to which the interpreter is pinned in spin mode */
+  int stats_enabled;
+  int stats_mutex_initialized;
+  pthread_mutex_t stats_mutex; /* transfers may complete in another thread */
+  transfer_stats_t stats;
+  transfer_pool_t pool;
+};
+
+static void get_time(struct timespec* ts)
 {
-  char str[STRING_DESCRIPTOR_SIZE];
-  ydev_instance_t* obj;
-  int index;
-  int ret;
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
 
-  if (argc != 2) {
-    y_error("expecting exactly 2 arguments");
-  }
-  obj = get_device(1);
-  index = ygets_i(0);
+static double elapsed_seconds(const struct timespec* t0,
+                              const struct timespec* t1)
+{
+  return ((double)(t1->tv_sec - t0->tv_sec) +
+          1E-9*(double)(t1->tv_nsec - t0->tv_nsec));
+}
 
-  ret = get_string_descriptor(obj->handle, index, str, sizeof(str));
-  if (ret < 0) {
-    ypush_int(ret);
-  } else {
-    str[sizeof(str)/sizeof(str[0]) - 1] = 0;
-    push_string(str);
+static void reset_stats(ydev_instance_t* obj)
+{
+  if (obj->stats_mutex_initialized) {
+    pthread_mutex_lock(&obj->stats_mutex);
+  }
+  memset(&obj->stats, 0, sizeof(obj->stats));
+  if (obj->stats_mutex_initialized) {
+    pthread_mutex_unlock(&obj->stats_mutex);
+  }
+  if (obj->pool.mutex_initialized) {
+    pthread_mutex_lock(&obj->pool.mutex);
+    obj->pool.hits = 0;
+    obj->pool.misses = 0;
+    pthread_mutex_unlock(&obj->pool.mutex);
   }
 }
 
-void Y_usb_claim_interface(int argc)
+/* Make sure the pool has room for N more transfers and preallocate them.
+   Returns 0 on success or an error code.  The caller must own the lock. */
+static int grow_pool(transfer_pool_t* pool, int n)
 {
-  ydev_instance_t* obj;
-  int interface_number;
-  int ret;
+  struct libusb_transfer** available;
+  struct libusb_transfer* transfer;
 
-  if (argc != 2) {
-    y_error("expecting exactly 2 arguments");
+  /* Use the standard allocator which, unlike p_malloc, is thread-safe. */
+  available = (struct libusb_transfer**)realloc(pool->available,
+                                                (pool->total + n)*
+                                                sizeof(available[0]));
+  if (available == NULL) {
+    return LIBUSB_ERROR_NO_MEM;
   }
-  obj = get_device(1);
-  interface_number = ygets_i(0);
+  pool->available = available;
+  while (n-- > 0) {
+    transfer = libusb_alloc_transfer(0);
+    if (transfer == NULL) {
+      return LIBUSB_ERROR_NO_MEM;
+    }
+    pool->available[pool->count++] = transfer;
+    ++pool->total;
+  }
+  return 0;
+}
+
+static int init_pool(transfer_pool_t* pool, int n)
+{
+  if (pthread_mutex_init(&pool->mutex, NULL) != 0) {
+    return LIBUSB_ERROR_OTHER;
+  }
+  pool->mutex_initialized = TRUE;
+  return grow_pool(pool, n);
+}
+
+static void free_pool(transfer_pool_t* pool)
+{
+  int i;
+  if (pool->available != NULL) {
+    /* All transfers must have been released. */
+    for (i = 0; i < pool->count; ++i) {
+      libusb_free_transfer(pool->available[i]);
+    }
+    free(pool->available);
+    pool->available = NULL;
+  }
+  pool->count = 0;
+  pool->total = 0;
+  if (pool->mutex_initialized) {
+    pthread_mutex_destroy(&pool->mutex);
+    pool->mutex_initialized = FALSE;
+  }
+}
+
+/* Get a transfer from the pool of a device, NULL on allocation failure. */
+static struct libusb_transfer* acquire_transfer(ydev_instance_t* dev)
+{
+  transfer_pool_t* pool = &dev->pool;
+  struct libusb_transfer* transfer = NULL;
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->count > 0) {
+    ++pool->hits;
+  } else {
+    ++pool->misses;
+    grow_pool(pool, 1);
+  }
+  if (pool->count > 0) {
+    transfer = pool->available[--pool->count];
+    transfer->flags = 0;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return transfer;
+}
+
+/* Return the transfer stored at REF to the pool of a device (it must not be
+   in flight) and set REF to NULL while owning the lock of the pool, so that
+   other threads can safely check whether the transfer has been released.
+   This may be called by completion callbacks. */
+static void release_transfer(ydev_instance_t* dev,
+                             struct libusb_transfer** ref)
+{
+  transfer_pool_t* pool = &dev->pool;
+  pthread_mutex_lock(&pool->mutex);
+  if (*ref != NULL) {
+    pool->available[pool->count++] = *ref;
+    *ref = NULL;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Account for a transfer started at time T0 with result RET (0 or a
+   non-negative byte count on success, an error code otherwise) and BYTES
+   transferred bytes.  This must be cheap when statistics are disabled. */
+static void record_transfer(ydev_instance_t* obj, const struct timespec* t0,
+                            int ret, long bytes)
+{
+  struct timespec t1;
+  transfer_stats_t* stats;
+  double t;
+  long us;
+  int k;
+
+  if (! obj->stats_enabled) {
+    return;
+  }
+  get_time(&t1);
+  t = elapsed_seconds(t0, &t1);
+  us = (long)(1E6*t);
+  for (k = 0; us > 0 && k < LATENCY_BINS - 1; ++k) {
+    us >>= 1;
+  }
+  pthread_mutex_lock(&obj->stats_mutex);
+  stats = &obj->stats;
+  if (stats->count == 0 || t < stats->lat_min) {
+    stats->lat_min = t;
+  }
+  if (stats->count == 0 || t > stats->lat_max) {
+    stats->lat_max = t;
+  }
+  stats->lat_sum += t;
+  ++stats->count;
+  ++stats->histogram[k];
+  if (bytes > 0) {
+    stats->bytes += bytes;
+  }
+  if (ret < 0) {
+    ++stats->failures;
+    ++stats->errors[(-ret < ERROR_BINS ? -ret : ERROR_BINS) - 1];
+  }
+  pthread_mutex_unlock(&obj->stats_mutex);
+}
+
+/*--------------------------------------------------------------------------*/
+/* MOCK BACKEND */
+
+/* A mock context (see usb_new_context, or set the environment variable
+   YUSB_BACKEND to "mock" for the default context) has a list of simulated
+   devices instead of the real ones.  By default, the simulated devices
+   emulate a BMC Multi-DM (same vendor and product identifiers, frames are
+   accepted on any OUT endpoint, firmware version and status bits can be
+   queried and control bits can be set).  Data sent to an OUT endpoint are
+   looped back and returned by reads on IN endpoints.  Synchronous
+   transfers only are supported with a configurable latency, throughput
+   and rate of injected errors (see usb_mock_config).  This is mainly
+   intended to measure the overheads of the plug-in without any hardware. */
+
+/* Identifiers and requests of the BMC Multi-DM (see "bmcusb.i"). */
+#define BMC_VENDOR               0x1781
+#define BMC_MULTIDRIVER          0x0ED8
+#define BMC_GET_FIRMWARE_VERSION 0xF0
+#define BMC_GET_STATUS_BITS      0xF4
+#define BMC_SET_CONTROL_BITS     0xF5
+#define BMC_CABLE_OK             0x04
+
+static struct {
+  double latency;    /* latency of a transfer (in seconds) */
+  double throughput; /* throughput (in bytes/s), 0 for unlimited */
+  double error_rate; /* probability that a transfer fails */
+  int error_code;    /* error code of a failed transfer */
+  int devices;       /* number of simulated devices */
+  int vendor, product;
+} mock_config = {0.0, 0.0, 0.0, LIBUSB_ERROR_IO, 1,
+                 BMC_VENDOR, BMC_MULTIDRIVER};
+
+struct _mock_device {
+  int number;            /* index of the simulated device */
+  int control_bits;      /* last control bits set by eCIUsbCmndSetControlBits */
+  unsigned long frames;  /* number of OUT bulk/interrupt transfers */
+  unsigned long seed;    /* state of the random generator */
+  unsigned char* loopback; /* last OUT data */
+  long loopback_length;
+  long loopback_size;
+};
+
+static const char* mock_string(int number, int index, char* buf)
+{
+  switch (index) {
+  case 1:
+    return "Boston Micromachines (mock)";
+  case 2:
+    return "Multi-DM (mock)";
+  case 3:
+    sprintf(buf, "MOCK%04d", number);
+    return buf;
+  default:
+    return NULL;
+  }
+}
+
+/* Rebuild the list of simulated devices. */
+static void load_mock_devices(context_t* uc)
+{
+  dev_info_t* info;
+  char buf[32];
+  ssize_t count = mock_config.devices, i;
+  int k;
+
+  free_dev_info(uc->dev_info, uc->dev_info_count);
+  uc->dev_info = NULL;
+  uc->dev_info_count = 0;
+  info = (dev_info_t*)p_malloc((count > 0 ? count : 1)*sizeof(dev_info_t));
+  memset(info, 0, (count > 0 ? count : 1)*sizeof(dev_info_t));
+  for (i = 0; i < count; ++i) {
+    dev_info_t* item = &info[i];
+    item->bus = 1;
+    item->port = i + 1;
+    item->address = i + 2;
+    item->speed = LIBUSB_SPEED_HIGH;
+    sprintf(item->path, "1-%d", (int)(i + 1));
+    item->descriptor.bLength = LIBUSB_DT_DEVICE_SIZE;
+    item->descriptor.bDescriptorType = LIBUSB_DT_DEVICE;
+    item->descriptor.bcdUSB = 0x0200;
+    item->descriptor.bMaxPacketSize0 = 64;
+    item->descriptor.idVendor = mock_config.vendor;
+    item->descriptor.idProduct = mock_config.product;
+    item->descriptor.bcdDevice = 0x0100;
+    item->descriptor.iManufacturer = 1;
+    item->descriptor.iProduct = 2;
+    item->descriptor.iSerialNumber = 3;
+    item->descriptor.bNumConfigurations = 1;
+    item->fetched = TRUE;
+    for (k = 0; k < DEV_STRINGS; ++k) {
+      item->strings[k] = p_strcpy(mock_string(i, k + 1, buf));
+    }
+  }
+  uc->dev_info = info;
+  uc->dev_info_count = count;
+  build_dev_index(uc);
+}
+
+static mock_device_t* new_mock_device(int number)
+{
+  mock_device_t* mock = (mock_device_t*)malloc(sizeof(mock_device_t));
+  if (mock == NULL) {
+    y_error("insufficient memory");
+  }
+  memset(mock, 0, sizeof(mock_device_t));
+  mock->number = number;
+  mock->seed = 2463534242UL + number;
+  return mock;
+}
+
+static void free_mock_device(mock_device_t* mock)
+{
+  if (mock->loopback != NULL) {
+    free(mock->loopback);
+  }
+  free(mock);
+}
+
+/* Simulate the duration of a transfer of LENGTH bytes and the injection of
+   errors.  Returns 0 or an error code. */
+static int mock_transfer(mock_device_t* mock, long length)
+{
+  struct timespec t0, t1, ts;
+  double delay, r;
+
+  delay = mock_config.latency;
+  if (mock_config.throughput > 0.0) {
+    delay += length/mock_config.throughput;
+  }
+  if (delay > 0.0) {
+    /* Sleep for long delays, busy-wait for the remaining time to be
+       accurate. */
+    get_time(&t0);
+    if (delay > 2E-3) {
+      r = delay - 1E-3;
+      ts.tv_sec = (time_t)r;
+      ts.tv_nsec = (long)(1E9*(r - (double)ts.tv_sec));
+      nanosleep(&ts, NULL);
+    }
+    do {
+      get_time(&t1);
+    } while (elapsed_seconds(&t0, &t1) < delay);
+  }
+  if (mock_config.error_rate > 0.0) {
+    /* Xorshift generator (on 32 bits). */
+    unsigned long x = mock->seed;
+    x ^= (x << 13) & 0xffffffffUL;
+    x ^= x >> 17;
+    x ^= (x << 5) & 0xffffffffUL;
+    mock->seed = x;
+    r = (double)x/4294967296.0;
+    if (r < mock_config.error_rate) {
+      return mock_config.error_code;
+    }
+  }
+  return 0;
+}
+
+static int mock_control_transfer(mock_device_t* mock, int type, int request,
+                                 int value, int index, unsigned char* data,
+                                 int length, unsigned int timeout)
+{
+  int ret = mock_transfer(mock, length);
+  if (ret != 0) {
+    return ret;
+  }
+  if ((type & LIBUSB_ENDPOINT_IN) != 0) {
+    memset(data, 0, length);
+    if (request == BMC_GET_FIRMWARE_VERSION && length >= 2) {
+      data[0] = 0x01;
+    } else if (request == BMC_GET_STATUS_BITS && length >= 2) {
+      data[0] = BMC_CABLE_OK;
+    }
+  } else if (request == BMC_SET_CONTROL_BITS) {
+    if ((value & 0x80) != 0) {
+      mock->control_bits |= (value & 0x7f);
+    } else {
+      mock->control_bits &= ~(value & 0x7f);
+    }
+  }
+  return length;
+}
+
+static int mock_data_transfer(mock_device_t* mock, int endpoint,
+                              unsigned char* data, int length,
+                              int* transferred, unsigned int timeout)
+{
+  long n;
+  int ret = mock_transfer(mock, length);
+  if (ret != 0) {
+    *transferred = 0;
+    return ret;
+  }
+  if ((endpoint & LIBUSB_ENDPOINT_IN) != 0) {
+    n = (mock->loopback_length < length ? mock->loopback_length : length);
+    if (n > 0) {
+      memcpy(data, mock->loopback, n);
+    }
+    if (n < length) {
+      memset(data + n, 0, length - n);
+    }
+  } else {
+    if (length > mock->loopback_size) {
+      unsigned char* buf = (unsigned char*)realloc(mock->loopback, length);
+      if (buf == NULL) {
+        *transferred = 0;
+        return LIBUSB_ERROR_NO_MEM;
+      }
+      mock->loopback = buf;
+      mock->loopback_size = length;
+    }
+    if (length > 0) {
+      memcpy(mock->loopback, data, length);
+    }
+    mock->loopback_length = length;
+    ++mock->frames;
+  }
+  *transferred = length;
+  return 0;
+}
+
+/* Asynchronous transfers require a real device. */
+static void check_async(ydev_instance_t* dev)
+{
+  if (dev->mock != NULL) {
+    y_error("asynchronous transfers not supported by mock devices");
+  }
+}
+
+void Y__usb_mock_config(int argc)
+{
+  double latency, throughput, error_rate;
+  int error_code, devices;
+
+  if (argc != 5) {
+    y_error("expecting exactly 5 arguments");
+  }
+  latency = (yarg_nil(4) ? mock_config.latency : ygets_d(4));
+  throughput = (yarg_nil(3) ? mock_config.throughput : ygets_d(3));
+  error_rate = (yarg_nil(2) ? mock_config.error_rate : ygets_d(2));
+  error_code = (yarg_nil(1) ? mock_config.error_code : ygets_i(1));
+  devices = (yarg_nil(0) ? mock_config.devices : ygets_i(0));
+  if (latency < 0.0) {
+    y_error("invalid latency");
+  }
+  if (throughput < 0.0) {
+    y_error("invalid throughput");
+  }
+  if (error_rate < 0.0 || error_rate > 1.0) {
+    y_error("invalid error rate");
+  }
+  if (error_code >= 0) {
+    y_error("error code must be strictly negative");
+  }
+  if (devices < 0) {
+    y_error("invalid number of devices");
+  }
+  mock_config.latency = latency;
+  mock_config.throughput = throughput;
+  mock_config.error_rate = error_rate;
+  mock_config.error_code = error_code;
+  mock_config.devices = devices;
+  ypush_nil();
+}
+
+static void ydev_free(void *);
+static void ydev_print(void *);
+/*static void ydev_eval(void *, int);*/
+static void ydev_extract(void *, char *);
+
+static y_userobj_t ydev_class = {
+  "USB Device",
+  ydev_free,
+  ydev_print,
+  /*ydev_eval*/NULL,
+  ydev_extract,
+  NULL
+};
+
+static void ydev_free(void *self)
+{
+  ydev_instance_t *obj = (ydev_instance_t *)self;
+  if (obj->handle != NULL) {
+    libusb_close(obj->handle);
+  }
+  if (obj->device != NULL) {
+    libusb_unref_device(obj->device);
+  }
+  if (obj->context_use != NULL) {
+    ydrop_use(obj->context_use);
+  }
+  if (obj->stats_mutex_initialized) {
+    pthread_mutex_destroy(&obj->stats_mutex);
+  }
+  free_pool(&obj->pool);
+  if (obj->spin_cpu >= 0) {
+    pin_interpreter(-1);
+  }
+  if (obj->mock != NULL) {
+    free_mock_device(obj->mock);
+  }
+  if (obj->strings != NULL) {
+    int k;
+    for (k = 0; k < 256; ++k) {
+      if (obj->strings[k] != NULL) {
+        p_free(obj->strings[k]);
+      }
+    }
+    p_free(obj->strings);
+  }
+  if (obj->config != NULL) {
+    libusb_free_config_descriptor(obj->config);
+  }
+  if (obj->endpoints != NULL) {
+    p_free(obj->endpoints);
+  }
+}
+
+/* Store string descriptor STR of index INDEX in the cache of device OBJ. */
+static const char* cache_string(ydev_instance_t* obj, int index,
+                                const char* str)
+{
+  if (obj->strings == NULL) {
+    obj->strings = (char**)p_malloc(256*sizeof(char*));
+    memset(obj->strings, 0, 256*sizeof(char*));
+  }
+  if (obj->strings[index] != NULL) {
+    p_free(obj->strings[index]);
+  }
+  obj->strings[index] = p_strcpy(str);
+  return obj->strings[index];
+}
+
+/* Get string descriptor of index INDEX of device OBJ.  The string is read
+   from the device on first access and then cached (failures are not
+   cached).  Returns NULL and sets CODE in case of failure. */
+static const char* get_cached_string(ydev_instance_t* obj, int index,
+                                     int* code)
+{
+  char str[STRING_DESCRIPTOR_SIZE];
+  const char* ptr;
+  int ret;
+
+  index &= 0xff;
+  if (obj->strings != NULL && obj->strings[index] != NULL) {
+    return obj->strings[index];
+  }
+  if (obj->mock != NULL) {
+    ptr = mock_string(obj->mock->number, index, str);
+    if (ptr == NULL) {
+      *code = LIBUSB_ERROR_PIPE;
+      return NULL;
+    }
+    return cache_string(obj, index, ptr);
+  }
+  ret = get_string_descriptor(obj->handle, index, str, sizeof(str));
+  if (ret < 0) {
+    *code = ret;
+    return NULL;
+  }
+  str[(ret < (int)sizeof(str) ? ret : (int)sizeof(str) - 1)] = 0;
+  return cache_string(obj, index, str);
+}
+
+/* Push the string descriptor of index INDEX of device OBJ, nil if there is
+   no such string. */
+static void push_cached_string(ydev_instance_t* obj, int index)
+{
+  const char* str;
+  int code;
+  str = (index > 0 ? get_cached_string(obj, index, &code) : NULL);
+  if (str != NULL) {
+    push_string(str);
+  } else {
+    ypush_nil();
+  }
+}
+
+/* Get the active configuration descriptor of device OBJ (cached), NULL if
+   not available. */
+static const struct libusb_config_descriptor*
+get_config(ydev_instance_t* obj)
+{
+  if (obj->config == NULL && obj->device != NULL &&
+      libusb_get_active_config_descriptor(obj->device, &obj->config) != 0) {
+    obj->config = NULL;
+  }
+  return obj->config;
+}
+
+/* Endpoints of simulated devices (see MOCK BACKEND). */
+static const endpoint_info_t mock_endpoints[] = {
+  {0x02, LIBUSB_TRANSFER_TYPE_BULK, 512, 0, 0, 0},
+  {0x82, LIBUSB_TRANSFER_TYPE_BULK, 512, 0, 0, 0}
+};
+
+/* Parse (once) the endpoint descriptors of the active configuration of
+   device OBJ.  Returns the number of endpoints. */
+static int get_endpoints(ydev_instance_t* obj)
+{
+  const struct libusb_config_descriptor* config;
+  const struct libusb_interface_descriptor* alt;
+  const struct libusb_endpoint_descriptor* ep;
+  endpoint_info_t* info;
+  int i, j, k, n;
+
+  if (obj->nendpoints >= 0) {
+    return obj->nendpoints;
+  }
+  if (obj->mock != NULL) {
+    n = sizeof(mock_endpoints)/sizeof(mock_endpoints[0]);
+    obj->endpoints = (endpoint_info_t*)p_malloc(sizeof(mock_endpoints));
+    memcpy(obj->endpoints, mock_endpoints, sizeof(mock_endpoints));
+    obj->nendpoints = n;
+    return n;
+  }
+  config = get_config(obj);
+  if (config == NULL) {
+    return 0; /* try again next time */
+  }
+  n = 0;
+  for (i = 0; i < config->bNumInterfaces; ++i) {
+    for (j = 0; j < config->interface[i].num_altsetting; ++j) {
+      n += config->interface[i].altsetting[j].bNumEndpoints;
+    }
+  }
+  info = (endpoint_info_t*)p_malloc((n > 0 ? n : 1)*sizeof(endpoint_info_t));
+  n = 0;
+  for (i = 0; i < config->bNumInterfaces; ++i) {
+    for (j = 0; j < config->interface[i].num_altsetting; ++j) {
+      alt = &config->interface[i].altsetting[j];
+      for (k = 0; k < alt->bNumEndpoints; ++k) {
+        ep = &alt->endpoint[k];
+        info[n].address = ep->bEndpointAddress;
+        info[n].type = (ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK);
+        info[n].max_packet_size = (ep->wMaxPacketSize & 0x7ff);
+        info[n].interval = ep->bInterval;
+        info[n].interface = alt->bInterfaceNumber;
+        info[n].altsetting = alt->bAlternateSetting;
+        ++n;
+      }
+    }
+  }
+  obj->endpoints = info;
+  obj->nendpoints = n;
+  return n;
+}
+
+/* Get the maximum packet size of an endpoint of device OBJ.  If the
+   endpoint is unknown, the maximum packet size of bulk endpoints for the
+   speed of the device is returned. */
+static int get_max_packet_size(ydev_instance_t* obj, int endpoint)
+{
+  int k, n = get_endpoints(obj);
+  for (k = 0; k < n; ++k) {
+    if (obj->endpoints[k].address == endpoint &&
+        obj->endpoints[k].max_packet_size > 0) {
+      return obj->endpoints[k].max_packet_size;
+    }
+  }
+  switch (obj->speed) {
+  case LIBUSB_SPEED_LOW:
+    return 8;
+  case LIBUSB_SPEED_FULL:
+    return 64;
+  case LIBUSB_SPEED_HIGH:
+  case LIBUSB_SPEED_UNKNOWN:
+    return 512;
+  default:
+    return 1024;
+  }
+}
+
+/* Compute default sizes for chunked transfers (if STREAM is false) or
+   streams (if STREAM is true) from the speed of device OBJ.  The size of
+   each transfer is a multiple of the maximum packet size of ENDPOINT (-1
+   for any bulk endpoint) and DEPTH is the number of transfers to keep in
+   flight to saturate the bus. */
+static void get_tuned_sizes(ydev_instance_t* obj, int endpoint, int stream,
+                            int* size, int* depth)
+{
+  int maxp;
+  switch (obj->speed) {
+  case LIBUSB_SPEED_LOW:
+  case LIBUSB_SPEED_FULL:
+    *size = 4096;
+    *depth = (stream ? 4 : 2);
+    break;
+  case LIBUSB_SPEED_HIGH:
+  case LIBUSB_SPEED_UNKNOWN:
+    *size = (stream ? 16384 : 65536);
+    *depth = (stream ? 8 : 4);
+    break;
+  default:
+    *size = (stream ? 65536 : 262144);
+    *depth = (stream ? 16 : 8);
+  }
+  maxp = get_max_packet_size(obj, endpoint);
+  if (maxp > 0 && *size % maxp != 0) {
+    *size = (*size/maxp + 1)*maxp;
+  }
+}
+
+static void ydev_print(void *self)
+{
+  ydev_instance_t *obj = (ydev_instance_t *)self;
+  char buf[256];
+  y_print(ydev_class.type_name, 0);
+  sprintf(buf, ": bus=%d, port=%d, address=%d, vendor=0x%04x, product=0x%04x, manufacturer=0x%04x, serial=0x%04x", obj->bus, obj->port, obj->address, obj->descriptor.idVendor, obj->descriptor.idProduct, obj->descriptor.iManufacturer, obj->descriptor.iSerialNumber);
+  y_print(buf, 1);
+}
+
+static void ydev_extract(void *addr, char *member)
+{
+  ydev_instance_t *obj = (ydev_instance_t *)addr;
+  int c = (member != NULL ? member[0] : '\0');
+  if (c == 'b' && strcmp(member, "bus") == 0) {
+    ypush_int(obj->bus);
+  } else if (c == 'p' && strcmp(member, "port") == 0) {
+    ypush_int(obj->port);
+  } else if (c == 'a' && strcmp(member, "address") == 0) {
+    ypush_int(obj->address);
+  } else if (c == 'v' && strcmp(member, "vendor") == 0) {
+    ypush_int(obj->descriptor.idVendor);
+  } else if (c == 'p' && strcmp(member, "product") == 0) {
+    ypush_int(obj->descriptor.idProduct);
+  } else if (c == 'p' && strcmp(member, "path") == 0) {
+    *ypush_q(NULL) = p_strcpy(obj->path);
+  } else if (c == 'm' && strcmp(member, "mock") == 0) {
+    ypush_int(obj->mock != NULL);
+  } else if (c == 'c' && strcmp(member, "chunking") == 0) {
+    long dims[2];
+    int* out;
+    dims[0] = 1;
+    dims[1] = 2;
+    out = ypush_i(dims);
+    out[0] = obj->chunk_size;
+    out[1] = obj->chunk_depth;
+  } else if (c == 'm' && strcmp(member, "manufacturer") == 0) {
+    ypush_int(obj->descriptor.iManufacturer);
+  } else if (c == 's' && strcmp(member, "serial") == 0) {
+    ypush_int(obj->descriptor.iSerialNumber);
+  } else if (c == 'm' && strcmp(member, "manufacturer_string") == 0) {
+    push_cached_string(obj, obj->descriptor.iManufacturer);
+  } else if (c == 'p' && strcmp(member, "product_string") == 0) {
+    push_cached_string(obj, obj->descriptor.iProduct);
+  } else if (c == 's' && strcmp(member, "serial_string") == 0) {
+    push_cached_string(obj, obj->descriptor.iSerialNumber);
+  } else if (c == 's' && strcmp(member, "speed") == 0) {
+    ypush_int(obj->speed);
+  } else if (c == 'e' && strcmp(member, "endpoints") == 0) {
+    int k, n = get_endpoints(obj);
+    if (n > 0) {
+      long dims[3];
+      int* out;
+      dims[0] = 2;
+      dims[1] = 7;
+      dims[2] = n;
+      out = ypush_i(dims);
+      for (k = 0; k < n; ++k) {
+        const endpoint_info_t* ep = &obj->endpoints[k];
+        out[0] = ep->address;
+        out[1] = ((ep->address & LIBUSB_ENDPOINT_IN) != 0);
+        out[2] = ep->type;
+        out[3] = ep->max_packet_size;
+        out[4] = ep->interval;
+        out[5] = ep->interface;
+        out[6] = ep->altsetting;
+        out += 7;
+      }
+    } else {
+      ypush_nil();
+    }
+  } else if (c == 'c' && strcmp(member, "config") == 0) {
+    const struct libusb_config_descriptor* config = get_config(obj);
+    if (config != NULL) {
+      long dims[2];
+      int* out;
+      dims[0] = 1;
+      dims[1] = 4;
+      out = ypush_i(dims);
+      out[0] = config->bConfigurationValue;
+      out[1] = config->bNumInterfaces;
+      out[2] = config->bmAttributes;
+      out[3] = 2*config->MaxPower; /* in mA */
+    } else {
+      ypush_nil();
+    }
+  } else if (c == 's' && strcmp(member, "stats") == 0) {
+    transfer_stats_t* stats = &obj->stats;
+    long dims[2];
+    double* out;
+    dims[0] = 1;
+    dims[1] = 9;
+    out = ypush_d(dims);
+    pthread_mutex_lock(&obj->stats_mutex);
+    out[0] = stats->count;
+    out[1] = stats->bytes;
+    out[2] = stats->failures;
+    out[3] = stats->errors[-LIBUSB_ERROR_TIMEOUT - 1];
+    out[4] = stats->lat_min;
+    out[5] = (stats->count > 0 ? stats->lat_sum/stats->count : 0.0);
+    out[6] = stats->lat_max;
+    pthread_mutex_unlock(&obj->stats_mutex);
+    pthread_mutex_lock(&obj->pool.mutex);
+    out[7] = obj->pool.hits;
+    out[8] = obj->pool.misses;
+    pthread_mutex_unlock(&obj->pool.mutex);
+  } else if (c == 's' && strcmp(member, "spin") == 0) {
+    long dims[2];
+    int* out;
+    dims[0] = 1;
+    dims[1] = 2;
+    out = ypush_i(dims);
+    out[0] = obj->spin;
+    out[1] = obj->spin_cpu;
+  } else if (c == 'r' && strcmp(member, "recovery") == 0) {
+    long dims[2];
+    long* out;
+    dims[0] = 1;
+    dims[1] = 3;
+    out = ypush_l(dims);
+    out[0] = obj->recovery;
+    out[1] = obj->retries;
+    out[2] = obj->recovery_budget;
+  } else if (c == 'r' && strcmp(member, "recovery_stats") == 0) {
+    transfer_stats_t* stats = &obj->stats;
+    long dims[2];
+    double* out;
+    dims[0] = 1;
+    dims[1] = 7;
+    out = ypush_d(dims);
+    pthread_mutex_lock(&obj->stats_mutex);
+    out[0] = stats->retries;
+    out[1] = stats->clear_halts;
+    out[2] = stats->resets;
+    out[3] = stats->reclaims;
+    out[4] = stats->recovered;
+    out[5] = stats->unrecovered;
+    out[6] = stats->recovery_time;
+    pthread_mutex_unlock(&obj->stats_mutex);
+  } else if (c == 'p' && strcmp(member, "pool") == 0) {
+    long dims[2];
+    long* out;
+    dims[0] = 1;
+    dims[1] = 2;
+    out = ypush_l(dims);
+    pthread_mutex_lock(&obj->pool.mutex);
+    out[0] = obj->pool.count;
+    out[1] = obj->pool.total;
+    pthread_mutex_unlock(&obj->pool.mutex);
+  } else if (c == 'h' && strcmp(member, "histogram") == 0) {
+    long dims[2];
+    long* out;
+    int k;
+    dims[0] = 1;
+    dims[1] = LATENCY_BINS;
+    out = ypush_l(dims);
+    pthread_mutex_lock(&obj->stats_mutex);
+    for (k = 0; k < LATENCY_BINS; ++k) {
+      out[k] = obj->stats.histogram[k];
+    }
+    pthread_mutex_unlock(&obj->stats_mutex);
+  } else if (c == 'e' && strcmp(member, "errors") == 0) {
+    long dims[2];
+    long* out;
+    int k;
+    dims[0] = 1;
+    dims[1] = ERROR_BINS;
+    out = ypush_l(dims);
+    pthread_mutex_lock(&obj->stats_mutex);
+    for (k = 0; k < ERROR_BINS; ++k) {
+      out[k] = obj->stats.errors[k];
+    }
+    pthread_mutex_unlock(&obj->stats_mutex);
+  } else {
+    y_error("bad member name");
+  }
+}
+
+/* Get an USB device from the stack. */
+static ydev_instance_t* get_device(int iarg)
+{
+  return (ydev_instance_t*)yget_obj(iarg, &ydev_class);
+}
+
+/* Fetch the string descriptors of the I-th device of the cached list (only
+   once). */
+static void fetch_dev_strings(context_t* uc, ssize_t i)
+{
+  char str[STRING_DESCRIPTOR_SIZE];
+  libusb_device_handle* handle;
+  dev_info_t* item;
+  int index[DEV_STRINGS];
+  int k, ret;
+
+  pthread_mutex_lock(&uc->dev_mutex);
+  item = &uc->dev_info[i];
+  if (item->fetched) {
+    pthread_mutex_unlock(&uc->dev_mutex);
+    return;
+  }
+  item->fetched = TRUE;
+  index[0] = item->descriptor.iManufacturer;
+  index[1] = item->descriptor.iProduct;
+  index[2] = item->descriptor.iSerialNumber;
+  if (libusb_open(item->device, &handle) != 0) {
+    /* Not accessible, leave strings empty. */
+    pthread_mutex_unlock(&uc->dev_mutex);
+    return;
+  }
+  for (k = 0; k < DEV_STRINGS; ++k) {
+    if (index[k] > 0) {
+      ret = get_string_descriptor(handle, index[k], str, sizeof(str));
+      if (ret > 0) {
+        str[(ret < sizeof(str) ? ret : sizeof(str) - 1)] = 0;
+        item->strings[k] = p_strcpy(str);
+      }
+    }
+  }
+  libusb_close(handle);
+  pthread_mutex_unlock(&uc->dev_mutex);
+}
+
+/* Open the I-th device of the cached list of context UC and push it on the
+   stack.  CTX_IARG is the stack position of the context object, -1 for the
+   default context. */
+static void open_device(context_t* uc, int ctx_iarg, ssize_t i)
+{
+  ydev_instance_t *obj;
+  libusb_device* dev;
+  struct timespec t0;
+  int ret;
+
+  obj = (ydev_instance_t *)ypush_obj(&ydev_class, sizeof(ydev_instance_t));
+  obj->spin_cpu = -1; /* before anything can fail, see ydev_free */
+
+  /* Copy the information from the device table and seed the cache of string
+     descriptors with the strings already read for the device list. */
+  pthread_mutex_lock(&uc->dev_mutex);
+  dev = uc->dev_info[i].device;
+  if (dev != NULL) {
+    obj->device = libusb_ref_device(dev);
+  }
+  obj->bus = uc->dev_info[i].bus;
+  obj->port = uc->dev_info[i].port;
+  obj->address = uc->dev_info[i].address;
+  obj->speed = uc->dev_info[i].speed;
+  obj->descriptor = uc->dev_info[i].descriptor;
+  strcpy(obj->path, uc->dev_info[i].path);
+  if (uc->dev_info[i].fetched) {
+    int index[DEV_STRINGS], k;
+    index[0] = obj->descriptor.iManufacturer;
+    index[1] = obj->descriptor.iProduct;
+    index[2] = obj->descriptor.iSerialNumber;
+    for (k = 0; k < DEV_STRINGS; ++k) {
+      if (index[k] > 0 && uc->dev_info[i].strings[k] != NULL) {
+        cache_string(obj, index[k], uc->dev_info[i].strings[k]);
+      }
+    }
+  }
+  pthread_mutex_unlock(&uc->dev_mutex);
+
+  if (pthread_mutex_init(&obj->stats_mutex, NULL) != 0) {
+    y_error("failed to initialize mutex");
+  }
+  obj->stats_mutex_initialized = TRUE;
+  obj->nendpoints = -1;
+  ret = init_pool(&obj->pool, TRANSFER_POOL_SIZE);
+  if (ret != 0) {
+    failure("failed to create pool of transfers", ret);
+  }
+  obj->context = uc;
+  if (ctx_iarg >= 0) {
+    obj->context_use = yget_use(ctx_iarg + 1);
+  }
+  if (dev == NULL) {
+    /* Simulated device. */
+    obj->mock = new_mock_device(i);
+  } else {
+    TRACE_START(t0);
+    ret = libusb_open(obj->device, &obj->handle);
+    TRACE_EVENT("open_device", t0, (obj->bus << 8) | obj->address, 0, ret);
+    if (ret < 0) {
+      obj->handle = NULL;
+      failure("failed to open device", ret);
+    }
+  }
+}
+
+void Y_usb_open_device(int argc)
+{
+  context_t* uc;
+  ssize_t i;
+  int bus, port, ctx_iarg;
+
+  if (argc >= 2 && is_context(argc - 1)) {
+    /* Device in a given context. */
+    ctx_iarg = argc - 1;
+    uc = get_context(ctx_iarg);
+    --argc;
+  } else {
+    ctx_iarg = -1;
+    INITIALIZE;
+    uc = &default_context;
+  }
+  if (argc == 1) {
+    /* Open by port path. */
+    const char* path = ygets_q(0);
+    load_device_list(uc);
+    i = (path != NULL ? find_by_path(uc, path) : -1);
+    if (i >= 0) {
+      open_device(uc, ctx_iarg, i);
+    } else {
+      ypush_nil();
+    }
+    return;
+  }
+  if (argc != 2) {
+    y_error("expecting 1 or 2 arguments (not counting the context)");
+  }
+  bus = ygets_i(1);
+  port = ygets_i(0);
+
+  load_device_list(uc);
+  for (i = 0; i < uc->dev_info_count; ++i) {
+    if (uc->dev_info[i].bus == bus && uc->dev_info[i].port == port) {
+      open_device(uc, ctx_iarg, i);
+      return;
+    }
+  }
+  ypush_nil();
+}
+
+void Y__usb_open_by_id(int argc)
+{
+  context_t* uc;
+  const char* serial;
+  long slot;
+  ssize_t i;
+  int vendor, product;
+
+  if (argc != 4) {
+    y_error("expecting exactly 4 arguments");
+  }
+  vendor = ygets_i(3);
+  product = ygets_i(2);
+  serial = (yarg_nil(1) ? NULL : ygets_q(1));
+  uc = get_context(0);
+
+  load_device_list(uc);
+  slot = -1;
+  while ((i = find_by_id(uc, vendor, product, &slot)) >= 0) {
+    if (serial != NULL) {
+      /* Strings are only read once per device. */
+      fetch_dev_strings(uc, i);
+      if (uc->dev_info[i].strings[2] == NULL ||
+          strcmp(uc->dev_info[i].strings[2], serial) != 0) {
+        continue;
+      }
+    }
+    open_device(uc, (uc == &default_context ? -1 : 0), i);
+    return;
+  }
+  ypush_nil();
+}
+
+#define PROBE_FIELDS 9
+#define PROBE_STRINGS (DEV_STRINGS + 1)
+
+void Y__usb_probe_devices(int argc)
+{
+  context_t* uc;
+  dev_info_t* info;
+  long dims[3], info_index;
+  int* data;
+  char** str;
+  int i, k, strings;
+
+  if (argc == 1) {
+    if (! yarg_nil(0)) {
+      y_error("expecting exactly one nil argument");
+    }
+    info_index = -1L;
+    strings = FALSE;
+    uc = get_context(0);
+  } else if (argc == 3) {
+    info_index = yget_ref(2);
+    if (info_index < 0L) {
+      y_error("expecting a simple variable reference");
+    }
+    strings = yarg_true(1);
+    uc = get_context(0);
+  } else {
+    y_error("expecting 1 or 3 arguments");
+    return;
+  }
+  load_device_list(uc);
+  if (uc->dev_info_count <= 0) {
+    ypush_nil();
+    return;
+  }
+  info = uc->dev_info;
+
+  /* Strings: port path, manufacturer, product and serial number. */
+  if (info_index >= 0L) {
+    dims[0] = 2;
+    dims[1] = PROBE_STRINGS;
+    dims[2] = uc->dev_info_count;
+    str = ypush_q(dims);
+    for (i = 0; i < uc->dev_info_count; ++i) {
+      str[0] = p_strcpy(info[i].path);
+      if (strings) {
+        fetch_dev_strings(uc, i);
+        for (k = 0; k < DEV_STRINGS; ++k) {
+          str[k + 1] = p_strcpy(info[i].strings[k] != NULL ?
+                                info[i].strings[k] : "");
+        }
+      }
+      str += PROBE_STRINGS;
+    }
+    yput_global(info_index, 0);
+    yarg_drop(1);
+  }
+
+  /* Numerical fields. */
+  dims[0] = 2;
+  dims[1] = PROBE_FIELDS;
+  dims[2] = uc->dev_info_count;
+  data = ypush_i(dims);
+  for (i = 0; i < uc->dev_info_count; ++i) {
+    const struct libusb_device_descriptor* desc = &info[i].descriptor;
+    data[0] = info[i].bus;
+    data[1] = info[i].port;
+    data[2] = info[i].address;
+    data[3] = desc->idVendor;
+    data[4] = desc->idProduct;
+    data[5] = desc->iManufacturer;
+    data[6] = desc->iSerialNumber;
+    data[7] = info[i].speed;
+    data[8] = desc->iProduct;
+    data += PROBE_FIELDS;
+  }
+}
+
+void Y_usb_refresh_devices(int argc)
+{
+  context_t* uc;
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
+  }
+  uc = get_context(0);
+  free_dev_list(uc);
+  load_device_list(uc);
+  ypush_long(uc->dev_info_count);
+}
+
+void Y_usb_hotplug_supported(int argc)
+{
+  if (argc != 1 || ! yarg_nil(0)) {
+    y_error("expecting exactly one nil argument");
+  }
+  INITIALIZE;
+  ypush_int(default_context.hotplug_supported);
+}
+
+void Y_usb_get_string(int argc)
+{
+  ydev_instance_t* obj;
+  const char* str;
+  int index, code;
+
+  if (argc != 2) {
+    y_error("expecting exactly 2 arguments");
+  }
+  obj = get_device(1);
+  index = ygets_i(0);
+
+  str = get_cached_string(obj, index, &code);
+  if (str == NULL) {
+    ypush_int(code);
+  } else {
+    push_string(str);
+  }
+}
+
+void Y_usb_claim_interface(int argc)
+{
+  ydev_instance_t* obj;
+  int interface_number;
+  int ret;
+
+  if (argc != 2) {
+    y_error("expecting exactly 2 arguments");
+  }
+  obj = get_device(1);
+  interface_number = ygets_i(0);
+
+  ret = (obj->mock != NULL ? 0 :
+         libusb_claim_interface(obj->handle, interface_number));
+  if (ret == 0 && interface_number >= 0 && interface_number < 32) {
+    obj->claimed |= (1U << interface_number);
+  }
+  if (ret < 0 && yarg_subroutine()) {
+    failure(NULL, ret);
+  }
+  ypush_int(ret);
+}
+
+void Y_usb_release_interface(int argc)
+{
+  ydev_instance_t* obj;
+  int interface_number;
+  int ret;
+
+  if (argc != 2) {
+    y_error("expecting exactly 2 arguments");
+  }
+  obj = get_device(1);
+  interface_number = ygets_i(0);
+
+
+  ret = (obj->mock != NULL ? 0 :
+         libusb_release_interface(obj->handle, interface_number));
+  if (ret == 0 && interface_number >= 0 && interface_number < 32) {
+    obj->claimed &= ~(1U << interface_number);
+  }
+  if (ret < 0 && yarg_subroutine()) {
+    failure(NULL, ret);
+  }
+  ypush_int(ret);
+}
+
+void Y_usb_enable_stats(int argc)
+{
+  ydev_instance_t* obj;
+  int flag;
+
+  if (argc != 2) {
+    y_error("expecting exactly 2 arguments");
+  }
+  obj = get_device(1);
+  flag = yarg_true(0);
+  if (flag && ! obj->stats_enabled) {
+    reset_stats(obj);
+  }
+  obj->stats_enabled = flag;
+  ypush_nil();
+}
+
+void Y_usb_reset_stats(int argc)
+{
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
+  }
+  reset_stats(get_device(0));
+  ypush_nil();
+}
+
+/*--------------------------------------------------------------------------*/
+/* TRANSFER BUFFERS */
+
+/* A transfer buffer is either a registered Yorick array (the buffer holds a
+   reference on the array to keep it alive) or memory owned by the buffer
+   (possibly allocated by libusb_dev_mem_alloc for zero-copy DMA). */
+typedef struct _ybuf_instance ybuf_instance_t;
+struct _ybuf_instance {
+  unsigned char* data;
+  long size;
+  void* array_use;  /* use of the registered array */
+  void* device_use; /* use of the device object for device memory */
+  libusb_device_handle* handle; /* device handle for device memory */
+};
+
+static void ybuf_free(void *);
+static void ybuf_print(void *);
+static void ybuf_eval(void *, int);
+static void ybuf_extract(void *, char *);
+
+static y_userobj_t ybuf_class = {
+  "USB Buffer",
+  ybuf_free,
+  ybuf_print,
+  ybuf_eval,
+  ybuf_extract,
+  NULL
+};
+
+static void ybuf_free(void *self)
+{
+  ybuf_instance_t *obj = (ybuf_instance_t *)self;
+  if (obj->array_use != NULL) {
+    ydrop_use(obj->array_use);
+  } else if (obj->data != NULL) {
+#ifdef HAVE_LIBUSB_DEV_MEM
+    if (obj->handle != NULL) {
+      libusb_dev_mem_free(obj->handle, obj->data, obj->size);
+    } else {
+      p_free(obj->data);
+    }
+#else
+    p_free(obj->data);
+#endif
+  }
+  if (obj->device_use != NULL) {
+    ydrop_use(obj->device_use);
+  }
+}
+
+static void ybuf_print(void *self)
+{
+  ybuf_instance_t *obj = (ybuf_instance_t *)self;
+  char buf[128];
+  y_print(ybuf_class.type_name, 0);
+  sprintf(buf, ": size=%ld, %s", obj->size,
+          (obj->array_use != NULL ? "registered array" :
+           (obj->handle != NULL ? "device memory" : "host memory")));
+  y_print(buf, 1);
+}
+
+/* Calling the buffer object as a function, with no arguments, yields a copy
+   of its contents as an array of char's. */
+static void ybuf_eval(void *self, int argc)
+{
+  ybuf_instance_t *obj = (ybuf_instance_t *)self;
+  long dims[2];
+  if (argc > 1 || (argc == 1 && ! yarg_nil(0))) {
+    y_error("expecting no arguments");
+  }
+  if (obj->size > 0) {
+    dims[0] = 1;
+    dims[1] = obj->size;
+    memcpy(ypush_c(dims), obj->data, obj->size);
+  } else {
+    ypush_nil();
+  }
+}
+
+static void ybuf_extract(void *addr, char *member)
+{
+  ybuf_instance_t *obj = (ybuf_instance_t *)addr;
+  int c = (member != NULL ? member[0] : '\0');
+  if (c == 's' && strcmp(member, "size") == 0) {
+    ypush_long(obj->size);
+  } else if (c == 'd' && strcmp(member, "devmem") == 0) {
+    ypush_int(obj->handle != NULL);
+  } else if (c == 'a' && strcmp(member, "array") == 0) {
+    if (obj->array_use != NULL) {
+      ypush_use(obj->array_use);
+    } else {
+      ypush_nil();
+    }
+  } else {
+    y_error("bad member name");
+  }
+}
+
+/* Get an USB buffer from the stack. */
+static ybuf_instance_t* get_buffer(int iarg)
+{
+  return (ybuf_instance_t*)yget_obj(iarg, &ybuf_class);
+}
+
+static long get_type_size(int type)
+{
+  switch(type) {
+  case Y_CHAR:
+    return sizeof(char);
+  case Y_SHORT:
+    return sizeof(short);
+  case Y_INT:
+    return sizeof(int);
+  case Y_LONG:
+    return sizeof(long);
+  case Y_FLOAT:
+    return sizeof(float);
+  case Y_DOUBLE:
+    return sizeof(double);
+  case Y_COMPLEX:
+    return 2*sizeof(double);
+  default:
+    y_error("bad data type");
+    return 0;
+  }
+}
+
+void Y_usb_buffer(int argc)
+{
+  ybuf_instance_t* obj;
+  ydev_instance_t* dev;
+  void* data;
+  long ntot, size;
+  int type;
+
+  if (argc == 1) {
+    /* Register an existing array. */
+    if (yarg_rank(0) <= 0) {
+      y_error("expecting a non-scalar array");
+    }
+    data = ygeta_any(0, &ntot, NULL, &type);
+    size = get_type_size(type)*ntot;
+    obj = (ybuf_instance_t *)ypush_obj(&ybuf_class, sizeof(ybuf_instance_t));
+    obj->array_use = yget_use(1);
+    obj->data = (unsigned char*)data;
+    obj->size = size;
+  } else if (argc == 2) {
+    /* Allocate memory for a given device. */
+    dev = get_device(1);
+    size = ygets_l(0);
+    if (size <= 0) {
+      y_error("invalid buffer size");
+    }
+    obj = (ybuf_instance_t *)ypush_obj(&ybuf_class, sizeof(ybuf_instance_t));
+#ifdef HAVE_LIBUSB_DEV_MEM
+    obj->data = (dev->handle != NULL ?
+                 libusb_dev_mem_alloc(dev->handle, size) : NULL);
+    if (obj->data != NULL) {
+      obj->device_use = yget_use(2);
+      obj->handle = dev->handle;
+    }
+#endif
+    if (obj->data == NULL) {
+      /* Device memory not supported, fall back to ordinary memory. */
+      obj->data = (unsigned char*)p_malloc(size);
+    }
+    obj->size = size;
+    memset(obj->data, 0, size);
+  } else {
+    y_error("expecting 1 or 2 arguments");
+  }
+}
+
+void Y_usb_buffer_store(int argc)
+{
+  ybuf_instance_t* obj;
+  void* data;
+  long ntot, size, offset;
+  int type;
+
+  if (argc != 2 && argc != 3) {
+    y_error("expecting 2 or 3 arguments");
+  }
+  obj = get_buffer(argc - 1);
+  data = ygeta_any(argc - 2, &ntot, NULL, &type);
+  size = get_type_size(type)*ntot;
+  offset = (argc >= 3 ? ygets_l(0) : 0);
+  if (offset < 0 || offset + size > obj->size) {
+    y_error("out of range offset or too many data");
+  }
+  if (obj->data + offset != data) {
+    memmove(obj->data + offset, data, size);
+  }
+  ypush_long(size);
+}
+
+static void* get_data(int iarg, long* the_size)
+{
+  ybuf_instance_t* buf;
+  void* data;
+  long size, ntot;
+  int type;
+
+  data = NULL;
+  size = 0;
+  if (yarg_typeid(iarg) == Y_OPAQUE) {
+    /* Fast path for transfer buffers. */
+    buf = get_buffer(iarg);
+    data = buf->data;
+    size = buf->size;
+  } else if (! yarg_nil(iarg)) {
+    data = ygeta_any(iarg, &ntot, NULL, &type);
+    size = get_type_size(type)*ntot;
+  }
+  if (the_size != NULL) {
+    *the_size = size;
+  }
+  return data;
+}
+
+/*--------------------------------------------------------------------------*/
+/* BINARY PACKING */
+
+/* Payloads are described by a format string made of items.  Each item is an
+   optional repeat count (decimal digits or '*') followed by a code:
+
+     x - skip a byte (left unchanged by packing)
+     b, B - signed/unsigned 8-bit integer
+     h, H - signed/unsigned 16-bit integer
+     i, I - signed/unsigned 32-bit integer
+     q, Q - signed/unsigned 64-bit integer
+     f, d - IEEE single/double precision floating-point
+
+   The characters '<', '>' and '=' select little-endian, big-endian and
+   native byte order for the next items (little-endian is the default).
+   Spaces are ignored.  Integers are saturated to the range of their code,
+   floating-point values are rounded to the nearest integer. */
+#define PACK_NONE   -1L /* no repeat count */
+#define PACK_REST   -2L /* '*' repeat count */
+
+typedef struct _pack_item pack_item_t;
+struct _pack_item {
+  int code;
+  int size;  /* number of bytes per element */
+  int big;   /* big-endian byte order? */
+  long count;
+};
+
+static int native_big_endian(void)
+{
+  static const union { int i; char c; } order = {1};
+  return ! order.c;
+}
+
+/* Parse the next item of the format at *FMT, BIG is the current byte
+   order.  Returns false at the end of the format. */
+static int next_pack_item(const char** fmt, int* big, pack_item_t* item)
+{
+  const char* p = *fmt;
+  int c;
+
+  for (;;) {
+    c = *p;
+    if (c == '<') {
+      *big = FALSE;
+    } else if (c == '>') {
+      *big = TRUE;
+    } else if (c == '=') {
+      *big = native_big_endian();
+    } else if (c != ' ') {
+      break;
+    }
+    ++p;
+  }
+  if (c == '\0') {
+    *fmt = p;
+    return FALSE;
+  }
+  if (c == '*') {
+    item->count = PACK_REST;
+    c = *++p;
+  } else if (c >= '0' && c <= '9') {
+    item->count = 0;
+    while (c >= '0' && c <= '9') {
+      if (item->count > 0x7fffffffL/10) {
+        y_error("too large repeat count in format");
+      }
+      item->count = 10*item->count + (c - '0');
+      c = *++p;
+    }
+  } else {
+    item->count = PACK_NONE;
+  }
+  switch (c) {
+  case 'x': case 'b': case 'B':
+    item->size = 1;
+    break;
+  case 'h': case 'H':
+    item->size = 2;
+    break;
+  case 'i': case 'I': case 'f':
+    item->size = 4;
+    break;
+  case 'q': case 'Q': case 'd':
+    item->size = 8;
+    break;
+  default:
+    y_error("invalid code in format");
+  }
+  item->code = c;
+  item->big = *big;
+  *fmt = p + 1;
+  return TRUE;
+}
+
+/* Store N unsigned integers of SIZE bytes.  The loops have no dependencies
+   between iterations so that the compiler can vectorize them. */
+#define STORE_UNSIGNED(dst, n, size, big, value)                      \
+  do {                                                                \
+    long _i;                                                          \
+    int _k;                                                           \
+    for (_i = 0; _i < (n); ++_i) {                                    \
+      unsigned long _u = (value);                                     \
+      unsigned char* _p = (dst) + _i*(size);                          \
+      for (_k = 0; _k < (size); ++_k) {                              \
+        _p[(big) ? (size) - 1 - _k : _k] = (unsigned char)(_u >> 8*_k); \
+      }                                                               \
+    }                                                                 \
+  } while (0)
+
+/* Limits of the integer codes (as long integers). */
+static void get_pack_limits(int code, long* lo, long* hi)
+{
+  switch (code) {
+  case 'b': *lo = -128L;        *hi = 127L;        break;
+  case 'B': *lo = 0L;           *hi = 255L;        break;
+  case 'h': *lo = -32768L;      *hi = 32767L;      break;
+  case 'H': *lo = 0L;           *hi = 65535L;      break;
+  case 'i': *lo = -2147483647L - 1L; *hi = 2147483647L; break;
+  case 'I': *lo = 0L;           *hi = 4294967295L; break;
+  case 'Q': *lo = 0L;           *hi = LONG_MAX;    break;
+  default:  *lo = LONG_MIN;     *hi = LONG_MAX;    break;
+  }
+}
+
+/* Pack N elements of integer source SRC (with stride STEP, 0 to repeat a
+   scalar) according to ITEM. */
+static void pack_integers(unsigned char* dst, const pack_item_t* item,
+                          const long* src, long step, long n)
+{
+  long lo, hi;
+  get_pack_limits(item->code, &lo, &hi);
+  STORE_UNSIGNED(dst, n, item->size, item->big,
+                 (unsigned long)(src[_i*step] < lo ? lo :
+                                 (src[_i*step] > hi ? hi : src[_i*step])));
+}
+
+/* Round X to the nearest integer in [LO,HI], NaN's yield 0. */
+static long round_saturate(double x, double lo, double hi)
+{
+  if (x != x) {
+    return 0L;
+  }
+  return (long)(x <= lo ? lo : (x >= hi ? hi :
+                                (x >= 0.0 ? x + 0.5 : x - 0.5)));
+}
+
+/* Same as pack_integers for a floating-point source. */
+static void pack_reals(unsigned char* dst, const pack_item_t* item,
+                       const double* src, long step, long n)
+{
+  union { float f; unsigned int u; } f32;
+  union { double d; unsigned char c[8]; } f64;
+  double lo, hi;
+  long i, l, h;
+  int k, swap;
+
+  if (item->code == 'f') {
+    for (i = 0; i < n; ++i) {
+      f32.f = (float)src[i*step];
+      STORE_UNSIGNED(dst + 4*i, 1, 4, item->big, (unsigned long)f32.u);
+    }
+  } else if (item->code == 'd') {
+    swap = (item->big != native_big_endian());
+    for (i = 0; i < n; ++i) {
+      f64.d = src[i*step];
+      for (k = 0; k < 8; ++k) {
+        dst[8*i + k] = f64.c[swap ? 7 - k : k];
+      }
+    }
+  } else {
+    get_pack_limits(item->code, &l, &h);
+    lo = (double)l;
+    /* Largest double strictly smaller than 2^63 for 64-bit codes. */
+    hi = (item->size == 8 ? 9223372036854774784.0 : (double)h);
+    STORE_UNSIGNED(dst, n, item->size, item->big,
+                   (unsigned long)round_saturate(src[_i*step], lo, hi));
+  }
+}
+
+void Y_usb_pack(int argc)
+{
+  const char* fmt;
+  const char* p;
+  pack_item_t item;
+  unsigned char* data;
+  long size, offset, ntot, n;
+  int big, iarg, type;
+
+  if (argc < 2) {
+    y_error("expecting at least 2 arguments");
+  }
+  data = (unsigned char*)get_data(argc - 1, &size);
+  fmt = ygets_q(argc - 2);
+  if (fmt == NULL) {
+    y_error("invalid format");
+  }
+
+  /* Check the format and the arguments before writing anything. */
+  p = fmt;
+  big = FALSE;
+  offset = 0;
+  iarg = argc - 2;
+  while (next_pack_item(&p, &big, &item)) {
+    if (item.code == 'x') {
+      if (item.count == PACK_REST) {
+        y_error("invalid repeat count for 'x'");
+      }
+      n = (item.count == PACK_NONE ? 1 : item.count);
+    } else {
+      if (--iarg < 0) {
+        y_error("too few arguments for format");
+      }
+      type = yarg_typeid(iarg);
+      if (type < Y_CHAR || type > Y_DOUBLE) {
+        y_error("expecting integer or real values");
+      }
+      ygeta_any(iarg, &ntot, NULL, NULL);
+      n = ((item.count < 0 || ntot != 1) ? ntot : item.count);
+      if (item.count >= 0 && n != item.count) {
+        y_error("bad number of values for repeat count");
+      }
+    }
+    offset += n*item.size;
+    if (offset > size) {
+      y_error("packed data do not fit in the buffer");
+    }
+  }
+  if (iarg > 0) {
+    y_error("too many arguments for format");
+  }
+
+  /* Pack the values. */
+  p = fmt;
+  big = FALSE;
+  offset = 0;
+  iarg = argc - 2;
+  while (next_pack_item(&p, &big, &item)) {
+    if (item.code == 'x') {
+      n = (item.count == PACK_NONE ? 1 : item.count);
+    } else {
+      --iarg;
+      type = yarg_typeid(iarg);
+      if (type == Y_FLOAT || type == Y_DOUBLE ||
+          item.code == 'f' || item.code == 'd') {
+        const double* src = ygeta_d(iarg, &ntot, NULL);
+        n = (item.count >= 0 ? item.count : ntot);
+        pack_reals(data + offset, &item, src, (ntot > 1 ? 1 : 0), n);
+      } else {
+        const long* src = ygeta_l(iarg, &ntot, NULL);
+        n = (item.count >= 0 ? item.count : ntot);
+        pack_integers(data + offset, &item, src, (ntot > 1 ? 1 : 0), n);
+      }
+    }
+    offset += n*item.size;
+  }
+  ypush_long(offset);
+}
+
+void Y_usb_unpack(int argc)
+{
+  const char* fmt;
+  const char* p;
+  pack_item_t item;
+  const unsigned char* data;
+  const unsigned char* q;
+  union { float f; unsigned int u; } f32;
+  union { double d; unsigned char c[8]; } f64;
+  unsigned long u;
+  long size, offset, dims[2], index, n, i;
+  int big, iarg, k, swap;
+
+  if (argc < 2) {
+    y_error("expecting at least 2 arguments");
+  }
+  data = (const unsigned char*)get_data(argc - 1, &size);
+  fmt = ygets_q(argc - 2);
+  if (fmt == NULL) {
+    y_error("invalid format");
+  }
+
+  /* Check the format, the size of the data and the variables before
+     assigning anything. */
+  p = fmt;
+  big = FALSE;
+  offset = 0;
+  iarg = argc - 2;
+  while (next_pack_item(&p, &big, &item)) {
+    if (item.count == PACK_REST) {
+      n = (size - offset)/item.size;
+    } else {
+      n = (item.count == PACK_NONE ? 1 : item.count);
+    }
+    if (offset + n*item.size > size) {
+      y_error("format requires more data");
+    }
+    if (item.code != 'x') {
+      if (--iarg < 0) {
+        y_error("too few variables for format");
+      }
+      if (yget_ref(iarg) < 0L) {
+        y_error("expecting a simple variable reference");
+      }
+    }
+    offset += n*item.size;
+  }
+  if (iarg > 0) {
+    y_error("too many variables for format");
+  }
+
+  /* Unpack the values. */
+  p = fmt;
+  big = FALSE;
+  offset = 0;
+  iarg = argc - 2;
+  while (next_pack_item(&p, &big, &item)) {
+    if (item.count == PACK_REST) {
+      n = (size - offset)/item.size;
+    } else {
+      n = (item.count == PACK_NONE ? 1 : item.count);
+    }
+    if (item.code == 'x') {
+      offset += n;
+      continue;
+    }
+    index = yget_ref(--iarg);
+    dims[0] = (item.count == PACK_NONE ? 0 : 1);
+    dims[1] = n;
+    q = data + offset;
+    swap = (item.big != native_big_endian());
+    if (item.code == 'f') {
+      float* dst = ypush_f(dims);
+      for (i = 0; i < n; ++i, q += 4) {
+        for (u = 0, k = 0; k < 4; ++k) {
+          u |= (unsigned long)q[item.big ? 3 - k : k] << 8*k;
+        }
+        f32.u = (unsigned int)u;
+        dst[i] = f32.f;
+      }
+    } else if (item.code == 'd') {
+      double* dst = ypush_d(dims);
+      for (i = 0; i < n; ++i, q += 8) {
+        for (k = 0; k < 8; ++k) {
+          f64.c[k] = q[swap ? 7 - k : k];
+        }
+        dst[i] = f64.d;
+      }
+    } else {
+      /* Signed and unsigned integers of at most 16 bits and signed 32-bit
+         integers yield int's, the others yield long's. */
+      int sign = (item.code >= 'a');
+      int bits = 8*item.size;
+      if (item.size < 4 || (item.size == 4 && sign)) {
+        int* dst = ypush_i(dims);
+        for (i = 0; i < n; ++i, q += item.size) {
+          for (u = 0, k = 0; k < item.size; ++k) {
+            u |= (unsigned long)q[item.big ? item.size - 1 - k : k] << 8*k;
+          }
+          if (sign && (u >> (bits - 1)) != 0) {
+            dst[i] = (int)((long)u - (1L << bits));
+          } else {
+            dst[i] = (int)u;
+          }
+        }
+      } else {
+        long* dst = ypush_l(dims);
+        for (i = 0; i < n; ++i, q += item.size) {
+          for (u = 0, k = 0; k < item.size; ++k) {
+            u |= (unsigned long)q[item.big ? item.size - 1 - k : k] << 8*k;
+          }
+          if (sign && bits < 64 && (u >> (bits - 1)) != 0) {
+            dst[i] = (long)u - (1L << bits);
+          } else {
+            dst[i] = (long)u;
+          }
+        }
+      }
+    }
+    yput_global(index, 0);
+    yarg_drop(1);
+    offset += n*item.size;
+  }
+  ypush_long(offset);
+}
+
+/*--------------------------------------------------------------------------*/
+/* TRAFFIC CAPTURE */
+
+/* When capture is enabled, every control, bulk and interrupt transfer is
+   logged into a preallocated ring of records (and, optionally, up to a
+   given number of bytes of its payload).  Records are added by the
+   interpreter thread for synchronous transfers and by whichever thread
+   processes USB events for asynchronous ones, the mutex is only held while
+   filling one record.  There are two rings: dumping the records swaps the
+   rings under the lock and writes the inactive one, so producers are never
+   blocked by file I/O.  When a ring is full, the oldest records are
+   overwritten (and counted as lost).
+
+   The dump file is little-endian and column-oriented (to be easily read by
+   Yorick or any other program):
+
+     header: 8-char magic "YUSBCAP", then 6 int's: version, COUNT,
+             PAYLOAD (max. number of payload bytes per record), number of
+             lost records, 2 reserved
+     columns of COUNT values each:
+             time, latency (doubles, in seconds),
+             length, result, transferred, timeout, payload (int's),
+             value, index (unsigned short's),
+             bus, address, type, endpoint, request_type, request,
+             async (unsigned char's)
+     payloads: COUNT blocks of PAYLOAD bytes
+*/
+
+#define CAPTURE_VERSION 1
+
+static int get_status_result(enum libusb_transfer_status status);
+
+typedef struct _capture_record capture_record_t;
+struct _capture_record {
+  double time;       /* start time (same origin as usb_clock) */
+  double latency;    /* duration of the transfer */
+  int length;        /* requested length */
+  int result;        /* result as returned by libusb synchronous API */
+  int transferred;   /* number of transferred bytes */
+  int timeout;       /* timeout in milliseconds */
+  int payload;       /* number of captured payload bytes */
+  unsigned short value, index; /* setup fields of control transfers */
+  unsigned char bus, address;
+  unsigned char type, endpoint;
+  unsigned char request_type, request; /* setup fields */
+  unsigned char async; /* asynchronous transfer? */
+};
+
+static struct {
+  volatile int enabled;
+  pthread_mutex_t mutex;
+  capture_record_t* records[2];
+  unsigned char* payloads[2];
+  long capacity;    /* number of records per ring */
+  long payload_max; /* max. number of payload bytes per record */
+  long next;        /* index of next record in active ring */
+  long count;       /* number of records in active ring */
+  long lost;        /* number of overwritten records */
+  int active;       /* index of active ring */
+} capture = {FALSE, PTHREAD_MUTEX_INITIALIZER};
+
+/* Log a transfer started at time T0.  DATA is the payload (may be NULL). */
+static void capture_transfer(ydev_instance_t* dev, const struct timespec* t0,
+                             int type, int endpoint, int request_type,
+                             int request, int value, int index,
+                             const unsigned char* data, int length,
+                             int result, int transferred,
+                             unsigned int timeout, int async)
+{
+  struct timespec t1;
+  capture_record_t* rec;
+  long slot, n;
+
+  get_time(&t1);
+  pthread_mutex_lock(&capture.mutex);
+  if (capture.enabled) {
+    slot = capture.next;
+    capture.next = (slot + 1)%capture.capacity;
+    if (capture.count < capture.capacity) {
+      ++capture.count;
+    } else {
+      ++capture.lost;
+    }
+    rec = &capture.records[capture.active][slot];
+    rec->time = (double)t0->tv_sec + 1E-9*(double)t0->tv_nsec;
+    rec->latency = elapsed_seconds(t0, &t1);
+    rec->length = length;
+    rec->result = result;
+    rec->transferred = transferred;
+    rec->timeout = (int)timeout;
+    rec->value = (unsigned short)value;
+    rec->index = (unsigned short)index;
+    rec->bus = (unsigned char)dev->bus;
+    rec->address = (unsigned char)dev->address;
+    rec->type = (unsigned char)type;
+    rec->endpoint = (unsigned char)endpoint;
+    rec->request_type = (unsigned char)request_type;
+    rec->request = (unsigned char)request;
+    rec->async = (unsigned char)async;
+    n = ((endpoint & LIBUSB_ENDPOINT_IN) != 0 ||
+         (type == LIBUSB_TRANSFER_TYPE_CONTROL &&
+          (request_type & LIBUSB_ENDPOINT_IN) != 0) ? transferred : length);
+    if (n > capture.payload_max) {
+      n = capture.payload_max;
+    }
+    if (data == NULL || n < 0) {
+      n = 0;
+    }
+    rec->payload = (int)n;
+    if (n > 0) {
+      memcpy(capture.payloads[capture.active] + slot*capture.payload_max,
+             data, n);
+    }
+  }
+  pthread_mutex_unlock(&capture.mutex);
+}
+
+/* Log a completed asynchronous transfer (not an isochronous one). */
+static void capture_completion(ydev_instance_t* dev,
+                               const struct timespec* start,
+                               const struct libusb_transfer* transfer)
+{
+  const unsigned char* setup; /* little-endian setup packet */
+  int ret = get_status_result(transfer->status);
+  if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+    if (ret == 0) {
+      ret = transfer->actual_length;
+    }
+    setup = transfer->buffer;
+    capture_transfer(dev, start, transfer->type, transfer->endpoint,
+                     setup[0], setup[1], setup[2] | (setup[3] << 8),
+                     setup[4] | (setup[5] << 8),
+                     transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+                     transfer->length - LIBUSB_CONTROL_SETUP_SIZE,
+                     ret, transfer->actual_length, transfer->timeout, TRUE);
+  } else if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    capture_transfer(dev, start, transfer->type, transfer->endpoint,
+                     0, 0, 0, 0, transfer->buffer, transfer->length,
+                     ret, transfer->actual_length, transfer->timeout, TRUE);
+  }
+}
+
+static void free_capture(void)
+{
+  int j;
+  for (j = 0; j < 2; ++j) {
+    if (capture.records[j] != NULL) {
+      p_free(capture.records[j]);
+      capture.records[j] = NULL;
+    }
+    if (capture.payloads[j] != NULL) {
+      p_free(capture.payloads[j]);
+      capture.payloads[j] = NULL;
+    }
+  }
+  capture.capacity = 0;
+  capture.payload_max = 0;
+}
+
+/* Write SIZE bytes of the native value at SRC in little-endian order. */
+static int write_le(FILE* file, const void* src, size_t size)
+{
+  static const union { int i; char c; } order = {1};
+  const unsigned char* p = (const unsigned char*)src;
+  unsigned char buf[8];
+  size_t k;
+  if (order.c) {
+    return (fwrite(p, 1, size, file) == size ? 0 : -1);
+  }
+  for (k = 0; k < size; ++k) {
+    buf[k] = p[size - 1 - k];
+  }
+  return (fwrite(buf, 1, size, file) == size ? 0 : -1);
+}
+
+#define CAPTURE_COLUMN(T, member)                                       \
+  for (k = 0; k < count && status == 0; ++k) {                          \
+    T value = (T)records[(first + k)%capacity].member;                  \
+    status = write_le(file, &value, sizeof(value));                     \
+  }
+
+/* Write COUNT records of a ring, starting at index FIRST. */
+static int write_capture(FILE* file, const capture_record_t* records,
+                         const unsigned char* payloads, long capacity,
+                         long payload_max, long first, long count, long lost)
+{
+  static const char magic[8] = "YUSBCAP";
+  int header[6];
+  long k;
+  int j, status;
+
+  header[0] = CAPTURE_VERSION;
+  header[1] = (int)count;
+  header[2] = (int)payload_max;
+  header[3] = (int)lost;
+  header[4] = 0;
+  header[5] = 0;
+  status = (fwrite(magic, 1, 8, file) == 8 ? 0 : -1);
+  for (j = 0; j < 6 && status == 0; ++j) {
+    status = write_le(file, &header[j], sizeof(int));
+  }
+  CAPTURE_COLUMN(double, time);
+  CAPTURE_COLUMN(double, latency);
+  CAPTURE_COLUMN(int, length);
+  CAPTURE_COLUMN(int, result);
+  CAPTURE_COLUMN(int, transferred);
+  CAPTURE_COLUMN(int, timeout);
+  CAPTURE_COLUMN(int, payload);
+  CAPTURE_COLUMN(unsigned short, value);
+  CAPTURE_COLUMN(unsigned short, index);
+  CAPTURE_COLUMN(unsigned char, bus);
+  CAPTURE_COLUMN(unsigned char, address);
+  CAPTURE_COLUMN(unsigned char, type);
+  CAPTURE_COLUMN(unsigned char, endpoint);
+  CAPTURE_COLUMN(unsigned char, request_type);
+  CAPTURE_COLUMN(unsigned char, request);
+  CAPTURE_COLUMN(unsigned char, async);
+  for (k = 0; k < count && status == 0 && payload_max > 0; ++k) {
+    if (fwrite(payloads + ((first + k)%capacity)*payload_max, 1,
+               payload_max, file) != (size_t)payload_max) {
+      status = -1;
+    }
+  }
+  return status;
+}
+
+#undef CAPTURE_COLUMN
+
+void Y__usb_capture_start(int argc)
+{
+  long capacity, payload_max;
+  int j;
+
+  if (argc != 2) {
+    y_error("expecting exactly 2 arguments");
+  }
+  capacity = ygets_l(1);
+  payload_max = (yarg_nil(0) ? 0 : ygets_l(0));
+  if (capacity < 1) {
+    y_error("invalid capture capacity");
+  }
+  if (payload_max < 0) {
+    y_error("invalid maximum payload size");
+  }
+  pthread_mutex_lock(&capture.mutex);
+  capture.enabled = FALSE;
+  pthread_mutex_unlock(&capture.mutex);
+  if (capacity != capture.capacity || payload_max != capture.payload_max) {
+    free_capture();
+    for (j = 0; j < 2; ++j) {
+      capture.records[j] = (capture_record_t*)p_malloc(capacity*
+                                                   sizeof(capture_record_t));
+      if (payload_max > 0) {
+        capture.payloads[j] = (unsigned char*)p_malloc(capacity*payload_max);
+      }
+    }
+    capture.capacity = capacity;
+    capture.payload_max = payload_max;
+  }
+  pthread_mutex_lock(&capture.mutex);
+  capture.next = 0;
+  capture.count = 0;
+  capture.lost = 0;
+  capture.enabled = TRUE;
+  pthread_mutex_unlock(&capture.mutex);
+  ypush_nil();
+}
+
+void Y_usb_capture_stop(int argc)
+{
+  if (argc > 1 || (argc == 1 && ! yarg_nil(0))) {
+    y_error("expecting no arguments");
+  }
+  pthread_mutex_lock(&capture.mutex);
+  capture.enabled = FALSE;
+  pthread_mutex_unlock(&capture.mutex);
+  ypush_nil();
+}
+
+void Y_usb_capture_status(int argc)
+{
+  long dims[2];
+  long* result;
+  if (argc > 1 || (argc == 1 && ! yarg_nil(0))) {
+    y_error("expecting no arguments");
+  }
+  dims[0] = 1;
+  dims[1] = 5;
+  result = ypush_l(dims);
+  pthread_mutex_lock(&capture.mutex);
+  result[0] = capture.enabled;
+  result[1] = capture.capacity;
+  result[2] = capture.payload_max;
+  result[3] = capture.count;
+  result[4] = capture.lost;
+  pthread_mutex_unlock(&capture.mutex);
+}
+
+void Y_usb_capture_dump(int argc)
+{
+  FILE* file;
+  char* name;
+  long first, count, lost;
+  int j, status;
+
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
+  }
+  name = p_native(ygets_q(0));
+  if (capture.capacity < 1) {
+    p_free(name);
+    y_error("traffic capture has never been started");
+  }
+  file = fopen(name, "wb");
+  p_free(name);
+  if (file == NULL) {
+    y_error("cannot create capture file");
+  }
+
+  /* Swap the rings (the inactive ring is empty). */
+  pthread_mutex_lock(&capture.mutex);
+  j = capture.active;
+  count = capture.count;
+  lost = capture.lost;
+  first = (capture.next - count + capture.capacity)%capture.capacity;
+  capture.active = 1 - j;
+  capture.next = 0;
+  capture.count = 0;
+  capture.lost = 0;
+  pthread_mutex_unlock(&capture.mutex);
+
+  status = write_capture(file, capture.records[j], capture.payloads[j],
+                         capture.capacity, capture.payload_max,
+                         first, count, lost);
+  if (fclose(file) != 0) {
+    status = -1;
+  }
+  if (status != 0) {
+    y_error("failed to write capture file");
+  }
+  ypush_long(count);
+}
+
+/*--------------------------------------------------------------------------*/
+/* TRACING */
+
+/* Tracing records individual calls to libusb (their start time, duration,
+   argument and result) to correlate them with the timeline of the caller.
+   Each thread records events into its own ring of events, so recording
+   requires no locks: the owner thread is the only writer and publishes a
+   new event by incrementing the HEAD counter of its ring after a memory
+   barrier.  Rings are allocated on the first event of a thread after
+   tracing has been (re)started and are never freed (they are reused by the
+   next traces), so that dumping can read the rings of all threads.  Events
+   are exported in the Chrome trace format (JSON) which can be viewed with
+   chrome://tracing or Perfetto. */
+#ifndef YUSB_NO_TRACE
+
+typedef struct _trace_record trace_record_t;
+struct _trace_record {
+  const char* name; /* name of the event (a static string) */
+  double start;     /* start time relative to the trace origin (seconds) */
+  double duration;  /* duration (seconds) */
+  int arg;          /* endpoint or request */
+  int length;       /* requested length */
+  int result;       /* result of the call */
+};
+
+typedef struct _trace_ring trace_ring_t;
+struct _trace_ring {
+  trace_ring_t* next; /* next ring in the list of all rings */
+  trace_record_t* records;
+  long capacity;
+  volatile unsigned long head; /* number of events recorded so far */
+  unsigned long tail;          /* number of events already dumped */
+  unsigned long lost;          /* number of overwritten events */
+  int generation;              /* trace to which the ring belongs */
+  int tid;                     /* thread identifier in the trace */
+};
+
+static struct {
+  pthread_mutex_t mutex; /* to create rings and to dump them */
+  pthread_key_t key;     /* ring of the calling thread */
+  int key_created;
+  trace_ring_t* rings;
+  long capacity;    /* number of events per thread */
+  int generation;   /* incremented at each start */
+  int threads;      /* number of threads with a ring */
+  struct timespec origin;
+} trace = {PTHREAD_MUTEX_INITIALIZER};
+
+/* Get the ring of the calling thread for the current trace, NULL if the
+   ring cannot be allocated.  The standard allocator is used since this may
+   be called by any thread. */
+static trace_ring_t* get_trace_ring(void)
+{
+  trace_ring_t* ring = (trace_ring_t*)pthread_getspecific(trace.key);
+  trace_record_t* records;
+
+  if (ring != NULL && ring->generation == trace.generation) {
+    return ring;
+  }
+  pthread_mutex_lock(&trace.mutex);
+  if (ring == NULL) {
+    ring = (trace_ring_t*)malloc(sizeof(trace_ring_t));
+    if (ring == NULL) {
+      pthread_mutex_unlock(&trace.mutex);
+      return NULL;
+    }
+    memset(ring, 0, sizeof(trace_ring_t));
+    ring->tid = ++trace.threads;
+    ring->next = trace.rings;
+    trace.rings = ring;
+    pthread_setspecific(trace.key, ring);
+  }
+  if (ring->capacity != trace.capacity) {
+    records = (trace_record_t*)realloc(ring->records,
+                                       trace.capacity*sizeof(trace_record_t));
+    if (records == NULL) {
+      pthread_mutex_unlock(&trace.mutex);
+      return NULL;
+    }
+    ring->records = records;
+    ring->capacity = trace.capacity;
+  }
+  ring->head = 0;
+  ring->tail = 0;
+  ring->lost = 0;
+  ring->generation = trace.generation;
+  pthread_mutex_unlock(&trace.mutex);
+  return ring;
+}
+
+static void trace_event(const char* name, const struct timespec* t0,
+                        int arg, int length, int result)
+{
+  struct timespec t1;
+  trace_ring_t* ring;
+  trace_record_t* rec;
+
+  get_time(&t1);
+  ring = get_trace_ring();
+  if (ring == NULL) {
+    return;
+  }
+  rec = &ring->records[ring->head%ring->capacity];
+  rec->name = name;
+  rec->start = elapsed_seconds(&trace.origin, t0);
+  rec->duration = elapsed_seconds(t0, &t1);
+  rec->arg = arg;
+  rec->length = length;
+  rec->result = result;
+  TRACE_BARRIER(); /* publish the record before the counter */
+  ++ring->head;
+}
+
+void Y_usb_trace_start(int argc)
+{
+  long capacity;
+
+  if (argc > 1) {
+    y_error("expecting at most one argument");
+  }
+  capacity = (argc < 1 || yarg_nil(0) ? 65536L : ygets_l(0));
+  if (capacity < 1) {
+    y_error("invalid trace capacity");
+  }
+  pthread_mutex_lock(&trace.mutex);
+  if (! trace.key_created) {
+    if (pthread_key_create(&trace.key, NULL) != 0) {
+      pthread_mutex_unlock(&trace.mutex);
+      y_error("failed to create thread-specific key");
+    }
+    trace.key_created = TRUE;
+  }
+  trace_enabled = FALSE;
+  trace.capacity = capacity;
+  ++trace.generation;
+  get_time(&trace.origin);
+  trace_enabled = TRUE;
+  pthread_mutex_unlock(&trace.mutex);
+  ypush_nil();
+}
+
+void Y_usb_trace_stop(int argc)
+{
+  if (argc > 1 || (argc == 1 && ! yarg_nil(0))) {
+    y_error("expecting no arguments");
+  }
+  trace_enabled = FALSE;
+  ypush_nil();
+}
+
+/* Count the events recorded and lost by the rings of the current trace.
+   The caller must own the lock. */
+static void count_trace_events(long* count, long* lost)
+{
+  trace_ring_t* ring;
+  unsigned long head, n;
+
+  *count = 0;
+  *lost = 0;
+  for (ring = trace.rings; ring != NULL; ring = ring->next) {
+    if (ring->generation != trace.generation) {
+      continue;
+    }
+    head = ring->head;
+    n = head - ring->tail;
+    if (n > (unsigned long)ring->capacity) {
+      *lost += ring->lost + (n - ring->capacity);
+      n = ring->capacity;
+    } else {
+      *lost += ring->lost;
+    }
+    *count += n;
+  }
+}
+
+void Y_usb_trace_status(int argc)
+{
+  long dims[2];
+  long* result;
+  if (argc > 1 || (argc == 1 && ! yarg_nil(0))) {
+    y_error("expecting no arguments");
+  }
+  dims[0] = 1;
+  dims[1] = 5;
+  result = ypush_l(dims);
+  pthread_mutex_lock(&trace.mutex);
+  result[0] = trace_enabled;
+  result[1] = trace.capacity;
+  count_trace_events(&result[2], &result[3]);
+  result[4] = trace.threads;
+  pthread_mutex_unlock(&trace.mutex);
+}
+
+void Y_usb_trace_dump(int argc)
+{
+  FILE* file;
+  char* name;
+  trace_ring_t* ring;
+  const trace_record_t* rec;
+  unsigned long head, i;
+  long count;
+  int status;
+
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
+  }
+  name = p_native(ygets_q(0));
+  if (trace.capacity < 1) {
+    p_free(name);
+    y_error("tracing has never been started");
+  }
+  file = fopen(name, "w");
+  p_free(name);
+  if (file == NULL) {
+    y_error("cannot create trace file");
+  }
+
+  /* Write the events not yet dumped, the oldest ones may be overwritten
+     while being written if the owner thread is still recording. */
+  count = 0;
+  status = (fputs("{\"traceEvents\":[", file) < 0 ? -1 : 0);
+  pthread_mutex_lock(&trace.mutex);
+  for (ring = trace.rings; ring != NULL; ring = ring->next) {
+    if (ring->generation != trace.generation) {
+      continue;
+    }
+    head = ring->head;
+    TRACE_BARRIER(); /* read the counter before the records */
+    if (head - ring->tail > (unsigned long)ring->capacity) {
+      ring->lost += head - ring->tail - ring->capacity;
+      ring->tail = head - ring->capacity;
+    }
+    for (i = ring->tail; i < head && status == 0; ++i) {
+      rec = &ring->records[i%ring->capacity];
+      if (fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"usb\",\"ph\":\"X\","
+                  "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+                  "\"args\":{\"arg\":%d,\"length\":%d,\"result\":%d}}",
+                  (count > 0 ? "," : ""), rec->name, 1E6*rec->start,
+                  1E6*rec->duration, ring->tid, rec->arg, rec->length,
+                  rec->result) < 0) {
+        status = -1;
+      }
+      ++count;
+    }
+    ring->tail = head;
+  }
+  pthread_mutex_unlock(&trace.mutex);
+  if (status == 0 &&
+      fputs("\n],\"displayTimeUnit\":\"ns\"}\n", file) < 0) {
+    status = -1;
+  }
+  if (fclose(file) != 0) {
+    status = -1;
+  }
+  if (status != 0) {
+    y_error("failed to write trace file");
+  }
+  ypush_long(count);
+}
+
+#else /* YUSB_NO_TRACE */
+
+void Y_usb_trace_start(int argc)
+{
+  y_error("tracing has been disabled at compile time");
+}
+
+void Y_usb_trace_stop(int argc)
+{
+  ypush_nil();
+}
+
+void Y_usb_trace_status(int argc)
+{
+  long dims[2];
+  long* result;
+  dims[0] = 1;
+  dims[1] = 5;
+  result = ypush_l(dims);
+  memset(result, 0, 5*sizeof(long));
+}
+
+void Y_usb_trace_dump(int argc)
+{
+  y_error("tracing has been disabled at compile time");
+}
+
+#endif /* YUSB_NO_TRACE */
+
+/*--------------------------------------------------------------------------*/
+/* SPIN MODE */
+
+/* In spin mode, synchronous transfers of a device are submitted
+   asynchronously and their completion is busy-polled by processing USB
+   events with a zero timeout, instead of sleeping in the kernel until
+   completion.  This trades a CPU core for a reduced and more predictable
+   latency.  The timeout of the transfer is still enforced by libusb.  The
+   interpreter thread may optionally be pinned to a given CPU while spin mode
+   is enabled. */
+
+static int get_transfer_result(const struct libusb_transfer* transfer);
+
+static void LIBUSB_CALL spin_callback(struct libusb_transfer* transfer)
+{
+  *(volatile int*)transfer->user_data = TRUE;
+  COUNT_COMPLETION();
+}
+
+/* Submit TRANSFER and spin until it completes.  Returns 0 on success or an
+   error code. */
+static int spin_transfer(ydev_instance_t* dev,
+                         struct libusb_transfer* transfer)
+{
+  libusb_context* ctx = dev->context->ctx;
+  struct timeval tv;
+  volatile int completed = FALSE;
+  int ret;
+
+  transfer->user_data = (void*)&completed;
+  transfer->callback = spin_callback;
+  ret = libusb_submit_transfer(transfer);
+  if (ret != 0) {
+    return ret;
+  }
+  while (! completed) {
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    ret = libusb_handle_events_timeout_completed(ctx, &tv, (int*)&completed);
+    if (ret != 0 && ret != LIBUSB_ERROR_INTERRUPTED &&
+        ret != LIBUSB_ERROR_TIMEOUT) {
+      /* The transfer must not be released while in flight. */
+      libusb_cancel_transfer(transfer);
+      while (! completed) {
+        libusb_handle_events_completed(ctx, (int*)&completed);
+      }
+    }
+  }
+  return get_transfer_result(transfer);
+}
+
+/* Same as libusb_control_transfer in spin mode. */
+static int spin_control_transfer(ydev_instance_t* dev, int type, int request,
+                                 int value, int index, unsigned char* data,
+                                 int length, unsigned int timeout)
+{
+  unsigned char small[LIBUSB_CONTROL_SETUP_SIZE + 64];
+  unsigned char* buffer;
+  struct libusb_transfer* transfer;
+  int ret;
+
+  transfer = acquire_transfer(dev);
+  if (transfer == NULL) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  if (length <= sizeof(small) - LIBUSB_CONTROL_SETUP_SIZE) {
+    buffer = small;
+  } else {
+    buffer = (unsigned char*)malloc(LIBUSB_CONTROL_SETUP_SIZE + length);
+    if (buffer == NULL) {
+      release_transfer(dev, &transfer);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  }
+  libusb_fill_control_setup(buffer, type, request, value, index, length);
+  if ((type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT &&
+      length > 0) {
+    memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+  }
+  libusb_fill_control_transfer(transfer, dev->handle, buffer, NULL, NULL,
+                               timeout);
+  ret = spin_transfer(dev, transfer);
+  if (ret == 0) {
+    ret = transfer->actual_length;
+    if ((type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN && ret > 0) {
+      memcpy(data, buffer + LIBUSB_CONTROL_SETUP_SIZE, ret);
+    }
+  }
+  release_transfer(dev, &transfer);
+  if (buffer != small) {
+    free(buffer);
+  }
+  return ret;
+}
+
+/* Same as libusb_bulk_transfer or libusb_interrupt_transfer (depending on
+   TYPE) in spin mode. */
+static int spin_data_transfer(ydev_instance_t* dev, int type, int endpoint,
+                              unsigned char* data, int length,
+                              int* transferred, unsigned int timeout)
+{
+  struct libusb_transfer* transfer;
+  int ret;
+
+  *transferred = 0;
+  transfer = acquire_transfer(dev);
+  if (transfer == NULL) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  libusb_fill_bulk_transfer(transfer, dev->handle, endpoint, data, length,
+                            NULL, NULL, timeout);
+  transfer->type = type;
+  ret = spin_transfer(dev, transfer);
+  *transferred = transfer->actual_length;
+  release_transfer(dev, &transfer);
+  return ret;
+}
+
+#ifdef __linux__
+/* Affinity of the interpreter thread before being pinned, CPU to which it
+   is pinned and number of devices requiring it. */
+static cpu_set_t saved_affinity;
+static int pinned_cpu = -1;
+static int pinned_devices = 0;
+#endif
+
+/* Pin the calling thread to a given CPU (-1 to restore its initial
+   affinity).  All devices pinning the thread must agree on the CPU.
+   Returns 0 on success or an error code (LIBUSB_ERROR_BUSY if the thread
+   is pinned to another CPU). */
+static int pin_interpreter(int cpu)
+{
+#ifdef __linux__
+  cpu_set_t mask;
+  if (cpu >= 0) {
+    if (cpu >= CPU_SETSIZE) {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    if (pinned_devices > 0) {
+      if (cpu != pinned_cpu) {
+        return LIBUSB_ERROR_BUSY;
+      }
+      ++pinned_devices;
+      return 0;
+    }
+    if (pthread_getaffinity_np(pthread_self(), sizeof(saved_affinity),
+                               &saved_affinity) != 0) {
+      return LIBUSB_ERROR_OTHER;
+    }
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0) {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    pinned_cpu = cpu;
+    pinned_devices = 1;
+  } else if (pinned_devices > 0 && --pinned_devices == 0) {
+    pthread_setaffinity_np(pthread_self(), sizeof(saved_affinity),
+                           &saved_affinity);
+    pinned_cpu = -1;
+  }
+  return 0;
+#else
+  return (cpu >= 0 ? LIBUSB_ERROR_NOT_SUPPORTED : 0);
+#endif
+}
+
+void Y_usb_set_spin(int argc)
+{
+  ydev_instance_t* obj;
+  int flag, cpu, ret;
+
+  if (argc != 2 && argc != 3) {
+    y_error("expecting 2 or 3 arguments");
+  }
+  obj = get_device(argc - 1);
+  flag = yarg_true(argc - 2);
+  cpu = (argc == 3 && ! yarg_nil(0) ? ygets_i(0) : -1);
+  if (! flag) {
+    cpu = -1;
+  }
+  if (obj->spin_cpu >= 0) {
+    pin_interpreter(-1);
+    obj->spin_cpu = -1;
+  }
+  if (cpu >= 0) {
+    ret = pin_interpreter(cpu);
+    if (ret != 0) {
+      obj->spin = FALSE;
+      failure((ret == LIBUSB_ERROR_BUSY ?
+               "interpreter already pinned to another CPU" :
+               "failed to pin thread to CPU"), ret);
+    }
+    obj->spin_cpu = cpu;
+  }
+  obj->spin = flag;
+  ypush_nil();
+}
+
+/*--------------------------------------------------------------------------*/
+/* ERROR RECOVERY */
+
+/* Recovery policy of a device (see usb_set_recovery).  When a synchronous
+   transfer fails with a stall, a timeout or an I/O error and no data have
+   been transferred, it is retried at most RETRIES times and within BUDGET
+   milliseconds.  Before the first retry, the halt condition of the endpoint
+   is cleared (if RECOVER_CLEAR_HALT is set); before the other retries, or
+   if clearing the halt failed, the device is reset (if RECOVER_RESET is
+   set) and its claimed interfaces claimed again (if RECOVER_RECLAIM is
+   set).  Recovery events are always counted in the statistics. */
+
+/* Apply an action on device DEV and account for it in the counter at
+   COUNTER (in the statistics). */
+#define RECOVERY_ACTION(dev, expr, counter)             \
+  do {                                                  \
+    ret = (dev->mock != NULL ? 0 : (expr));             \
+    pthread_mutex_lock(&dev->stats_mutex);              \
+    ++dev->stats.counter;                               \
+    pthread_mutex_unlock(&dev->stats_mutex);            \
+  } while (0)
+
+/* Decide whether a transfer with ENDPOINT (0 for a control transfer) of
+   device DEV which failed with code CODE after TRANSFERRED bytes should be
+   retried.  ATTEMPT is the number of retries so far (it is incremented) and
+   START is the time of the first attempt.  The recovery actions are applied
+   before returning true. */
+static int recover_transfer(ydev_instance_t* dev, int endpoint, int code,
+                            int transferred, int* attempt,
+                            const struct timespec* start)
+{
+  struct timespec t0, t1;
+  int ret, k, n;
+
+  if (*attempt >= dev->retries || transferred > 0 ||
+      !(code == LIBUSB_ERROR_TIMEOUT || code == LIBUSB_ERROR_IO ||
+        (code == LIBUSB_ERROR_PIPE && endpoint != 0))) {
+    return FALSE;
+  }
+  get_time(&t0);
+  if (dev->recovery_budget > 0 &&
+      1E3*elapsed_seconds(start, &t0) >= dev->recovery_budget) {
+    return FALSE;
+  }
+  n = ++*attempt;
+  ret = -1;
+  if ((dev->recovery & RECOVER_CLEAR_HALT) != 0 && endpoint != 0 &&
+      n == 1) {
+    RECOVERY_ACTION(dev, libusb_clear_halt(dev->handle, endpoint),
+                    clear_halts);
+  }
+  if (ret != 0 && (dev->recovery & RECOVER_RESET) != 0 &&
+      (n > 1 || (dev->recovery & RECOVER_CLEAR_HALT) == 0)) {
+    RECOVERY_ACTION(dev, libusb_reset_device(dev->handle), resets);
+    if (ret == 0 && (dev->recovery & RECOVER_RECLAIM) != 0) {
+      for (k = 0; k < 32; ++k) {
+        if ((dev->claimed & (1U << k)) != 0) {
+          RECOVERY_ACTION(dev, libusb_claim_interface(dev->handle, k),
+                          reclaims);
+        }
+      }
+    }
+  }
+  get_time(&t1);
+  pthread_mutex_lock(&dev->stats_mutex);
+  ++dev->stats.retries;
+  dev->stats.recovery_time += elapsed_seconds(&t0, &t1);
+  pthread_mutex_unlock(&dev->stats_mutex);
+  return TRUE;
+}
+
+/* Account for the outcome RET of a transfer which has been retried. */
+static void end_recovery(ydev_instance_t* dev, int ret)
+{
+  pthread_mutex_lock(&dev->stats_mutex);
+  if (ret >= 0) {
+    ++dev->stats.recovered;
+  } else {
+    ++dev->stats.unrecovered;
+  }
+  pthread_mutex_unlock(&dev->stats_mutex);
+}
+
+void Y_usb_set_recovery(int argc)
+{
+  ydev_instance_t* obj;
+  long budget;
+  int policy, retries;
+
+  if (argc != 3 && argc != 4) {
+    y_error("expecting 3 or 4 arguments");
+  }
+  obj = get_device(argc - 1);
+  policy = (yarg_nil(argc - 2) ? 0 : ygets_i(argc - 2));
+  if ((policy & ~(RECOVER_CLEAR_HALT | RECOVER_RESET |
+                  RECOVER_RECLAIM)) != 0) {
+    y_error("invalid recovery policy");
+  }
+  retries = (yarg_nil(argc - 3) ? 0 : ygets_i(argc - 3));
+  if (retries < 0) {
+    y_error("invalid number of retries");
+  }
+  budget = ((argc < 4 || yarg_nil(0)) ? 0 : ygets_l(0));
+  if (budget < 0 || budget > 0xffffffffL) {
+    y_error("invalid time budget");
+  }
+  obj->recovery = policy;
+  obj->retries = retries;
+  obj->recovery_budget = (unsigned int)budget;
+  ypush_nil();
+}
+
+/*--------------------------------------------------------------------------*/
+/* SYNCHRONOUS TRANSFERS */
+
+void Y_usb_control_transfer(int argc)
+{
+  ydev_instance_t* obj;
+  int ret;
+  int type, request, value, index, length;
+  long size;
+  unsigned char* data;
+  unsigned int timeout;
+  struct timespec t0, start;
+  int attempt;
+
+  /* Get arguments. */
+  if (argc != 8) {
+    y_error("expecting exactly 8 arguments");
+  }
+  obj = get_device(7);
+  type = ygets_i(6) & 0xff; /* uint8_t */
+  request = ygets_i(5) & 0xff; /* uint8_t */
+  value = ygets_i(4) & 0xffff; /* uint16_t */
+  index = ygets_i(3) & 0xffff; /* uint16_t */
+  data = (unsigned char*)get_data(2, &size);
+  length = ygets_i(1) & 0xffff; /* uint16_t */
+  timeout = (unsigned int)(ygets_l(0) & 0xffffffffL);
+  if (length < 0) {
+    y_error("invalid length");
+  }
+  if (length > size) {
+    y_error("length must be at most the size of the data");
+  }
+
+  /* Apply operation. */
+  get_time(&start);
+  t0 = start;
+  attempt = 0;
+  for (;;) {
+    if (obj->mock != NULL) {
+      ret = mock_control_transfer(obj->mock, type, request, value, index,
+                                  data, length, timeout);
+    } else if (obj->spin) {
+      ret = spin_control_transfer(obj, type, request, value, index,
+                                  data, length, timeout);
+    } else {
+      ret = libusb_control_transfer(obj->handle, type, request, value,
+                                    index, data, length, timeout);
+    }
+    record_transfer(obj, &t0, ret, ret);
+    TRACE_EVENT("control_transfer", t0, request, length, ret);
+    if (capture.enabled) {
+      capture_transfer(obj, &t0, LIBUSB_TRANSFER_TYPE_CONTROL, 0, type,
+                       request, value, index, data, length, ret,
+                       (ret > 0 ? ret : 0), timeout, FALSE);
+    }
+    if (ret >= 0 || ! recover_transfer(obj, 0, ret, 0, &attempt, &start)) {
+      break;
+    }
+    get_time(&t0);
+  }
+  if (attempt > 0) {
+    end_recovery(obj, ret);
+  }
+  if (ret < 0 && yarg_subroutine()) {
+    failure(NULL, ret);
+  }
+  ypush_int(ret);
+}
+
+static int chunked_transfer(ydev_instance_t* dev, int endpoint,
+                            unsigned char* data, int length,
+                            int* transferred, unsigned int timeout);
+
+ static void do_transfer(int argc, int type,
+                         int (*transfer)(struct libusb_device_handle* handle,
+                                         unsigned char endpoint,
+                                         unsigned char* data,
+                                         int length,
+                                         int* transferred,
+                                         unsigned int timeout))
+{
+  ydev_instance_t* obj;
+  int ret, iarg;
+  int endpoint, length, transferred, offset;
+  long size;
+  unsigned char* data;
+  unsigned int timeout;
+  long transferred_index;
+  struct timespec t0, start;
+  int attempt;
+
+  /* Get arguments. */
+  if (argc != 6 && argc != 7) {
+    y_error("expecting 6 or 7 arguments");
+  }
+  iarg = argc;
+  obj = get_device(--iarg);
+  endpoint = ygets_i(--iarg) & 0xff; /* uint8_t */
+  data = (unsigned char*)get_data(--iarg, &size);
+  length = ygets_i(--iarg);
+  if (length < 0) {
+    y_error("invalid length");
+  }
+  if (length > size) {
+    y_error("length must be at most the size of the data");
+  }
+  transferred_index = yget_ref(--iarg);
+  if (transferred_index < 0L) {
+    y_error("expecting a simple variable reference");
+  }
+  timeout = (unsigned int)(ygets_l(--iarg) & 0xffffffffL);
+  if (iarg > 0) {
+    offset = ygets_i(--iarg);
+    if (offset < 0 || offset > length) {
+      y_error("invalid offset");
+    }
+  } else {
+    offset = 0;
+  }
+
+  /* Apply operation. */
+  if (length > offset) {
+    get_time(&start);
+    t0 = start;
+    attempt = 0;
+    for (;;) {
+      transferred = 0;
+      if (obj->mock != NULL) {
+        ret = mock_data_transfer(obj->mock, endpoint, data + offset,
+                                 length - offset, &transferred, timeout);
+      } else if (obj->chunk_size > 0 && type == LIBUSB_TRANSFER_TYPE_BULK &&
+                 length - offset > obj->chunk_size) {
+        ret = chunked_transfer(obj, endpoint, data + offset,
+                               length - offset, &transferred, timeout);
+      } else if (obj->spin) {
+        ret = spin_data_transfer(obj, type, endpoint, data + offset,
+                                 length - offset, &transferred, timeout);
+      } else {
+        ret = transfer(obj->handle, endpoint, data + offset,
+                       length - offset, &transferred, timeout);
+      }
+      record_transfer(obj, &t0, ret, transferred);
+      TRACE_EVENT((type == LIBUSB_TRANSFER_TYPE_BULK ? "bulk_transfer" :
+                   "interrupt_transfer"), t0, endpoint, length - offset, ret);
+      if (capture.enabled) {
+        capture_transfer(obj, &t0, type, endpoint, 0, 0, 0, 0,
+                         data + offset, length - offset, ret, transferred,
+                         timeout, FALSE);
+      }
+      if (ret == 0 || ! recover_transfer(obj, endpoint, ret, transferred,
+                                         &attempt, &start)) {
+        break;
+      }
+      get_time(&t0);
+    }
+    if (attempt > 0) {
+      end_recovery(obj, ret);
+    }
+    if (!(ret == 0 || (ret == LIBUSB_ERROR_TIMEOUT && transferred > 0))) {
+      /* No data has been transferred. */
+      transferred = 0;
+      if (yarg_subroutine()) {
+        /* Some error has occured. */
+        failure(NULL, ret);
+      }
+    }
+  } else {
+    /* Nothing to do. */
+    transferred = 0;
+    ret = 0;
+  }
+  if (transferred_index >= 0L) {
+    /* Store total number of transferred bytes so far. */
+    ypush_int(offset + transferred);
+    yput_global(transferred_index, 0);
+  }
+  ypush_int(ret);
+}
+
+void Y_usb_bulk_transfer(int argc)
+{
+  do_transfer(argc, LIBUSB_TRANSFER_TYPE_BULK, libusb_bulk_transfer);
+}
+
+void Y_usb_interrupt_transfer(int argc)
+{
+  do_transfer(argc, LIBUSB_TRANSFER_TYPE_INTERRUPT,
+              libusb_interrupt_transfer);
+}
+
+/*--------------------------------------------------------------------------*/
+/* PREPARED TRANSFERS */
+
+/* A prepared transfer binds once and for all the device, endpoint, data
+   buffer, length and timeout of a synchronous bulk or interrupt transfer.
+   Calling the object as a function performs the transfer with no argument
+   parsing nor variable references and yields the number of transferred
+   bytes (or a strictly negative error code). */
+typedef struct _yprep_instance yprep_instance_t;
+struct _yprep_instance {
+  ydev_instance_t* dev;
+  void* device_use; /* use of the device object */
+  void* data_use;   /* use of the data array or buffer object */
+  unsigned char* data;
+  int type, endpoint, length, status;
+  unsigned int timeout;
+  int (*transfer)(struct libusb_device_handle* handle,
+                  unsigned char endpoint, unsigned char* data, int length,
+                  int* transferred, unsigned int timeout);
+};
+
+static void yprep_free(void *);
+static void yprep_print(void *);
+static void yprep_eval(void *, int);
+static void yprep_extract(void *, char *);
+
+static y_userobj_t yprep_class = {
+  "USB Prepared Transfer",
+  yprep_free,
+  yprep_print,
+  yprep_eval,
+  yprep_extract,
+  NULL
+};
+
+static void yprep_free(void *self)
+{
+  yprep_instance_t *obj = (yprep_instance_t *)self;
+  if (obj->data_use != NULL) {
+    ydrop_use(obj->data_use);
+  }
+  if (obj->device_use != NULL) {
+    ydrop_use(obj->device_use);
+  }
+}
+
+static void yprep_print(void *self)
+{
+  yprep_instance_t *obj = (yprep_instance_t *)self;
+  char buf[128];
+  y_print(yprep_class.type_name, 0);
+  sprintf(buf, ": %s %s, endpoint=0x%02x, length=%d, timeout=%u",
+          (obj->type == LIBUSB_TRANSFER_TYPE_BULK ? "bulk" : "interrupt"),
+          ((obj->endpoint & LIBUSB_ENDPOINT_IN) != 0 ? "in" : "out"),
+          obj->endpoint, obj->length, obj->timeout);
+  y_print(buf, 1);
+}
+
+static void yprep_eval(void *self, int argc)
+{
+  yprep_instance_t *obj = (yprep_instance_t *)self;
+  ydev_instance_t* dev = obj->dev;
+  struct timespec t0, start;
+  int ret, transferred, attempt;
+
+  if (argc > 1 || (argc == 1 && ! yarg_nil(0))) {
+    y_error("expecting no arguments");
+  }
+  if (dev->stats_enabled || capture.enabled || dev->retries > 0) {
+    get_time(&t0);
+  } else {
+    TRACE_START(t0);
+  }
+  start = t0;
+  attempt = 0;
+  for (;;) {
+    transferred = 0;
+    if (dev->mock != NULL) {
+      ret = mock_data_transfer(dev->mock, obj->endpoint, obj->data,
+                               obj->length, &transferred, obj->timeout);
+    } else if (dev->spin) {
+      ret = spin_data_transfer(dev, obj->type, obj->endpoint, obj->data,
+                               obj->length, &transferred, obj->timeout);
+    } else {
+      ret = obj->transfer(dev->handle, obj->endpoint, obj->data, obj->length,
+                          &transferred, obj->timeout);
+    }
+    record_transfer(dev, &t0, ret, transferred);
+    TRACE_EVENT("prepared_transfer", t0, obj->endpoint, obj->length, ret);
+    if (capture.enabled) {
+      capture_transfer(dev, &t0, obj->type, obj->endpoint, 0, 0, 0, 0,
+                       obj->data, obj->length, ret, transferred, obj->timeout,
+                       FALSE);
+    }
+    if (ret == 0 || ! recover_transfer(dev, obj->endpoint, ret, transferred,
+                                       &attempt, &start)) {
+      break;
+    }
+    get_time(&t0);
+  }
+  if (attempt > 0) {
+    end_recovery(dev, ret);
+  }
+  obj->status = ret;
+  ypush_int((ret == 0 || (ret == LIBUSB_ERROR_TIMEOUT && transferred > 0)) ?
+            transferred : ret);
+}
+
+static void yprep_extract(void *addr, char *member)
+{
+  yprep_instance_t *obj = (yprep_instance_t *)addr;
+  int c = (member != NULL ? member[0] : '\0');
+  if (c == 'd' && strcmp(member, "device") == 0) {
+    ypush_use(obj->device_use);
+  } else if (c == 'd' && strcmp(member, "data") == 0) {
+    ypush_use(obj->data_use);
+  } else if (c == 'e' && strcmp(member, "endpoint") == 0) {
+    ypush_int(obj->endpoint);
+  } else if (c == 'l' && strcmp(member, "length") == 0) {
+    ypush_int(obj->length);
+  } else if (c == 's' && strcmp(member, "status") == 0) {
+    ypush_int(obj->status);
+  } else if (c == 't' && strcmp(member, "timeout") == 0) {
+    ypush_long(obj->timeout);
+  } else if (c == 't' && strcmp(member, "type") == 0) {
+    ypush_int(obj->type);
+  } else {
+    y_error("bad member name");
+  }
+}
+
+void Y_usb_prepare_transfer(int argc)
+{
+  yprep_instance_t* obj;
+  ydev_instance_t* dev;
+  unsigned char* data;
+  unsigned int timeout;
+  long size;
+  int endpoint, length, type;
+
+  if (argc != 5 && argc != 6) {
+    y_error("expecting 5 or 6 arguments");
+  }
+  dev = get_device(argc - 1);
+  endpoint = ygets_i(argc - 2) & 0xff; /* uint8_t */
+  if (yarg_nil(argc - 3)) {
+    y_error("expecting a data array or a transfer buffer");
+  }
+  data = (unsigned char*)get_data(argc - 3, &size);
+  length = ygets_i(argc - 4);
+  if (length < 0) {
+    y_error("invalid length");
+  }
+  if (length > size) {
+    y_error("length must be at most the size of the data");
+  }
+  timeout = (unsigned int)(ygets_l(argc - 5) & 0xffffffffL);
+  type = ((argc < 6 || yarg_nil(0)) ? LIBUSB_TRANSFER_TYPE_BULK :
+          ygets_i(0));
+  if (type != LIBUSB_TRANSFER_TYPE_BULK &&
+      type != LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+    y_error("transfer type must be bulk or interrupt");
+  }
+
+  obj = (yprep_instance_t*)ypush_obj(&yprep_class, sizeof(yprep_instance_t));
+  obj->dev = dev;
+  obj->device_use = yget_use(argc);
+  obj->data_use = yget_use(argc - 2);
+  obj->data = data;
+  obj->type = type;
+  obj->endpoint = endpoint;
+  obj->length = length;
+  obj->timeout = timeout;
+  obj->transfer = (type == LIBUSB_TRANSFER_TYPE_BULK ?
+                   libusb_bulk_transfer : libusb_interrupt_transfer);
+}
+
+/*--------------------------------------------------------------------------*/
+/* DEFORMABLE MIRROR FRAMES */
+
+/* Convert normalized actuator commands into 16-bit DAC counts in
+   little-endian byte order.  Commands are clamped to [0,1].  The loops are
+   written so that the compiler can vectorize them. */
+#define ENCODE_FRAME(T)                                                 \
+  static void JOIN2(encode_frame_,T)(unsigned char* dst, const T* src,  \
+                                     long n, T scale)                   \
+  {                                                                     \
+    long i;                                                             \
+    for (i = 0; i < n; ++i) {                                           \
+      T x = src[i];                                                     \
+      unsigned int c;                                                   \
+      x = (x > 0 ? (x < 1 ? x : 1) : 0);                                \
+      c = (unsigned int)(x*scale + (T)0.5);                             \
+      dst[2*i]     = (unsigned char)(c & 0xff);                         \
+      dst[2*i + 1] = (unsigned char)((c >> 8) & 0xff);                  \
+    }                                                                   \
+  }
+ENCODE_FRAME(float)
+ENCODE_FRAME(double)
+#undef ENCODE_FRAME
+
+void Y_usb_send_frame(int argc)
+{
+  ydev_instance_t* obj;
+  unsigned char* frame;
+  void* values;
+  long ntot, nchannels, dims[2];
+  unsigned int timeout;
+  int endpoint, dacmax, type, ret, transferred, length, attempt;
+  struct timespec t0, start;
+
+  /* Get arguments. */
+  if (argc != 6) {
+    y_error("expecting exactly 6 arguments");
+  }
+  obj = get_device(5);
+  endpoint = ygets_i(4) & 0xff; /* uint8_t */
+  type = yarg_typeid(3);
+  if (type == Y_FLOAT) {
+    values = ygeta_f(3, &ntot, NULL);
+  } else {
+    values = ygeta_d(3, &ntot, NULL);
+    type = Y_DOUBLE;
+  }
+  nchannels = (yarg_nil(2) ? ntot : ygets_l(2));
+  if (nchannels < ntot || 2*nchannels > 0x7fffffffL) {
+    y_error("invalid number of channels");
+  }
+  dacmax = ygets_i(1);
+  if (dacmax <= 0 || dacmax > 0xffff) {
+    y_error("invalid maximum DAC value");
+  }
+  timeout = (unsigned int)(ygets_l(0) & 0xffffffffL);
+
+  /* Encode the frame with unused channels set to zero. */
+  dims[0] = 1;
+  dims[1] = 2*nchannels;
+  frame = (unsigned char*)ypush_c(dims);
+  if (type == Y_FLOAT) {
+    encode_frame_float(frame, (const float*)values, ntot, (float)dacmax);
+  } else {
+    encode_frame_double(frame, (const double*)values, ntot, (double)dacmax);
+  }
+  if (nchannels > ntot) {
+    memset(frame + 2*ntot, 0, 2*(nchannels - ntot));
+  }
+  length = (int)(2*nchannels);
+
+  /* Apply operation. */
+  get_time(&start);
+  t0 = start;
+  attempt = 0;
+  for (;;) {
+    transferred = 0;
+    if (obj->mock != NULL) {
+      ret = mock_data_transfer(obj->mock, endpoint, frame, length,
+                               &transferred, timeout);
+    } else if (obj->spin) {
+      ret = spin_data_transfer(obj, LIBUSB_TRANSFER_TYPE_BULK, endpoint,
+                               frame, length, &transferred, timeout);
+    } else {
+      ret = libusb_bulk_transfer(obj->handle, endpoint, frame, length,
+                                 &transferred, timeout);
+    }
+    record_transfer(obj, &t0, ret, transferred);
+    TRACE_EVENT("send_frame", t0, endpoint, length, ret);
+    if (capture.enabled) {
+      capture_transfer(obj, &t0, LIBUSB_TRANSFER_TYPE_BULK, endpoint,
+                       0, 0, 0, 0, frame, length, ret, transferred, timeout,
+                       FALSE);
+    }
+    if (ret == 0 || ! recover_transfer(obj, endpoint, ret, transferred,
+                                       &attempt, &start)) {
+      break;
+    }
+    get_time(&t0);
+  }
+  if (attempt > 0) {
+    end_recovery(obj, ret);
+  }
+  if (ret == 0) {
+    ret = transferred;
+  } else if (yarg_subroutine()) {
+    failure(NULL, ret);
+  }
+  ypush_int(ret);
+}
+
+/*--------------------------------------------------------------------------*/
+/* ASYNCHRONOUS TRANSFERS */
+
+typedef struct _ytrn_instance ytrn_instance_t;
+struct _ytrn_instance {
+  struct libusb_transfer* transfer; /* taken from the pool of the device and
+                                       released on completion */
+  ydev_instance_t* dev;
+  void* device_use; /* use of the device object (to keep it alive) */
+  void* data_use;   /* use of the data array (to keep it alive) */
+  int submitted;    /* transfer has been submitted */
+  volatile int completed; /* set by the completion callback */
+  struct timespec start; /* time of submission */
+  int endpoint;
+  int length;
+  int status;       /* result of the transfer when completed */
+  int transferred;  /* number of bytes actually transferred */
+};
+
+static void ytrn_free(void *);
+static void ytrn_print(void *);
+static void ytrn_extract(void *, char *);
+
+static y_userobj_t ytrn_class = {
+  "USB Transfer",
+  ytrn_free,
+  ytrn_print,
+  NULL,
+  ytrn_extract,
+  NULL
+};
+
+/* Process pending USB events of context UC until COMPLETED becomes non-zero
+   or TIMEOUT (in milliseconds) expires.  A negative TIMEOUT means no time
+   limit: then, if COMPLETED is not NULL, this function only returns once
+   COMPLETED is set (errors of libusb are retried after a short pause), so
+   that callers can safely release the resources used by the completion
+   callbacks.  If COMPLETED is NULL, events are processed at most once. */
+static int handle_events(context_t* uc, long timeout, volatile int* completed)
+{
+  libusb_context* ctx = uc->ctx;
+  struct timespec now, deadline;
+  struct timeval tv;
+  long remaining; /* in microseconds */
+  int ret;
+
+  if (timeout < 0) {
+    if (completed == NULL) {
+      return libusb_handle_events(ctx);
+    }
+    while (! *completed) {
+      ret = libusb_handle_events_completed(ctx, (int*)completed);
+      if (ret != 0 && ret != LIBUSB_ERROR_INTERRUPTED && ! *completed) {
+        /* Do not busy-loop on a persistent error. */
+        now.tv_sec = 0;
+        now.tv_nsec = 1000000L;
+        nanosleep(&now, NULL);
+      }
+    }
+    return 0;
+  }
+  tv.tv_sec = timeout/1000;
+  tv.tv_usec = (timeout%1000)*1000;
+  if (completed == NULL) {
+    return libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+  }
+  get_time(&now);
+  deadline.tv_sec = now.tv_sec + timeout/1000;
+  deadline.tv_nsec = now.tv_nsec + (timeout%1000)*1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_nsec -= 1000000000L;
+    ++deadline.tv_sec;
+  }
+  while (! *completed) {
+    ret = libusb_handle_events_timeout_completed(ctx, &tv, (int*)completed);
+    if (ret != 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+      return ret;
+    }
+    if (*completed) {
+      break;
+    }
+    /* Wait no more than the remaining time. */
+    get_time(&now);
+    remaining = ((long)(deadline.tv_sec - now.tv_sec)*1000000L +
+                 (deadline.tv_nsec - now.tv_nsec)/1000);
+    if (remaining <= 0) {
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+    tv.tv_sec = remaining/1000000L;
+    tv.tv_usec = remaining%1000000L;
+  }
+  return 0;
+}
+
+static void record_completion(ydev_instance_t* dev,
+                              const struct timespec* start,
+                              const struct libusb_transfer* transfer);
+
+/* Convert the status of a completed transfer into an error code (as returned
+   by the synchronous API). */
+static int get_status_result(enum libusb_transfer_status status)
+{
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return LIBUSB_SUCCESS;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return LIBUSB_ERROR_TIMEOUT;
+  case LIBUSB_TRANSFER_STALL:
+    return LIBUSB_ERROR_PIPE;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return LIBUSB_ERROR_NO_DEVICE;
+  case LIBUSB_TRANSFER_OVERFLOW:
+    return LIBUSB_ERROR_OVERFLOW;
+  case LIBUSB_TRANSFER_CANCELLED:
+    return LIBUSB_ERROR_INTERRUPTED;
+  default:
+    return LIBUSB_ERROR_IO;
+  }
+}
+
+static int get_transfer_result(const struct libusb_transfer* transfer)
+{
+  return get_status_result(transfer->status);
+}
+
+static void LIBUSB_CALL ytrn_callback(struct libusb_transfer* transfer)
+{
+  ytrn_instance_t* obj = (ytrn_instance_t*)transfer->user_data;
+  record_completion(obj->dev, &obj->start, transfer);
+  obj->status = get_transfer_result(transfer);
+  obj->transferred = transfer->actual_length;
+  release_transfer(obj->dev, &obj->transfer);
+  obj->completed = TRUE;
+  COUNT_COMPLETION();
+}
+
+/* Account for a completed asynchronous transfer in the statistics of the
+   device. */
+static void record_completion(ydev_instance_t* dev,
+                              const struct timespec* start,
+                              const struct libusb_transfer* transfer)
+{
+  int ret;
+  if (dev->stats_enabled) {
+    ret = get_transfer_result(transfer);
+    record_transfer(dev, start, (ret == 0 ? transfer->actual_length : ret),
+                    transfer->actual_length);
+  }
+  if (capture.enabled) {
+    capture_completion(dev, start, transfer);
+  }
+}
+
+static int ytrn_pending(ytrn_instance_t* obj)
+{
+  return (obj->submitted && ! obj->completed);
+}
+
+/* Cancel a pending transfer.  The lock of the pool prevents the transfer from
+   being released (and possibly reused) by its completion callback while it
+   is being cancelled. */
+static int cancel_transfer(ytrn_instance_t* obj)
+{
+  int ret;
+  pthread_mutex_lock(&obj->dev->pool.mutex);
+  if (obj->transfer != NULL && ! obj->completed) {
+    ret = libusb_cancel_transfer(obj->transfer);
+  } else {
+    ret = LIBUSB_ERROR_NOT_FOUND;
+  }
+  pthread_mutex_unlock(&obj->dev->pool.mutex);
+  return ret;
+}
+
+static void ytrn_free(void *self)
+{
+  ytrn_instance_t *obj = (ytrn_instance_t *)self;
+  if (ytrn_pending(obj)) {
+    /* The transfer must not be released while in flight: cancel it and
+       wait for its completion. */
+    cancel_transfer(obj);
+    handle_events(obj->dev->context, -1, &obj->completed);
+  }
+  if (obj->transfer != NULL) {
+    release_transfer(obj->dev, &obj->transfer);
+  }
+  if (obj->data_use != NULL) {
+    ydrop_use(obj->data_use);
+  }
+  if (obj->device_use != NULL) {
+    ydrop_use(obj->device_use);
+  }
+}
+
+static void ytrn_print(void *self)
+{
+  ytrn_instance_t *obj = (ytrn_instance_t *)self;
+  char buf[256];
+  y_print(ytrn_class.type_name, 0);
+  if (ytrn_pending(obj)) {
+    sprintf(buf, ": endpoint=0x%02x, length=%d, pending",
+            (unsigned int)obj->endpoint, obj->length);
+  } else {
+    sprintf(buf, ": endpoint=0x%02x, length=%d, transferred=%d, status=%s",
+            (unsigned int)obj->endpoint, obj->length, obj->transferred,
+            get_error_name(obj->status));
+  }
+  y_print(buf, 1);
+}
+
+static void ytrn_extract(void *addr, char *member)
+{
+  ytrn_instance_t *obj = (ytrn_instance_t *)addr;
+  int c = (member != NULL ? member[0] : '\0');
+  if (c == 'p' && strcmp(member, "pending") == 0) {
+    ypush_int(ytrn_pending(obj));
+  } else if (c == 's' && strcmp(member, "status") == 0) {
+    ypush_int(ytrn_pending(obj) ? LIBUSB_SUCCESS : obj->status);
+  } else if (c == 't' && strcmp(member, "transferred") == 0) {
+    ypush_int(ytrn_pending(obj) ? 0 : obj->transferred);
+  } else if (c == 'l' && strcmp(member, "length") == 0) {
+    ypush_int(obj->length);
+  } else if (c == 'e' && strcmp(member, "endpoint") == 0) {
+    ypush_int(obj->endpoint);
+  } else if (c == 'd' && strcmp(member, "device") == 0) {
+    ypush_use(obj->device_use);
+  } else {
+    y_error("bad member name");
+  }
+}
+
+/* Get an USB transfer from the stack. */
+static ytrn_instance_t* get_transfer(int iarg)
+{
+  return (ytrn_instance_t*)yget_obj(iarg, &ytrn_class);
+}
+
+void Y_usb_submit_transfer(int argc)
+{
+  ydev_instance_t* dev;
+  ytrn_instance_t* obj;
+  struct libusb_transfer* transfer;
+  int ret, iarg, data_iarg, dev_iarg;
+  int endpoint, length, type;
+  long size;
+  unsigned char* data;
+  unsigned int timeout;
+
+  /* Get arguments. */
+  if (argc != 5 && argc != 6) {
+    y_error("expecting 5 or 6 arguments");
+  }
+  iarg = argc;
+  dev_iarg = --iarg;
+  dev = get_device(dev_iarg);
+  check_async(dev);
+  endpoint = ygets_i(--iarg) & 0xff; /* uint8_t */
+  data_iarg = --iarg;
+  data = (unsigned char*)get_data(data_iarg, &size);
+  length = ygets_i(--iarg);
+  if (length < 0) {
+    y_error("invalid length");
+  }
+  if (length > size) {
+    y_error("length must be at most the size of the data");
+  }
+  timeout = (unsigned int)(ygets_l(--iarg) & 0xffffffffL);
+  if (iarg > 0) {
+    type = ygets_i(--iarg);
+    if (type != LIBUSB_TRANSFER_TYPE_BULK &&
+        type != LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+      y_error("unsupported transfer type");
+    }
+  } else {
+    type = LIBUSB_TRANSFER_TYPE_BULK;
+  }
+
+  /* Create the transfer object (pushing it on top of the stack shifts the
+     positions of the arguments by one). */
+  obj = (ytrn_instance_t *)ypush_obj(&ytrn_class, sizeof(ytrn_instance_t));
+  obj->device_use = yget_use(dev_iarg + 1);
+  obj->dev = dev;
+  if (data != NULL) {
+    obj->data_use = yget_use(data_iarg + 1);
+  }
+  obj->endpoint = endpoint;
+  obj->length = length;
+  transfer = acquire_transfer(dev);
+  if (transfer == NULL) {
+    failure("failed to allocate transfer", LIBUSB_ERROR_NO_MEM);
+  }
+  obj->transfer = transfer;
+  if (type == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+    libusb_fill_interrupt_transfer(transfer, dev->handle, endpoint,
+                                   data, length, ytrn_callback, obj,
+                                   timeout);
+  } else {
+    libusb_fill_bulk_transfer(transfer, dev->handle, endpoint,
+                              data, length, ytrn_callback, obj,
+                              timeout);
+  }
+
+  /* Apply operation. */
+  obj->completed = FALSE;
+  get_time(&obj->start);
+  ret = libusb_submit_transfer(transfer);
+  if (ret != 0) {
+    failure("failed to submit transfer", ret);
+  }
+  obj->submitted = TRUE;
+}
+
+void Y_usb_wait_transfer(int argc)
+{
+  ytrn_instance_t* obj;
+  long timeout;
+  int ret;
+
+  if (argc != 1 && argc != 2) {
+    y_error("expecting 1 or 2 arguments");
+  }
+  obj = get_transfer(argc - 1);
+  timeout = (argc >= 2 && ! yarg_nil(0) ? ygets_l(0) : -1);
+  if (! obj->submitted) {
+    y_error("transfer has not been submitted");
+  }
+  ret = handle_events(obj->dev->context, timeout, &obj->completed);
+  if (ret == 0) {
+    ret = obj->status;
+    if (ret == LIBUSB_ERROR_TIMEOUT && obj->transferred > 0) {
+      /* Some data have been transferred. */
+      if (yarg_subroutine()) {
+        ret = 0;
+      }
+    } else if (ret != 0 && yarg_subroutine()) {
+      failure(NULL, ret);
+    }
+  } else if (yarg_subroutine()) {
+    failure(NULL, ret);
+  }
+  ypush_int(ret);
+}
+
+void Y_usb_test_transfer(int argc)
+{
+  ytrn_instance_t* obj;
+
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
+  }
+  obj = get_transfer(0);
+  if (ytrn_pending(obj) && ! obj->dev->context->event_thread_started) {
+    handle_events(obj->dev->context, 0, &obj->completed);
+  }
+  ypush_int(! ytrn_pending(obj));
+}
+
+void Y_usb_cancel_transfer(int argc)
+{
+  ytrn_instance_t* obj;
+  int ret;
+
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
+  }
+  obj = get_transfer(0);
+  if (ytrn_pending(obj)) {
+    ret = cancel_transfer(obj);
+    if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND && yarg_subroutine()) {
+      failure(NULL, ret);
+    }
+  } else {
+    ret = LIBUSB_ERROR_NOT_FOUND;
+  }
+  ypush_int(ret);
+}
+
+void Y_usb_handle_events(int argc)
+{
+  context_t* uc;
+  int ret;
+
+  if (argc != 1 && argc != 2) {
+    y_error("expecting 1 or 2 arguments");
+  }
+  if (argc == 2) {
+    uc = get_context(0);
+  } else {
+    INITIALIZE;
+    uc = &default_context;
+  }
+  ret = handle_events(uc, yarg_nil(argc - 1) ? -1 : ygets_l(argc - 1), NULL);
+  if (ret < 0 && yarg_subroutine()) {
+    failure(NULL, ret);
+  }
+  ypush_int(ret);
+}
+
+/*--------------------------------------------------------------------------*/
+/* BATCHED CONTROL TRANSFERS */
+
+/* Context shared by the transfers of a batch of control transfers.  The
+   completion callbacks may be called by the event thread while transfers
+   are still being submitted, hence the mutex. */
+typedef struct _batch_context batch_context_t;
+struct _batch_context {
+  ydev_instance_t* dev;
+  pthread_mutex_t mutex;
+  struct timespec start; /* time of submission */
+  volatile int pending; /* number of transfers in flight */
+  volatile int done;    /* set when there are no more transfers in flight */
+};
+
+static void LIBUSB_CALL batch_callback(struct libusb_transfer* transfer)
+{
+  batch_context_t* batch = (batch_context_t*)transfer->user_data;
+  record_completion(batch->dev, &batch->start, transfer);
+  COUNT_COMPLETION();
+  /* This is the last access to the batch which may be released as soon as
+     DONE is set. */
+  pthread_mutex_lock(&batch->mutex);
+  if (--batch->pending <= 0) {
+    batch->done = TRUE;
+  }
+  pthread_mutex_unlock(&batch->mutex);
+}
+
+void Y_usb_control_batch(int argc)
+{
+  ydev_instance_t* obj;
+  struct libusb_transfer** transfers;
+  struct libusb_transfer* transfer;
+  batch_context_t batch;
+  long size, offset, total, dims[Y_DIMSIZE], ntot, j, n;
+  unsigned char* data;
+  unsigned char* buffer;
+  unsigned int timeout;
+  int* setup;
+  int* result;
+  int ret, first_error, length;
+
+  /* Get arguments. */
+  if (argc != 4) {
+    y_error("expecting exactly 4 arguments");
+  }
+  obj = get_device(3);
+  check_async(obj);
+  setup = ygeta_i(2, &ntot, dims);
+  if (dims[0] < 1 || dims[0] > 2 || dims[1] != 5) {
+    y_error("SETUP must be a 5-by-N array");
+  }
+  n = ntot/5;
+  data = (unsigned char*)get_data(1, &size);
+  timeout = (unsigned int)(ygets_l(0) & 0xffffffffL);
+  total = 0;
+  for (j = 0; j < n; ++j) {
+    length = setup[5*j + 4];
+    if (length < 0 || length > 0xffff) {
+      y_error("invalid length");
+    }
+    total += length;
+  }
+  if (total > size) {
+    y_error("total length must be at most the size of the data");
+  }
+
+  /* Allocate resources.  Workspace for the setup packets and data of all
+     transfers is taken from the stack so that it is automatically released
+     in case of interrupts. */
+  dims[0] = 1;
+  dims[1] = n;
+  result = ypush_i(dims);
+  dims[1] = n*(sizeof(struct libusb_transfer*) +
+               LIBUSB_CONTROL_SETUP_SIZE) + total;
+  transfers = (struct libusb_transfer**)ypush_c(dims);
+  buffer = (unsigned char*)(transfers + n);
+  for (j = 0; j < n; ++j) {
+    transfers[j] = acquire_transfer(obj);
+    if (transfers[j] == NULL) {
+      while (--j >= 0) {
+        release_transfer(obj, &transfers[j]);
+      }
+      failure("failed to allocate transfer", LIBUSB_ERROR_NO_MEM);
+    }
+  }
+  offset = 0;
+  for (j = 0; j < n; ++j) {
+    int type = setup[5*j] & 0xff; /* uint8_t */
+    length = setup[5*j + 4];
+    libusb_fill_control_setup(buffer, type,
+                              setup[5*j + 1] & 0xff, /* bRequest */
+                              setup[5*j + 2] & 0xffff, /* wValue */
+                              setup[5*j + 3] & 0xffff, /* wIndex */
+                              length);
+    if ((type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT &&
+        length > 0) {
+      memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data + offset, length);
+    }
+    libusb_fill_control_transfer(transfers[j], obj->handle, buffer,
+                                 batch_callback, &batch, timeout);
+    buffer += LIBUSB_CONTROL_SETUP_SIZE + length;
+    offset += length;
+  }
+
+  /* Submit all the transfers back-to-back and wait for their completion.
+     Submission stops at the first failure.  All the transfers are accounted
+     as pending before the first submission, those which could not be
+     submitted are subtracted under the lock. */
+  batch.dev = obj;
+  pthread_mutex_init(&batch.mutex, NULL);
+  batch.pending = n;
+  batch.done = (n <= 0);
+  get_time(&batch.start);
+  for (j = 0; j < n; ++j) {
+    ret = libusb_submit_transfer(transfers[j]);
+    if (ret != 0) {
+      pthread_mutex_lock(&batch.mutex);
+      batch.pending -= n - j;
+      if (batch.pending <= 0) {
+        batch.done = TRUE;
+      }
+      pthread_mutex_unlock(&batch.mutex);
+      result[j] = ret;
+      while (++j < n) {
+        result[j] = LIBUSB_ERROR_INTERRUPTED;
+        release_transfer(obj, &transfers[j]);
+      }
+      break;
+    }
+  }
+  if (! batch.done) {
+    handle_events(obj->context, -1, &batch.done);
+  }
+  /* Make sure the last callback has released the lock. */
+  pthread_mutex_lock(&batch.mutex);
+  pthread_mutex_unlock(&batch.mutex);
+  pthread_mutex_destroy(&batch.mutex);
+
+  /* Collect the results and copy the received data. */
+  first_error = 0;
+  offset = 0;
+  for (j = 0; j < n; ++j) {
+    transfer = transfers[j];
+    length = setup[5*j + 4];
+    if (transfer != NULL) {
+      if (result[j] == 0) {
+        if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+          result[j] = transfer->actual_length;
+          if ((setup[5*j] & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN &&
+              transfer->actual_length > 0) {
+            memcpy(data + offset, libusb_control_transfer_get_data(transfer),
+                   transfer->actual_length);
+          }
+        } else {
+          result[j] = get_transfer_result(transfer);
+        }
+      }
+      release_transfer(obj, &transfers[j]);
+    }
+    if (result[j] < 0 && first_error == 0) {
+      first_error = result[j];
+    }
+    offset += length;
+  }
+  yarg_drop(1); /* drop workspace */
+  if (first_error != 0 && yarg_subroutine()) {
+    failure(NULL, first_error);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+/* MULTI-DEVICE TRANSFERS */
+
+/* A device group is an ordered list of devices which can be driven
+   together by usb_multi_submit (for instance the deformable mirrors of an
+   adaptive optics system).  The group holds a use of each device. */
+typedef struct _ygrp_instance ygrp_instance_t;
+struct _ygrp_instance {
+  long count;
+  ydev_instance_t** devs;
+  void** uses;
+};
+
+static void ygrp_free(void *);
+static void ygrp_print(void *);
+static void ygrp_eval(void *, int);
+static void ygrp_extract(void *, char *);
+
+static y_userobj_t ygrp_class = {
+  "USB Device Group",
+  ygrp_free,
+  ygrp_print,
+  ygrp_eval,
+  ygrp_extract,
+  NULL
+};
+
+static void ygrp_free(void *self)
+{
+  ygrp_instance_t *obj = (ygrp_instance_t *)self;
+  long k;
+  if (obj->uses != NULL) {
+    for (k = 0; k < obj->count; ++k) {
+      if (obj->uses[k] != NULL) {
+        ydrop_use(obj->uses[k]);
+      }
+    }
+    p_free(obj->uses);
+  }
+  if (obj->devs != NULL) {
+    p_free(obj->devs);
+  }
+}
+
+static void ygrp_print(void *self)
+{
+  ygrp_instance_t *obj = (ygrp_instance_t *)self;
+  char buf[64];
+  y_print(ygrp_class.type_name, 0);
+  sprintf(buf, ": count=%ld", obj->count);
+  y_print(buf, 1);
+}
+
+/* GRP(I) yields the I-th device of the group. */
+static void ygrp_eval(void *self, int argc)
+{
+  ygrp_instance_t *obj = (ygrp_instance_t *)self;
+  long k;
+
+  if (argc != 1) {
+    y_error("expecting exactly 1 argument");
+  }
+  k = ygets_l(0);
+  if (k < 1 || k > obj->count) {
+    y_error("out of range device index");
+  }
+  ypush_use(obj->uses[k - 1]);
+}
+
+static void ygrp_extract(void *addr, char *member)
+{
+  ygrp_instance_t *obj = (ygrp_instance_t *)addr;
+  int c = (member != NULL ? member[0] : '\0');
+  if (c == 'c' && strcmp(member, "count") == 0) {
+    ypush_long(obj->count);
+  } else {
+    y_error("bad member name");
+  }
+}
+
+void Y_usb_device_group(int argc)
+{
+  ygrp_instance_t* obj;
+  long k;
+
+  if (argc < 1) {
+    y_error("expecting at least one device");
+  }
+  for (k = 0; k < argc; ++k) {
+    get_device(k);
+  }
+  obj = (ygrp_instance_t*)ypush_obj(&ygrp_class, sizeof(ygrp_instance_t));
+  obj->devs = (ydev_instance_t**)p_malloc(argc*sizeof(ydev_instance_t*));
+  obj->uses = (void**)p_malloc(argc*sizeof(void*));
+  for (k = 0; k < argc; ++k) {
+    obj->uses[k] = NULL;
+  }
+  obj->count = argc;
+  for (k = 0; k < argc; ++k) {
+    /* Arguments are numbered from the top of the stack, the group object is
+       now at position 0. */
+    obj->devs[k] = get_device(argc - k);
+    obj->uses[k] = yget_use(argc - k);
+  }
+}
+
+/* Maximum time (in milliseconds) spent waiting for the events of one
+   context when the devices of a group belong to several contexts. */
+#define MULTI_POLL_SLICE 1
+
+/* Context shared by the transfers submitted to a group of devices.  The
+   completion callbacks may be called by the event threads of different
+   libusb contexts, hence the mutex. */
+typedef struct _multi_context multi_context_t;
+typedef struct _multi_slot multi_slot_t;
+struct _multi_slot {
+  ydev_instance_t* dev;
+  struct libusb_transfer* transfer;
+  multi_context_t* multi;
+};
+struct _multi_context {
+  pthread_mutex_t mutex;
+  multi_slot_t* slots;
+  long count;
+  struct timespec start; /* time of submission */
+  volatile long pending; /* number of transfers in flight */
+  volatile int done;     /* set when there are no more transfers in flight */
+  int failed;            /* set by the first failed transfer */
+};
+
+static void LIBUSB_CALL multi_callback(struct libusb_transfer* transfer)
+{
+  multi_slot_t* slot = (multi_slot_t*)transfer->user_data;
+  multi_context_t* multi = slot->multi;
+  long k;
+
+  record_completion(slot->dev, &multi->start, transfer);
+  COUNT_COMPLETION();
+  pthread_mutex_lock(&multi->mutex);
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED && ! multi->failed) {
+    /* The group fails as a whole: do not wait for the other transfers to
+       time out.  Cancelling a completed transfer is harmless. */
+    multi->failed = TRUE;
+    for (k = 0; k < multi->count; ++k) {
+      if (multi->slots[k].transfer != NULL &&
+          multi->slots[k].transfer != transfer) {
+        libusb_cancel_transfer(multi->slots[k].transfer);
+      }
+    }
+  }
+  /* This is the last access to the shared context which may be released
+     as soon as DONE is set. */
+  if (--multi->pending <= 0) {
+    multi->done = TRUE;
+  }
+  pthread_mutex_unlock(&multi->mutex);
+}
+
+/* Yield the type of the transfers to ENDPOINT of device DEV. */
+static int get_endpoint_type(ydev_instance_t* dev, int endpoint)
+{
+  int k, n = get_endpoints(dev);
+  for (k = 0; k < n; ++k) {
+    if (dev->endpoints[k].address == endpoint) {
+      return dev->endpoints[k].type;
+    }
+  }
+  return LIBUSB_TRANSFER_TYPE_BULK;
+}
+
+void Y_usb_multi_submit(int argc)
+{
+  ygrp_instance_t* grp;
+  ydev_instance_t* dev;
+  struct libusb_transfer* transfer;
+  multi_context_t multi;
+  multi_slot_t* slots;
+  context_t* uc;
+  long size, dims[Y_DIMSIZE], nep, n, j, k;
+  unsigned char* data;
+  unsigned int timeout;
+  int* endpoints;
+  int* result;
+  int ret, first_error, length, endpoint, shared;
+
+  /* Get arguments. */
+  if (argc != 4) {
+    y_error("expecting exactly 4 arguments");
+  }
+  grp = (ygrp_instance_t*)yget_obj(3, &ygrp_class);
+  n = grp->count;
+  endpoints = ygeta_i(2, &nep, NULL);
+  if (nep != 1 && nep != n) {
+    y_error("expecting one endpoint or one endpoint per device");
+  }
+  if (yarg_nil(1)) {
+    y_error("expecting a data array or a transfer buffer");
+  }
+  data = (unsigned char*)get_data(1, &size);
+  if (size%n != 0 || size/n > 0x7fffffffL) {
+    y_error("size of the data must be a multiple of the number of devices");
+  }
+  length = (int)(size/n);
+  timeout = (unsigned int)(ygets_l(0) & 0xffffffffL);
+  shared = TRUE;
+  for (k = 0; k < n; ++k) {
+    check_async(grp->devs[k]);
+    if (grp->devs[k]->context != grp->devs[0]->context) {
+      shared = FALSE;
+    }
+  }
+
+  /* Allocate resources.  The slots are taken from the stack so that they are
+     automatically released in case of interrupts. */
+  dims[0] = 1;
+  dims[1] = n;
+  result = ypush_i(dims);
+  dims[1] = n*sizeof(multi_slot_t);
+  slots = (multi_slot_t*)ypush_c(dims);
+  for (k = 0; k < n; ++k) {
+    dev = grp->devs[k];
+    slots[k].dev = dev;
+    slots[k].multi = &multi;
+    slots[k].transfer = acquire_transfer(dev);
+    if (slots[k].transfer == NULL) {
+      while (--k >= 0) {
+        release_transfer(slots[k].dev, &slots[k].transfer);
+      }
+      failure("failed to allocate transfer", LIBUSB_ERROR_NO_MEM);
+    }
+    endpoint = endpoints[nep > 1 ? k : 0] & 0xff; /* uint8_t */
+    if (get_endpoint_type(dev, endpoint) == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+      libusb_fill_interrupt_transfer(slots[k].transfer, dev->handle,
+                                     endpoint, data + k*length, length,
+                                     multi_callback, &slots[k], timeout);
+    } else {
+      libusb_fill_bulk_transfer(slots[k].transfer, dev->handle,
+                                endpoint, data + k*length, length,
+                                multi_callback, &slots[k], timeout);
+    }
+  }
+
+  /* Submit all the transfers back-to-back (everything else has been done
+     before) so that the devices are served within microseconds of each
+     other, then wait for all of them.  A failed submission does not prevent
+     the other devices from being served. */
+  pthread_mutex_init(&multi.mutex, NULL);
+  multi.slots = slots;
+  multi.count = n;
+  multi.pending = n;
+  multi.done = FALSE;
+  multi.failed = FALSE;
+  for (k = 0; k < n; ++k) {
+    result[k] = 0;
+  }
+  get_time(&multi.start);
+  for (k = 0; k < n; ++k) {
+    ret = libusb_submit_transfer(slots[k].transfer);
+    if (ret != 0) {
+      /* The transfer is released with the others (cancelling a transfer
+         which has not been submitted is harmless). */
+      result[k] = ret;
+      pthread_mutex_lock(&multi.mutex);
+      if (--multi.pending <= 0) {
+        multi.done = TRUE;
+      }
+      pthread_mutex_unlock(&multi.mutex);
+    }
+  }
+  if (shared) {
+    handle_events(grp->devs[0]->context, -1, &multi.done);
+  } else {
+    /* Wait for the events of the distinct contexts in turn, for a short
+       time slice each so as to not busy-poll a CPU. */
+    while (! multi.done) {
+      for (k = 0; k < n && ! multi.done; ++k) {
+        uc = grp->devs[k]->context;
+        for (j = 0; j < k && grp->devs[j]->context != uc; ++j)
+          ;
+        if (j == k) {
+          handle_events(uc, MULTI_POLL_SLICE, &multi.done);
+        }
+      }
+    }
+  }
+  /* Make sure the last callback has released the lock. */
+  pthread_mutex_lock(&multi.mutex);
+  pthread_mutex_unlock(&multi.mutex);
+  pthread_mutex_destroy(&multi.mutex);
+
+  /* Collect the results. */
+  first_error = 0;
+  for (k = 0; k < n; ++k) {
+    transfer = slots[k].transfer;
+    if (result[k] == 0) {
+      if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        result[k] = transfer->actual_length;
+      } else {
+        result[k] = get_transfer_result(transfer);
+      }
+    }
+    release_transfer(slots[k].dev, &slots[k].transfer);
+    if (result[k] < 0 && first_error == 0) {
+      first_error = result[k];
+    }
+  }
+  yarg_drop(1); /* drop workspace */
+  if (first_error != 0 && yarg_subroutine()) {
+    failure(NULL, first_error);
+  }
+}
+
+/*--------------------------------------------------------------------------*/
+/* CHUNKED BULK TRANSFERS */
+
+/* When chunking is enabled for a device (see usb_set_chunking), large
+   synchronous bulk transfers are split into chunks of a given size which
+   are transferred by several asynchronous transfers kept in flight, so that
+   the bus is never idle between chunks.  The chunks are read or written in
+   place and completed in order.  The transfer stops at the first failed or
+   (for IN endpoints) short chunk, the chunks in flight after it are
+   cancelled. */
+
+#define CHUNK_DEPTH_MAX 32
+
+typedef struct _chunk_slot chunk_slot_t;
+struct _chunk_slot {
+  ydev_instance_t* dev;
+  struct libusb_transfer* transfer;
+  volatile int done;
+};
+
+/* The statistics and the capture only account for the whole transfer (see
+   do_transfer), not for its chunks. */
+static void LIBUSB_CALL chunk_callback(struct libusb_transfer* transfer)
+{
+  chunk_slot_t* slot = (chunk_slot_t*)transfer->user_data;
+  slot->done = TRUE;
+  COUNT_COMPLETION();
+}
+
+static int submit_chunk(chunk_slot_t* slot, int endpoint,
+                        unsigned char* data, int length, unsigned int timeout)
+{
+  int ret;
+  libusb_fill_bulk_transfer(slot->transfer, slot->dev->handle, endpoint,
+                            data, length, chunk_callback, slot, timeout);
+  slot->done = FALSE;
+  ret = libusb_submit_transfer(slot->transfer);
+  if (ret != 0) {
+    slot->done = TRUE;
+  }
+  return ret;
+}
+
+static int chunked_transfer(ydev_instance_t* dev, int endpoint,
+                            unsigned char* data, int length,
+                            int* transferred, unsigned int timeout)
+{
+  chunk_slot_t slots[CHUNK_DEPTH_MAX];
+  struct libusb_transfer* transfer;
+  long nchunks, next, j;
+  int chunk, depth, inflight, ret, k, n, stop;
+
+  chunk = dev->chunk_size;
+  nchunks = ((long)length + chunk - 1)/chunk;
+  depth = (dev->chunk_depth < nchunks ? dev->chunk_depth : (int)nchunks);
+  for (k = 0; k < depth; ++k) {
+    slots[k].dev = dev;
+    slots[k].transfer = acquire_transfer(dev);
+    slots[k].done = TRUE;
+    if (slots[k].transfer == NULL) {
+      while (--k >= 0) {
+        release_transfer(dev, &slots[k].transfer);
+      }
+      *transferred = 0;
+      return LIBUSB_ERROR_NO_MEM;
+    }
+  }
+
+  /* Fill the pipeline, then wait for each chunk in order and resubmit its
+     slot for the next chunk. */
+  ret = 0;
+  stop = FALSE;
+  inflight = 0;
+  for (next = 0; next < depth; ++next) {
+    n = (next < nchunks - 1 ? chunk : length - (int)(next*chunk));
+    ret = submit_chunk(&slots[next], endpoint, data + next*chunk, n,
+                       timeout);
+    if (ret != 0) {
+      stop = TRUE;
+      break;
+    }
+    ++inflight;
+  }
+  *transferred = 0;
+  for (j = 0; j < nchunks && inflight > 0; ++j) {
+    chunk_slot_t* slot = &slots[j%depth];
+    if (! slot->done) {
+      handle_events(dev->context, -1, &slot->done);
+    }
+    --inflight;
+    transfer = slot->transfer;
+    if (! stop) {
+      n = get_transfer_result(transfer);
+      *transferred += transfer->actual_length;
+      if (n != 0) {
+        ret = n;
+        stop = TRUE;
+      } else if (transfer->actual_length < transfer->length) {
+        stop = TRUE; /* short transfer */
+      }
+      if (stop) {
+        /* Cancel the chunks in flight. */
+        for (k = 0; k < depth; ++k) {
+          if (! slots[k].done) {
+            libusb_cancel_transfer(slots[k].transfer);
+          }
+        }
+      } else if (next < nchunks) {
+        n = (next < nchunks - 1 ? chunk : length - (int)(next*chunk));
+        ret = submit_chunk(slot, endpoint, data + next*chunk, n, timeout);
+        if (ret != 0) {
+          stop = TRUE;
+        } else {
+          ++next;
+          ++inflight;
+        }
+      }
+    }
+  }
+  for (k = 0; k < depth; ++k) {
+    if (! slots[k].done) {
+      handle_events(dev->context, -1, &slots[k].done);
+    }
+    release_transfer(dev, &slots[k].transfer);
+  }
+  return ret;
+}
+
+void Y_usb_set_chunking(int argc)
+{
+  ydev_instance_t* obj;
+  long size;
+  int chunk, depth;
+
+  if (argc != 2 && argc != 3) {
+    y_error("expecting 2 or 3 arguments");
+  }
+  obj = get_device(argc - 1);
+  get_tuned_sizes(obj, -1, FALSE, &chunk, &depth);
+  size = (yarg_nil(argc - 2) ? chunk : ygets_l(argc - 2));
+  if (argc >= 3 && ! yarg_nil(0)) {
+    depth = ygets_i(0);
+  }
+  if (size < 0 || size > 0x7fffffffL) {
+    y_error("invalid chunk size");
+  }
+  if (depth < 1 || depth > CHUNK_DEPTH_MAX) {
+    y_error("invalid number of chunks in flight");
+  }
+  if (size > 0) {
+    check_async(obj);
+  }
+  obj->chunk_size = (int)size;
+  obj->chunk_depth = depth;
+  ypush_nil();
+}
+
+/*--------------------------------------------------------------------------*/
+/* DOUBLE-BUFFERED FRAMES */
+
+/* A frame pipe uploads deformable mirror frames asynchronously.  Each frame
+   is sent by a chain of transfers: an optional control transfer to deassert
+   the frame-sync bit, the bulk transfer of the frame and an optional control
+   transfer to assert the frame-sync bit (which latches the new frame).  The
+   next transfer of the chain is submitted by the completion callback of the
+   previous one.  There are two frame buffers: while a frame is being sent,
+   the next one can be encoded and queued in the other buffer; if a frame is
+   already queued, it is replaced by the new one (and counted as dropped) so
+   that the most recent commands are always applied. */
+#define FPIPE_SYNC_OFF 0
+#define FPIPE_FRAME    1
+#define FPIPE_SYNC_ON  2
+#define FPIPE_STEPS    3
+
+typedef struct _yfpipe_instance yfpipe_instance_t;
+struct _yfpipe_instance {
+  ydev_instance_t* dev;
+  void* device_use; /* use of the device object (to keep it alive) */
+  struct libusb_transfer* transfers[FPIPE_STEPS];
+  unsigned char* frames[2];
+  unsigned char setup[2][LIBUSB_CONTROL_SETUP_SIZE];
+  struct timespec start; /* time of submission of the current transfer */
+  pthread_mutex_t mutex;
+  int mutex_initialized;
+  int has_sync;
+  int endpoint;
+  long nchannels;
+  int dacmax;
+  int current; /* index of frame being sent */
+  int queued;  /* index of queued frame, -1 if none */
+  int step;    /* current step of the chain */
+  int status;  /* last error */
+  unsigned long sent;    /* number of frames sent */
+  unsigned long dropped; /* number of queued frames replaced by newer ones */
+  volatile int idle;     /* no transfers in flight */
+  volatile int stopping;
+};
+
+static void yfpipe_free(void *);
+static void yfpipe_print(void *);
+static void yfpipe_extract(void *, char *);
+
+static y_userobj_t yfpipe_class = {
+  "USB Frame Pipe",
+  yfpipe_free,
+  yfpipe_print,
+  NULL,
+  yfpipe_extract,
+  NULL
+};
+
+/* Submit the transfer of the chain at STEP or a following one; the caller
+   must own the lock.  Returns 0 on success or an error code. */
+static int yfpipe_submit(yfpipe_instance_t* obj, int step)
+{
+  struct libusb_transfer* transfer;
+  int ret;
+
+  while (step < FPIPE_STEPS && obj->transfers[step] == NULL) {
+    ++step;
+  }
+  if (step >= FPIPE_STEPS) {
+    return 1; /* end of chain */
+  }
+  transfer = obj->transfers[step];
+  if (step == FPIPE_FRAME) {
+    transfer->buffer = obj->frames[obj->current];
+  }
+  obj->step = step;
+  get_time(&obj->start);
+  ret = libusb_submit_transfer(transfer);
+  return (ret < 0 ? ret : 0);
+}
+
+/* Start sending the queued frame if any; the caller must own the lock.
+   Returns 0 on success or an error code. */
+static int yfpipe_next(yfpipe_instance_t* obj)
+{
+  int ret;
+  if (obj->queued < 0 || obj->stopping) {
+    obj->idle = TRUE;
+    return 0;
+  }
+  obj->current = obj->queued;
+  obj->queued = -1;
+  obj->idle = FALSE;
+  ret = yfpipe_submit(obj, 0);
+  if (ret < 0) {
+    obj->status = ret;
+    obj->idle = TRUE;
+  }
+  return ret;
+}
+
+static void yfpipe_abort(yfpipe_instance_t* obj);
+
+static void LIBUSB_CALL yfpipe_callback(struct libusb_transfer* transfer)
+{
+  yfpipe_instance_t* obj = (yfpipe_instance_t*)transfer->user_data;
+  int ret;
+
+  record_completion(obj->dev, &obj->start, transfer);
+  COUNT_COMPLETION();
+  pthread_mutex_lock(&obj->mutex);
+  ret = get_transfer_result(transfer);
+  if (ret == 0 && ! obj->stopping) {
+    ret = yfpipe_submit(obj, obj->step + 1);
+    if (ret > 0) {
+      /* Frame latched, proceed with the queued one. */
+      ++obj->sent;
+      yfpipe_next(obj);
+    } else if (ret < 0) {
+      obj->status = ret;
+      yfpipe_abort(obj);
+    }
+  } else {
+    if (ret != 0) {
+      obj->status = ret;
+    }
+    yfpipe_abort(obj);
+  }
+  pthread_mutex_unlock(&obj->mutex);
+}
+
+static void yfpipe_free(void *self)
+{
+  yfpipe_instance_t *obj = (yfpipe_instance_t *)self;
+  int i;
+  if (obj->mutex_initialized) {
+    pthread_mutex_lock(&obj->mutex);
+    obj->stopping = TRUE;
+    if (! obj->idle) {
+      libusb_cancel_transfer(obj->transfers[obj->step]);
+    }
+    pthread_mutex_unlock(&obj->mutex);
+    handle_events(obj->dev->context, -1, &obj->idle);
+    /* The callback (possibly run by the event thread) may still own the
+       lock after having set the idle flag. */
+    pthread_mutex_lock(&obj->mutex);
+    pthread_mutex_unlock(&obj->mutex);
+    pthread_mutex_destroy(&obj->mutex);
+  }
+  for (i = 0; i < FPIPE_STEPS; ++i) {
+    if (obj->transfers[i] != NULL) {
+      libusb_free_transfer(obj->transfers[i]);
+    }
+  }
+  if (obj->frames[0] != NULL) {
+    p_free(obj->frames[0]);
+  }
+  if (obj->device_use != NULL) {
+    ydrop_use(obj->device_use);
+  }
+}
+
+static void yfpipe_print(void *self)
+{
+  yfpipe_instance_t *obj = (yfpipe_instance_t *)self;
+  char buf[256];
+  y_print(yfpipe_class.type_name, 0);
+  sprintf(buf, ": endpoint=0x%02x, nchannels=%ld, sync=%d, pending=%d, "
+          "sent=%lu, dropped=%lu",
+          (unsigned int)obj->endpoint, obj->nchannels, obj->has_sync,
+          (obj->idle ? 0 : 1) + (obj->queued >= 0 ? 1 : 0),
+          obj->sent, obj->dropped);
+  y_print(buf, 1);
+}
+
+static void yfpipe_extract(void *addr, char *member)
+{
+  yfpipe_instance_t *obj = (yfpipe_instance_t *)addr;
+  int c = (member != NULL ? member[0] : '\0');
+  if (c == 'p' && strcmp(member, "pending") == 0) {
+    pthread_mutex_lock(&obj->mutex);
+    ypush_int((obj->idle ? 0 : 1) + (obj->queued >= 0 ? 1 : 0));
+    pthread_mutex_unlock(&obj->mutex);
+  } else if (c == 's' && strcmp(member, "sent") == 0) {
+    ypush_long(obj->sent);
+  } else if (c == 'd' && strcmp(member, "dropped") == 0) {
+    ypush_long(obj->dropped);
+  } else if (c == 's' && strcmp(member, "status") == 0) {
+    ypush_int(obj->status);
+  } else if (c == 's' && strcmp(member, "sync") == 0) {
+    ypush_int(obj->has_sync);
+  } else if (c == 'n' && strcmp(member, "nchannels") == 0) {
+    ypush_long(obj->nchannels);
+  } else if (c == 'e' && strcmp(member, "endpoint") == 0) {
+    ypush_int(obj->endpoint);
+  } else if (c == 'd' && strcmp(member, "device") == 0) {
+    ypush_use(obj->device_use);
+  } else {
+    y_error("bad member name");
+  }
+}
+
+/* Get an USB frame pipe from the stack. */
+static yfpipe_instance_t* get_frame_pipe(int iarg)
+{
+  return (yfpipe_instance_t*)yget_obj(iarg, &yfpipe_class);
+}
+
+void Y_usb_frame_pipe(int argc)
+{
+  yfpipe_instance_t* obj;
+  ydev_instance_t* dev;
+  long nchannels, ntot, dims[Y_DIMSIZE];
+  unsigned int timeout;
+  int* sync;
+  int endpoint, dacmax, i, j;
+
+  /* Get arguments. */
+  if (argc != 6) {
+    y_error("expecting exactly 6 arguments");
+  }
+  dev = get_device(5);
+  check_async(dev);
+  endpoint = ygets_i(4) & 0xff; /* uint8_t */
+  nchannels = ygets_l(3);
+  if (nchannels <= 0 || 2*nchannels > 0x7fffffffL) {
+    y_error("invalid number of channels");
+  }
+  dacmax = ygets_i(2);
+  if (dacmax <= 0 || dacmax > 0xffff) {
+    y_error("invalid maximum DAC value");
+  }
+  if (yarg_nil(1)) {
+    sync = NULL;
+  } else {
+    sync = ygeta_i(1, &ntot, dims);
+    if (dims[0] != 2 || dims[1] != 5 || dims[2] != 2) {
+      y_error("SYNC must be a 5-by-2 array");
+    }
+    if (sync[4] != 0 || sync[9] != 0) {
+      y_error("frame-sync control transfers must have no data");
+    }
+  }
+  timeout = (unsigned int)(ygets_l(0) & 0xffffffffL);
+
+  /* Create the frame pipe. */
+  obj = (yfpipe_instance_t*)ypush_obj(&yfpipe_class,
+                                      sizeof(yfpipe_instance_t));
+  obj->idle = TRUE;
+  obj->queued = -1;
+  obj->dev = dev;
+  obj->device_use = yget_use(6);
+  obj->endpoint = endpoint;
+  obj->nchannels = nchannels;
+  obj->dacmax = dacmax;
+  obj->has_sync = (sync != NULL);
+  obj->frames[0] = (unsigned char*)p_malloc(4*nchannels);
+  obj->frames[1] = obj->frames[0] + 2*nchannels;
+  memset(obj->frames[0], 0, 4*nchannels);
+  for (i = 0; i < FPIPE_STEPS; ++i) {
+    if (i != FPIPE_FRAME && sync == NULL) {
+      continue;
+    }
+    obj->transfers[i] = libusb_alloc_transfer(0);
+    if (obj->transfers[i] == NULL) {
+      failure("failed to allocate transfer", LIBUSB_ERROR_NO_MEM);
+    }
+    if (i == FPIPE_FRAME) {
+      libusb_fill_bulk_transfer(obj->transfers[i], dev->handle, endpoint,
+                                obj->frames[0], (int)(2*nchannels),
+                                yfpipe_callback, obj, timeout);
+    } else {
+      j = (i == FPIPE_SYNC_OFF ? 0 : 1);
+      libusb_fill_control_setup(obj->setup[j], sync[5*j] & 0xff,
+                                sync[5*j + 1] & 0xff, /* bRequest */
+                                sync[5*j + 2] & 0xffff, /* wValue */
+                                sync[5*j + 3] & 0xffff, /* wIndex */
+                                0);
+      libusb_fill_control_transfer(obj->transfers[i], dev->handle,
+                                   obj->setup[j], yfpipe_callback, obj,
+                                   timeout);
+    }
+  }
+  if (pthread_mutex_init(&obj->mutex, NULL) != 0) {
+    y_error("failed to initialize mutex");
+  }
+  obj->mutex_initialized = TRUE;
+}
+
+/* Stop the chain after a failure or on request, the queued frame (if any)
+   is dropped; the caller must own the lock. */
+static void yfpipe_abort(yfpipe_instance_t* obj)
+{
+  if (obj->queued >= 0) {
+    obj->queued = -1;
+    ++obj->dropped;
+  }
+  obj->idle = TRUE;
+}
+
+void Y_usb_frame_submit(int argc)
+{
+  yfpipe_instance_t* obj;
+  unsigned char* frame;
+  void* values;
+  long ntot;
+  int type, ret, prev, slot;
+
+  if (argc != 2) {
+    y_error("expecting exactly 2 arguments");
+  }
+  obj = get_frame_pipe(1);
+  type = yarg_typeid(0);
+  if (type == Y_FLOAT) {
+    values = ygeta_f(0, &ntot, NULL);
+  } else {
+    values = ygeta_d(0, &ntot, NULL);
+    type = Y_DOUBLE;
+  }
+  if (ntot > obj->nchannels) {
+    y_error("too many actuator commands");
+  }
+
+  /* Encode the frame in the buffer which is not being sent (the queued
+     frame, if any, is replaced). */
+  pthread_mutex_lock(&obj->mutex);
+  prev = obj->status; /* error of a previous frame */
+  obj->status = 0;
+  if (obj->queued >= 0) {
+    ++obj->dropped;
+    ret = 2;
+  } else {
+    ret = (obj->idle ? 0 : 1);
+  }
+  slot = (obj->idle ? obj->current : 1 - obj->current);
+  frame = obj->frames[slot];
+  if (type == Y_FLOAT) {
+    encode_frame_float(frame, (const float*)values, ntot,
+                       (float)obj->dacmax);
+  } else {
+    encode_frame_double(frame, (const double*)values, ntot,
+                        (double)obj->dacmax);
+  }
+  if (obj->nchannels > ntot) {
+    memset(frame + 2*ntot, 0, 2*(obj->nchannels - ntot));
+  }
+  obj->queued = slot;
+  if (obj->idle && yfpipe_next(obj) < 0) {
+    ret = obj->status;
+    obj->status = 0;
+  } else if (prev < 0) {
+    ret = prev;
+  }
+  pthread_mutex_unlock(&obj->mutex);
+  if (ret < 0 && yarg_subroutine()) {
+    failure(NULL, ret);
+  }
+  ypush_int(ret);
+}
+
+void Y_usb_frame_wait(int argc)
+{
+  yfpipe_instance_t* obj;
+  long timeout;
+  int ret;
+
+  if (argc != 1 && argc != 2) {
+    y_error("expecting 1 or 2 arguments");
+  }
+  obj = get_frame_pipe(argc - 1);
+  timeout = (argc >= 2 && ! yarg_nil(0) ? ygets_l(0) : -1);
+  ret = 0;
+  while (ret == 0) {
+    pthread_mutex_lock(&obj->mutex);
+    if (obj->idle) {
+      ret = obj->status;
+      obj->status = 0;
+      pthread_mutex_unlock(&obj->mutex);
+      break;
+    }
+    pthread_mutex_unlock(&obj->mutex);
+    ret = handle_events(obj->dev->context, timeout, &obj->idle);
+  }
+  if (ret < 0 && yarg_subroutine()) {
+    failure(NULL, ret);
+  }
+  ypush_int(ret);
+}
+
+/*--------------------------------------------------------------------------*/
+/* EVENT THREAD */
+
+/* Maximum time (in microseconds) spent by the event thread in libusb before
+   checking whether it should quit.  This is only relevant if
+   libusb_interrupt_event_handler is not available. */
+#define EVENT_THREAD_PERIOD 100000
+
+static void* event_thread_loop(void* arg)
+{
+  context_t* uc = (context_t*)arg;
+  struct timeval tv;
+  while (! uc->event_thread_quit) {
+    tv.tv_sec = 0;
+    tv.tv_usec = EVENT_THREAD_PERIOD;
+    libusb_handle_events_timeout_completed(uc->ctx, &tv,
+                                           (int*)&uc->event_thread_quit);
+  }
+  return NULL;
+}
+
+/* Apply the scheduling parameters of the event thread (if it is running).
+   Returns 0 on success or an error code. */
+static int apply_io_params(context_t* uc)
+{
+  struct sched_param param;
+  int ret;
+
+  if (! uc->event_thread_started || ! uc->io_params) {
+    return 0;
+  }
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = uc->io_priority;
+  ret = pthread_setschedparam(uc->event_thread, uc->io_policy, &param);
+  if (ret != 0) {
+    return (ret == EPERM ? LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_INVALID_PARAM);
+  }
+#ifdef __linux__
+  {
+    /* Bind the thread to its CPU or let it run on any CPU (it may have
+       been bound before or have inherited the affinity of a pinned
+       interpreter, see usb_set_spin). */
+    cpu_set_t mask;
+    long i, n;
+    CPU_ZERO(&mask);
+    if (uc->io_cpu >= 0) {
+      if (uc->io_cpu >= CPU_SETSIZE) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+      }
+      CPU_SET(uc->io_cpu, &mask);
+    } else {
+      n = sysconf(_SC_NPROCESSORS_CONF);
+      if (n < 1 || n > CPU_SETSIZE) {
+        n = CPU_SETSIZE;
+      }
+      for (i = 0; i < n; ++i) {
+        CPU_SET(i, &mask);
+      }
+    }
+    if (pthread_setaffinity_np(uc->event_thread, sizeof(mask), &mask) != 0) {
+      return LIBUSB_ERROR_INVALID_PARAM;
+    }
+  }
+#else
+  if (uc->io_cpu >= 0) {
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+  }
+#endif
+  return 0;
+}
+
+static int start_event_thread(context_t* uc)
+{
+  int ret;
+  if (uc->event_thread_started) {
+    return 0;
+  }
+  uc->event_thread_quit = FALSE;
+  ret = pthread_create(&uc->event_thread, NULL, event_thread_loop, uc);
+  if (ret != 0) {
+    return ret;
+  }
+  uc->event_thread_started = TRUE;
+  return 0;
+}
+
+static void stop_event_thread(context_t* uc)
+{
+  if (uc->event_thread_started) {
+    uc->event_thread_quit = TRUE;
+#ifdef HAVE_LIBUSB_INTERRUPT_EVENT_HANDLER
+    libusb_interrupt_event_handler(uc->ctx);
+#endif
+    pthread_join(uc->event_thread, NULL);
+    uc->event_thread_started = FALSE;
+  }
+}
+
+void Y_usb_start_event_thread(int argc)
+{
+  context_t* uc;
+  int ret;
+
+  uc = get_optional_context(argc);
+  if (uc->event_thread_started) {
+    ypush_nil();
+    return;
+  }
+  if (start_event_thread(uc) != 0) {
+    y_error("failed to start USB event thread");
+  }
+  ret = apply_io_params(uc);
+  if (ret != 0) {
+    stop_event_thread(uc);
+    failure("failed to set scheduling parameters of USB event thread", ret);
+  }
+  ypush_nil();
+}
+
+void Y_usb_stop_event_thread(int argc)
+{
+  stop_event_thread(get_optional_context(argc));
+  ypush_nil();
+}
+
+void Y__usb_set_io_thread_params(int argc)
+{
+  context_t* uc;
+  int policy, priority, cpu, lock, ret;
+  int old_policy, old_priority, old_cpu, old_params;
+
+  if (argc != 5) {
+    y_error("expecting exactly 5 arguments");
+  }
+  uc = get_context(4);
+  policy = (yarg_nil(3) ? -1 : ygets_i(3));
+  priority = (yarg_nil(2) ? -1 : ygets_i(2));
+  cpu = (yarg_nil(1) ? -2 : ygets_i(1));
+  lock = (yarg_nil(0) ? -1 : yarg_true(0));
+  old_policy = uc->io_policy;
+  old_priority = uc->io_priority;
+  old_cpu = uc->io_cpu;
+  old_params = uc->io_params;
+
+  /* Scheduling parameters (a real-time policy by default if a priority is
+     specified, the current priority bounded to the range of the policy if
+     only the policy is specified). */
+  if (policy != -1 || priority != -1) {
+    if (policy == -1) {
+      policy = (priority > 0 ? SCHED_FIFO : SCHED_OTHER);
+    }
+    if (priority == -1) {
+      priority = uc->io_priority;
+      if (priority < sched_get_priority_min(policy)) {
+        priority = sched_get_priority_min(policy);
+      } else if (priority > sched_get_priority_max(policy)) {
+        priority = sched_get_priority_max(policy);
+      }
+    }
+    if (priority < sched_get_priority_min(policy) ||
+        priority > sched_get_priority_max(policy)) {
+      y_error("invalid priority for this scheduling policy");
+    }
+    uc->io_policy = policy;
+    uc->io_priority = priority;
+    uc->io_params = TRUE;
+  }
+  if (cpu != -2) {
+    uc->io_cpu = (cpu >= 0 ? cpu : -1);
+    if (! uc->io_params) {
+      uc->io_policy = SCHED_OTHER;
+      uc->io_priority = 0;
+      uc->io_params = TRUE;
+    }
+  }
+  ret = apply_io_params(uc);
+  if (ret != 0) {
+    /* Restore the previous parameters (which may have been partially
+       overwritten) so that the rejected ones are not applied later. */
+    uc->io_policy = old_policy;
+    uc->io_priority = old_priority;
+    uc->io_cpu = old_cpu;
+    uc->io_params = TRUE; /* the defaults if none were set */
+    apply_io_params(uc);
+    uc->io_params = old_params;
+    failure("failed to set scheduling parameters of USB event thread", ret);
+  }
+
+  /* Lock memory pages. */
+  if (lock == TRUE) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+      failure("failed to lock memory",
+              (errno == EPERM || errno == ENOMEM ? LIBUSB_ERROR_ACCESS :
+               LIBUSB_ERROR_OTHER));
+    }
+  } else if (lock == FALSE) {
+    munlockall();
+  }
+  ypush_nil();
+}
+
+void Y_usb_event_thread(int argc)
+{
+  ypush_int(get_optional_context(argc)->event_thread_started);
+}
+
+void Y_usb_completions(int argc)
+{
+  if (argc > 1 || (argc == 1 && ! yarg_nil(0))) {
+    y_error("expecting no arguments");
+  }
+  ypush_long((long)completion_count);
+}
+
+/*--------------------------------------------------------------------------*/
+/* EVENT LOOP INTEGRATION */
+
+/* USB events of a context can be processed by Yorick's own event loop when
+   the interpreter is idle.  Yorick event sources are file descriptors which
+   are polled for input, whereas libusb file descriptors may have to be
+   polled for output (e.g. usbfs device descriptors on Linux) and libusb may
+   have pending timeouts.  Hence a helper thread polls the file descriptors
+   of libusb and writes a byte in a pipe whose reading end is registered as
+   a Yorick event source.  The event source callback then processes USB
+   events without blocking (so completion callbacks are called by the
+   interpreter thread) and acknowledges the notification.  The helper thread
+   waits for the acknowledgement before polling again to avoid spinning. */
+
+/* Yorick (play) function to register a file descriptor with the event loop
+   (not declared in the installed headers).  ON_INPUT is called with CONTEXT
+   when there is input available on FD, a NULL ON_INPUT unregisters FD. */
+extern void u_event_src(int fd, void (*on_input)(void *), void *context);
+
+/* Maximum time (in milliseconds) spent by the helper thread in poll. */
+#define WATCHER_PERIOD 100
+
+static int watcher_wait(context_t* uc)
+{
+  const struct libusb_pollfd** list;
+  struct pollfd fds[WATCHER_MAX_FDS];
+  struct timeval tv;
+  int i, n, ms, ret;
+
+  /* The list of libusb file descriptors is fetched every time as it may
+     change when devices are opened or closed. */
+  list = libusb_get_pollfds(uc->ctx);
+  n = 0;
+  fds[n].fd = uc->watch_pipe[0];
+  fds[n].events = POLLIN;
+  ++n;
+  if (list != NULL) {
+    for (i = 0; list[i] != NULL && n < WATCHER_MAX_FDS; ++i, ++n) {
+      fds[n].fd = list[i]->fd;
+      fds[n].events = list[i]->events;
+    }
+    libusb_free_pollfds(list);
+  }
+  ms = WATCHER_PERIOD;
+  if (! libusb_pollfds_handle_timeouts(uc->ctx) &&
+      libusb_get_next_timeout(uc->ctx, &tv) == 1) {
+    ret = (int)(tv.tv_sec*1000 + (tv.tv_usec + 999)/1000);
+    if (ret < ms) {
+      ms = ret;
+      if (ms <= 0) {
+        return 1; /* a timeout has expired */
+      }
+    }
+  }
+  ret = poll(fds, n, ms);
+  if (ret <= 0) {
+    return (ret == 0 && ms < WATCHER_PERIOD ? 1 : 0);
+  }
+  for (i = 1; i < n; ++i) {
+    if (fds[i].revents != 0) {
+      return 1;
+    }
+  }
+  return 0; /* only the control pipe */
+}
+
+static void* watcher_loop(void* arg)
+{
+  context_t* uc = (context_t*)arg;
+  char c = 0;
+  while (! uc->watch_quit) {
+    if (watcher_wait(uc) && ! uc->watch_quit) {
+      /* Notify the interpreter and wait for the acknowledgement. */
+      pthread_mutex_lock(&uc->watch_mutex);
+      uc->watch_pending = TRUE;
+      if (write(uc->notify_pipe[1], &c, 1) != 1) {
+        uc->watch_pending = FALSE;
+      }
+      while (uc->watch_pending && ! uc->watch_quit) {
+        pthread_cond_wait(&uc->watch_cond, &uc->watch_mutex);
+      }
+      pthread_mutex_unlock(&uc->watch_mutex);
+    }
+  }
+  return NULL;
+}
+
+/* Event source callback, called by Yorick when the helper thread has
+   detected USB events. */
+static void on_usb_events(void* arg)
+{
+  context_t* uc = (context_t*)arg;
+  struct timeval tv;
+  char buf[16];
+
+  if (read(uc->notify_pipe[0], buf, sizeof(buf)) < 0) {
+    /* Nothing to read. */
+  }
+  tv.tv_sec = 0;
+  tv.tv_usec = 0;
+  libusb_handle_events_timeout_completed(uc->ctx, &tv, NULL);
+  pthread_mutex_lock(&uc->watch_mutex);
+  uc->watch_pending = FALSE;
+  pthread_cond_signal(&uc->watch_cond);
+  pthread_mutex_unlock(&uc->watch_mutex);
+}
+
+static void close_pipe(int fd[2])
+{
+  if (fd[0] >= 0) {
+    close(fd[0]);
+    fd[0] = -1;
+  }
+  if (fd[1] >= 0) {
+    close(fd[1]);
+    fd[1] = -1;
+  }
+}
+
+static int attach_events(context_t* uc)
+{
+  if (uc->watching) {
+    return 0;
+  }
+  uc->notify_pipe[0] = uc->notify_pipe[1] = -1;
+  uc->watch_pipe[0] = uc->watch_pipe[1] = -1;
+  if (pipe(uc->notify_pipe) != 0 || pipe(uc->watch_pipe) != 0) {
+    goto failed;
+  }
+  fcntl(uc->notify_pipe[0], F_SETFL, O_NONBLOCK);
+  if (pthread_mutex_init(&uc->watch_mutex, NULL) != 0) {
+    goto failed;
+  }
+  if (pthread_cond_init(&uc->watch_cond, NULL) != 0) {
+    pthread_mutex_destroy(&uc->watch_mutex);
+    goto failed;
+  }
+  uc->watch_quit = FALSE;
+  uc->watch_pending = FALSE;
+  if (pthread_create(&uc->watch_thread, NULL, watcher_loop, uc) != 0) {
+    pthread_cond_destroy(&uc->watch_cond);
+    pthread_mutex_destroy(&uc->watch_mutex);
+    goto failed;
+  }
+  u_event_src(uc->notify_pipe[0], on_usb_events, uc);
+  uc->watching = TRUE;
+  return 0;
+
+ failed:
+  close_pipe(uc->notify_pipe);
+  close_pipe(uc->watch_pipe);
+  return -1;
+}
+
+static void detach_events(context_t* uc)
+{
+  char c = 0;
+  if (uc->watching) {
+    u_event_src(uc->notify_pipe[0], NULL, NULL);
+    pthread_mutex_lock(&uc->watch_mutex);
+    uc->watch_quit = TRUE;
+    pthread_cond_signal(&uc->watch_cond);
+    pthread_mutex_unlock(&uc->watch_mutex);
+    if (write(uc->watch_pipe[1], &c, 1) != 1) {
+      /* The helper thread will quit after at most WATCHER_PERIOD. */
+    }
+    pthread_join(uc->watch_thread, NULL);
+    pthread_cond_destroy(&uc->watch_cond);
+    pthread_mutex_destroy(&uc->watch_mutex);
+    close_pipe(uc->notify_pipe);
+    close_pipe(uc->watch_pipe);
+    uc->watching = FALSE;
+  }
+}
 
-  ret = libusb_claim_interface(obj->handle, interface_number);
-  if (ret < 0 && yarg_subroutine()) {
-    failure(NULL, ret);
+void Y_usb_attach_events(int argc)
+{
+  if (attach_events(get_optional_context(argc)) != 0) {
+    y_error("failed to attach USB events to Yorick event loop");
   }
-  ypush_int(ret);
+  ypush_nil();
 }
 
-void Y_usb_release_interface(int argc)
+void Y_usb_detach_events(int argc)
 {
-  ydev_instance_t* obj;
-  int interface_number;
-  int ret;
+  detach_events(get_optional_context(argc));
+  ypush_nil();
+}
 
-  if (argc != 2) {
-    y_error("expecting exactly 2 arguments");
-  }
-  obj = get_device(1);
-  interface_number = ygets_i(0);
+void Y_usb_events_attached(int argc)
+{
+  ypush_int(get_optional_context(argc)->watching);
+}
 
+/*--------------------------------------------------------------------------*/
+/* STREAMING */
 
-  ret = libusb_release_interface(obj->handle, interface_number);
-  if (ret < 0 && yarg_subroutine()) {
-    failure(NULL, ret);
+/* A stream keeps NBUFS transfers always queued on an input endpoint.  There
+   are 2*NBUFS buffers of BUFSIZE bytes: NBUFS are attached to the transfers
+   in flight, the others are either filled (waiting to be read) or spare.
+   When a transfer completes, its buffer is queued in the ring of filled
+   buffers, a spare buffer is attached to the transfer and the transfer is
+   immediately re-submitted.  If there are no spare buffers (the reader is
+   too slow), the received data is dropped and the transfer re-submitted
+   with the same buffer.
+
+   For isochronous streams, each buffer consists in NPACKETS packets of
+   PACKET_SIZE bytes and the status and actual length of each packet are
+   saved along with the filled buffer. */
+typedef struct _ystream_instance ystream_instance_t;
+struct _ystream_instance {
+  ydev_instance_t* dev;
+  void* device_use;     /* use of the device object (to keep it alive) */
+  struct libusb_transfer** transfers;
+  unsigned char* memory; /* memory for all buffers */
+  unsigned char** ring; /* ring of filled buffers */
+  int* ring_length;     /* number of bytes in filled buffers */
+  unsigned char** spare; /* stack of spare buffers */
+  pthread_mutex_t mutex; /* lock to protect the ring and spare buffers */
+  int mutex_initialized;
+  int* iso_length;      /* actual lengths of packets in filled buffers */
+  int* iso_status;      /* status of packets in filled buffers */
+  int type;             /* type of transfers */
+  int endpoint;
+  int bufsize;
+  int nbufs;
+  int npackets;         /* number of packets per buffer */
+  int packet_size;      /* size of isochronous packets */
+  int first;            /* index of first filled buffer in ring */
+  int nready;           /* number of filled buffers */
+  int nspare;           /* number of spare buffers */
+  int status;           /* last error code */
+  unsigned long received; /* number of received buffers */
+  unsigned long bytes;  /* number of received bytes */
+  unsigned long overruns; /* number of dropped buffers */
+  unsigned long errors; /* number of failed transfers */
+  struct timespec* start; /* times of submission */
+  volatile int active;  /* number of transfers in flight */
+  volatile int stopping; /* stream is being stopped */
+  volatile int idle;    /* set when no transfers are in flight */
+  volatile int notify;  /* set when a transfer completes */
+};
+
+static void ystream_free(void *);
+static void ystream_print(void *);
+static void ystream_extract(void *, char *);
+
+static y_userobj_t ystream_class = {
+  "USB Stream",
+  ystream_free,
+  ystream_print,
+  NULL,
+  ystream_extract,
+  NULL
+};
+
+static void LIBUSB_CALL ystream_callback(struct libusb_transfer* transfer)
+{
+  ystream_instance_t* obj = (ystream_instance_t*)transfer->user_data;
+  int resubmit, length, ret, i, j, k;
+
+  for (i = 0; i < obj->nbufs && obj->transfers[i] != transfer; ++i)
+    ;
+  if (obj->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+    for (length = 0, k = 0; k < transfer->num_iso_packets; ++k) {
+      length += transfer->iso_packet_desc[k].actual_length;
+    }
+  } else {
+    length = transfer->actual_length;
   }
-  ypush_int(ret);
+  if (transfer->status != LIBUSB_TRANSFER_CANCELLED &&
+      obj->dev->stats_enabled) {
+    ret = get_transfer_result(transfer);
+    record_transfer(obj->dev, &obj->start[i], (ret == 0 ? length : ret),
+                    length);
+  }
+  if (transfer->status != LIBUSB_TRANSFER_CANCELLED && capture.enabled) {
+    capture_completion(obj->dev, &obj->start[i], transfer);
+  }
+  pthread_mutex_lock(&obj->mutex);
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    resubmit = TRUE;
+    if (length > 0 || obj->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+      if (obj->nspare > 0) {
+        j = (obj->first + obj->nready)%obj->nbufs;
+        obj->ring[j] = transfer->buffer;
+        obj->ring_length[j] = length;
+        if (obj->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+          int* dst_length = obj->iso_length + j*obj->npackets;
+          int* dst_status = obj->iso_status + j*obj->npackets;
+          for (k = 0; k < obj->npackets; ++k) {
+            dst_length[k] = transfer->iso_packet_desc[k].actual_length;
+            dst_status[k] =
+              get_status_result(transfer->iso_packet_desc[k].status);
+          }
+        }
+        ++obj->nready;
+        transfer->buffer = obj->spare[--obj->nspare];
+        ++obj->received;
+        obj->bytes += length;
+      } else {
+        ++obj->overruns;
+      }
+    }
+  } else {
+    resubmit = FALSE;
+    if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+      ++obj->errors;
+      obj->status = get_transfer_result(transfer);
+    }
+  }
+  if (resubmit && ! obj->stopping && obj->dev->stats_enabled) {
+    get_time(&obj->start[i]);
+  }
+  if (! resubmit || obj->stopping ||
+      libusb_submit_transfer(transfer) != 0) {
+    if (--obj->active <= 0) {
+      obj->idle = TRUE;
+    }
+  }
+  obj->notify = TRUE;
+  COUNT_COMPLETION();
+  pthread_mutex_unlock(&obj->mutex);
 }
 
-static void* get_data(int iarg, long* the_size)
+/* Cancel all transfers of a stream and wait for their completion. */
+static void ystream_stop(ystream_instance_t* obj)
 {
-  void* data;
-  long size, ntot;
-  int type;
+  int i, active;
+  if (! obj->mutex_initialized) {
+    return; /* no transfers have been submitted */
+  }
+  pthread_mutex_lock(&obj->mutex);
+  obj->stopping = TRUE;
+  active = obj->active;
+  if (active > 0) {
+    for (i = 0; i < obj->nbufs; ++i) {
+      if (obj->transfers[i] != NULL) {
+        libusb_cancel_transfer(obj->transfers[i]);
+      }
+    }
+  }
+  pthread_mutex_unlock(&obj->mutex);
+  if (active > 0) {
+    handle_events(obj->dev->context, -1, &obj->idle);
+    /* The callback (possibly run by the event thread) may still own the
+       lock after having set the idle flag. */
+    pthread_mutex_lock(&obj->mutex);
+    pthread_mutex_unlock(&obj->mutex);
+  }
+}
 
-  data = NULL;
-  size = 0;
-  if (! yarg_nil(iarg)) {
-    data = ygeta_any(iarg, &ntot, NULL, &type);
-    switch(type) {
-    case Y_CHAR:
-      size = sizeof(char)*ntot;
-      break;
-    case Y_SHORT:
-      size = sizeof(short)*ntot;
-      break;
-    case Y_INT:
-      size = sizeof(int)*ntot;
-      break;
-    case Y_LONG:
-      size = sizeof(long)*ntot;
-      break;
-    case Y_FLOAT:
-      size = sizeof(float)*ntot;
-      break;
-    case Y_DOUBLE:
-      size = sizeof(double)*ntot;
-      break;
-    case Y_COMPLEX:
-      size = 2*sizeof(double)*ntot;
-      break;
-    default:
-      y_error("bad data type");
+static void ystream_free(void *self)
+{
+  ystream_instance_t *obj = (ystream_instance_t *)self;
+  int i;
+  if (obj->transfers != NULL) {
+    ystream_stop(obj);
+    for (i = 0; i < obj->nbufs; ++i) {
+      if (obj->transfers[i] != NULL) {
+        libusb_free_transfer(obj->transfers[i]);
+      }
     }
+    p_free(obj->transfers);
   }
-  if (the_size != NULL) {
-    *the_size = size;
+  if (obj->memory != NULL) {
+    p_free(obj->memory);
+  }
+  if (obj->ring != NULL) {
+    p_free(obj->ring);
+  }
+  if (obj->iso_length != NULL) {
+    p_free(obj->iso_length);
+  }
+  if (obj->mutex_initialized) {
+    pthread_mutex_destroy(&obj->mutex);
+  }
+  if (obj->device_use != NULL) {
+    ydrop_use(obj->device_use);
   }
-  return data;
 }
 
-void Y_usb_control_transfer(int argc)
+static void ystream_print(void *self)
 {
-  ydev_instance_t* obj;
-  int ret;
-  int type, request, value, index, length;
-  long size;
-  unsigned char* data;
-  unsigned int timeout;
+  ystream_instance_t *obj = (ystream_instance_t *)self;
+  char buf[256];
+  y_print(ystream_class.type_name, 0);
+  sprintf(buf, ": endpoint=0x%02x, bufsize=%d, nbufs=%d, active=%d, "
+          "received=%lu, overruns=%lu, errors=%lu",
+          (unsigned int)obj->endpoint, obj->bufsize, obj->nbufs,
+          (int)obj->active, obj->received, obj->overruns, obj->errors);
+  y_print(buf, 1);
+}
 
-  /* Get arguments. */
-  if (argc != 8) {
-    y_error("expecting exactly 8 arguments");
+static void ystream_extract(void *addr, char *member)
+{
+  ystream_instance_t *obj = (ystream_instance_t *)addr;
+  int c = (member != NULL ? member[0] : '\0');
+  if (c == 'r' && strcmp(member, "received") == 0) {
+    ypush_long(obj->received);
+  } else if (c == 'r' && strcmp(member, "ready") == 0) {
+    ypush_int(obj->nready);
+  } else if (c == 'b' && strcmp(member, "bytes") == 0) {
+    ypush_long(obj->bytes);
+  } else if (c == 'o' && strcmp(member, "overruns") == 0) {
+    ypush_long(obj->overruns);
+  } else if (c == 'e' && strcmp(member, "errors") == 0) {
+    ypush_long(obj->errors);
+  } else if (c == 'a' && strcmp(member, "active") == 0) {
+    ypush_int(obj->active);
+  } else if (c == 's' && strcmp(member, "status") == 0) {
+    ypush_int(obj->status);
+  } else if (c == 'b' && strcmp(member, "bufsize") == 0) {
+    ypush_int(obj->bufsize);
+  } else if (c == 'n' && strcmp(member, "nbufs") == 0) {
+    ypush_int(obj->nbufs);
+  } else if (c == 'n' && strcmp(member, "npackets") == 0) {
+    ypush_int(obj->npackets);
+  } else if (c == 'p' && strcmp(member, "packet_size") == 0) {
+    ypush_int(obj->packet_size);
+  } else if (c == 't' && strcmp(member, "type") == 0) {
+    ypush_int(obj->type);
+  } else if (c == 'e' && strcmp(member, "endpoint") == 0) {
+    ypush_int(obj->endpoint);
+  } else if (c == 'd' && strcmp(member, "device") == 0) {
+    ypush_use(obj->device_use);
+  } else {
+    y_error("bad member name");
   }
-  obj = get_device(7);
-  type = ygets_i(6) & 0xff; /* uint8_t */
-  request = ygets_i(5) & 0xff; /* uint8_t */
-  value = ygets_i(4) & 0xffff; /* uint16_t */
-  index = ygets_i(3) & 0xffff; /* uint16_t */
-  data = (unsigned char*)get_data(2, &size);
-  length = ygets_i(1) & 0xffff; /* uint16_t */
-  timeout = (unsigned int)(ygets_l(0) & 0xffffffffL);
-  if (length < 0) {
-    y_error("invalid length");
+}
+
+/* Get an USB stream from the stack. */
+static ystream_instance_t* get_stream(int iarg)
+{
+  return (ystream_instance_t*)yget_obj(iarg, &ystream_class);
+}
+
+/* Start streaming (all arguments must have been checked).  The stream object
+   is left on top of the stack.  DEV_IARG is the position of the device before
+   pushing the stream object.  NPACKETS is 0 for bulk streams. */
+static void start_stream(ydev_instance_t* dev, int dev_iarg, int endpoint,
+                         int bufsize, int nbufs, int npackets)
+{
+  ystream_instance_t* obj;
+  struct libusb_transfer* transfer;
+  int i, ret;
+
+  check_async(dev);
+
+  /* Create the stream object (pushing it on top of the stack shifts the
+     positions of the arguments by one). */
+  obj = (ystream_instance_t *)ypush_obj(&ystream_class,
+                                        sizeof(ystream_instance_t));
+  obj->device_use = yget_use(dev_iarg + 1);
+  obj->dev = dev;
+  obj->type = (npackets > 0 ? LIBUSB_TRANSFER_TYPE_ISOCHRONOUS :
+               LIBUSB_TRANSFER_TYPE_BULK);
+  obj->endpoint = endpoint;
+  obj->bufsize = bufsize;
+  obj->nbufs = nbufs;
+  obj->npackets = npackets;
+  obj->packet_size = (npackets > 0 ? bufsize/npackets : 0);
+  obj->status = LIBUSB_SUCCESS;
+  obj->idle = TRUE;
+  obj->transfers = (struct libusb_transfer**)
+    p_malloc(nbufs*sizeof(struct libusb_transfer*));
+  memset(obj->transfers, 0, nbufs*sizeof(struct libusb_transfer*));
+  obj->memory = (unsigned char*)p_malloc(2*nbufs*(size_t)bufsize);
+  obj->ring = (unsigned char**)p_malloc(2*nbufs*sizeof(unsigned char*) +
+                                        nbufs*sizeof(struct timespec) +
+                                        nbufs*sizeof(int));
+  obj->spare = obj->ring + nbufs;
+  obj->start = (struct timespec*)(obj->spare + nbufs);
+  obj->ring_length = (int*)(obj->start + nbufs);
+  if (npackets > 0) {
+    obj->iso_length = (int*)p_malloc(2*nbufs*(size_t)npackets*sizeof(int));
+    obj->iso_status = obj->iso_length + nbufs*(size_t)npackets;
   }
-  if (length > size) {
-    y_error("length must be at most the size of the data");
+  for (i = 0; i < nbufs; ++i) {
+    obj->spare[i] = obj->memory + (nbufs + i)*(size_t)bufsize;
+  }
+  obj->nspare = nbufs;
+  if (pthread_mutex_init(&obj->mutex, NULL) != 0) {
+    y_error("failed to initialize mutex");
+  }
+  obj->mutex_initialized = TRUE;
+  for (i = 0; i < nbufs; ++i) {
+    transfer = libusb_alloc_transfer(npackets);
+    if (transfer == NULL) {
+      failure("failed to allocate transfer", LIBUSB_ERROR_NO_MEM);
+    }
+    obj->transfers[i] = transfer;
+    if (npackets > 0) {
+      libusb_fill_iso_transfer(transfer, dev->handle, endpoint,
+                               obj->memory + i*(size_t)bufsize, bufsize,
+                               npackets, ystream_callback, obj, 0);
+      libusb_set_iso_packet_lengths(transfer, obj->packet_size);
+    } else {
+      libusb_fill_bulk_transfer(transfer, dev->handle, endpoint,
+                                obj->memory + i*(size_t)bufsize, bufsize,
+                                ystream_callback, obj, 0);
+    }
   }
 
-  /* Apply operation. */
-  ret = libusb_control_transfer(obj->handle, type, request, value,
-                                index, data, length, timeout);
-  if (ret < 0 && yarg_subroutine()) {
-    failure(NULL, ret);
+  /* Queue all transfers. */
+  for (i = 0; i < nbufs; ++i) {
+    pthread_mutex_lock(&obj->mutex);
+    ++obj->active;
+    obj->idle = FALSE;
+    pthread_mutex_unlock(&obj->mutex);
+    get_time(&obj->start[i]);
+    ret = libusb_submit_transfer(obj->transfers[i]);
+    if (ret != 0) {
+      pthread_mutex_lock(&obj->mutex);
+      if (--obj->active <= 0) {
+        obj->idle = TRUE;
+      }
+      pthread_mutex_unlock(&obj->mutex);
+      failure("failed to submit transfer", ret);
+    }
   }
-  ypush_int(ret);
 }
 
- static void do_transfer(int argc,
-                         int (*transfer)(struct libusb_device_handle* handle,
-                                         unsigned char endpoint,
-                                         unsigned char* data,
-                                         int length,
-                                         int* transferred,
-                                         unsigned int timeout))
+void Y_usb_stream_start(int argc)
 {
-  ydev_instance_t* obj;
-  int ret, iarg;
-  int endpoint, length, transferred, offset;
-  long size;
-  unsigned char* data;
-  unsigned int timeout;
-  long transferred_index;
+  ydev_instance_t* dev;
+  int endpoint, bufsize, nbufs;
 
-  /* Get arguments. */
-  if (argc != 6 && argc != 7) {
-    y_error("expecting 6 or 7 arguments");
+  if (argc != 4) {
+    y_error("expecting exactly 4 arguments");
   }
-  iarg = argc;
-  obj = get_device(--iarg);
-  endpoint = ygets_i(--iarg) & 0xff; /* uint8_t */
-  data = (unsigned char*)get_data(--iarg, &size);
-  length = ygets_i(--iarg);
-  if (length < 0) {
-    y_error("invalid length");
+  dev = get_device(3);
+  endpoint = ygets_i(2) & 0xff; /* uint8_t */
+  get_tuned_sizes(dev, endpoint, TRUE, &bufsize, &nbufs);
+  if (! yarg_nil(1)) {
+    bufsize = ygets_i(1);
   }
-  if (length > size) {
-    y_error("length must be at most the size of the data");
+  if (! yarg_nil(0)) {
+    nbufs = ygets_i(0);
   }
-  transferred_index = yget_ref(--iarg);
-  if (transferred_index < 0L) {
-    y_error("expecting a simple variable reference");
+  if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN) {
+    y_error("streaming requires an input endpoint");
   }
-  timeout = (unsigned int)(ygets_l(--iarg) & 0xffffffffL);
-  if (iarg > 0) {
-    offset = ygets_i(--iarg);
-    if (offset < 0 || offset > length) {
-      y_error("invalid offset");
+  if (bufsize <= 0) {
+    y_error("invalid buffer size");
+  }
+  if (nbufs <= 0) {
+    y_error("invalid number of buffers");
+  }
+  start_stream(dev, 3, endpoint, bufsize, nbufs, 0);
+}
+
+void Y_usb_iso_stream_start(int argc)
+{
+  ydev_instance_t* dev;
+  int endpoint, packet_size, npackets, nbufs;
+
+  if (argc != 5) {
+    y_error("expecting exactly 5 arguments");
+  }
+  dev = get_device(4);
+  endpoint = ygets_i(3) & 0xff; /* uint8_t */
+  npackets = ygets_i(1);
+  nbufs = ygets_i(0);
+  if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN) {
+    y_error("streaming requires an input endpoint");
+  }
+  if (yarg_nil(2)) {
+    packet_size = libusb_get_max_iso_packet_size(dev->device, endpoint);
+    if (packet_size < 0) {
+      failure("failed to get maximum packet size", packet_size);
     }
   } else {
-    offset = 0;
+    packet_size = ygets_i(2);
+  }
+  if (packet_size <= 0) {
+    y_error("invalid packet size");
+  }
+  if (npackets <= 0 || npackets > 0x7fffffff/packet_size) {
+    y_error("invalid number of packets");
   }
+  if (nbufs <= 0) {
+    y_error("invalid number of buffers");
+  }
+  start_stream(dev, 4, endpoint, packet_size*npackets, nbufs, npackets);
+}
 
-  /* Apply operation. */
-  if (length > offset) {
-    ret = transfer(obj->handle, endpoint, data + offset,
-                   length - offset, &transferred, timeout);
-    if (!(ret == 0 || (ret == LIBUSB_ERROR_TIMEOUT && transferred > 0))) {
-      /* No data has been transferred. */
-      transferred = 0;
-      if (yarg_subroutine()) {
-        /* Some error has occured. */
-        failure(NULL, ret);
-      }
+void Y_usb_stream_read(int argc)
+{
+  ystream_instance_t* obj;
+  unsigned char* buffer;
+  long timeout, dims[3], length_index, status_index;
+  int length, ret, j, n;
+  int* out;
+
+  if (argc < 1 || argc > 4) {
+    y_error("expecting 1 to 4 arguments");
+  }
+  obj = get_stream(argc - 1);
+  timeout = (argc >= 2 && ! yarg_nil(argc - 2) ? ygets_l(argc - 2) : -1);
+  length_index = -1L;
+  status_index = -1L;
+  if (argc >= 3) {
+    length_index = yget_ref(argc - 3);
+    if (length_index < 0L) {
+      y_error("expecting a simple variable reference");
+    }
+  }
+  if (argc >= 4) {
+    status_index = yget_ref(argc - 4);
+    if (status_index < 0L) {
+      y_error("expecting a simple variable reference");
+    }
+  }
+
+  /* Wait for a filled buffer. */
+  pthread_mutex_lock(&obj->mutex);
+  while (obj->nready <= 0 && obj->active > 0) {
+    obj->notify = FALSE;
+    pthread_mutex_unlock(&obj->mutex);
+    ret = handle_events(obj->dev->context, timeout, &obj->notify);
+    pthread_mutex_lock(&obj->mutex);
+    if (ret != 0) {
+      break;
     }
+  }
+  if (obj->nready <= 0) {
+    int active = obj->active;
+    pthread_mutex_unlock(&obj->mutex);
+    if (active > 0) {
+      /* Timeout or interrupted. */
+      ypush_nil();
+      return;
+    }
+    failure("stream is no longer active", obj->status);
+  }
+  j = obj->first;
+  buffer = obj->ring[j];
+  length = obj->ring_length[j];
+  obj->first = (obj->first + 1)%obj->nbufs;
+  --obj->nready;
+  pthread_mutex_unlock(&obj->mutex);
+
+  /* Store the packet information (the slot J of the ring cannot be reused
+     before the buffer is recycled). */
+  n = (obj->npackets > 0 ? obj->npackets : 1);
+  dims[0] = 1;
+  dims[1] = n;
+  if (length_index >= 0L) {
+    out = ypush_i(dims);
+    if (obj->npackets > 0) {
+      memcpy(out, obj->iso_length + j*n, n*sizeof(int));
+    } else {
+      out[0] = length;
+    }
+    yput_global(length_index, 0);
+    yarg_drop(1);
+  }
+  if (status_index >= 0L) {
+    out = ypush_i(dims);
+    if (obj->npackets > 0) {
+      memcpy(out, obj->iso_status + j*n, n*sizeof(int));
+    } else {
+      out[0] = LIBUSB_SUCCESS;
+    }
+    yput_global(status_index, 0);
+    yarg_drop(1);
+  }
+
+  /* Copy the data and recycle the buffer.  For isochronous streams, the
+     result is a PACKET_SIZE-by-NPACKETS array. */
+  if (obj->npackets > 0) {
+    dims[0] = 2;
+    dims[1] = obj->packet_size;
+    dims[2] = obj->npackets;
+    length = obj->bufsize;
   } else {
-    /* Nothing to do. */
-    transferred = 0;
-    ret = 0;
+    dims[0] = 1;
+    dims[1] = length;
   }
-  if (transferred_index >= 0L) {
-    /* Store total number of transferred bytes so far. */
-    ypush_int(offset + transferred);
-    yput_global(transferred_index, 0);
+  memcpy(ypush_c(dims), buffer, length);
+  pthread_mutex_lock(&obj->mutex);
+  obj->spare[obj->nspare++] = buffer;
+  pthread_mutex_unlock(&obj->mutex);
+}
+
+void Y_usb_stream_stop(int argc)
+{
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
   }
-  ypush_int(ret);
+  ystream_stop(get_stream(0));
+  ypush_nil();
 }
 
-void Y_usb_bulk_transfer(int argc)
+/*--------------------------------------------------------------------------*/
+/* HOTPLUG NOTIFICATIONS */
+
+/* Hotplug callbacks may be called by the event thread, so they cannot call
+   the interpreter.  Instead, hotplug events are queued and fetched by
+   _usb_hotplug_events which is called by interpreted code to dispatch them to
+   Yorick callbacks. */
+#define HOTPLUG_MAX_CALLBACKS 32
+#define HOTPLUG_QUEUE_SIZE   128
+#define HOTPLUG_EVENT_SIZE     7
+
+static pthread_mutex_t hotplug_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int hotplug_queue[HOTPLUG_QUEUE_SIZE][HOTPLUG_EVENT_SIZE];
+static int hotplug_first = 0;
+static int hotplug_count = 0;
+#ifdef HAVE_LIBUSB_HOTPLUG
+static libusb_hotplug_callback_handle hotplug_handles[HOTPLUG_MAX_CALLBACKS];
+#endif
+static int hotplug_registered[HOTPLUG_MAX_CALLBACKS];
+
+#ifdef HAVE_LIBUSB_HOTPLUG
+static int LIBUSB_CALL queue_hotplug_event(libusb_context* context,
+                                           libusb_device* device,
+                                           libusb_hotplug_event event,
+                                           void* user_data)
 {
-  do_transfer(argc, libusb_bulk_transfer);
+  struct libusb_device_descriptor desc;
+  int* item;
+
+  if (libusb_get_device_descriptor(device, &desc) != 0) {
+    desc.idVendor = 0;
+    desc.idProduct = 0;
+  }
+  pthread_mutex_lock(&hotplug_mutex);
+  if (hotplug_count < HOTPLUG_QUEUE_SIZE) {
+    item = hotplug_queue[(hotplug_first + hotplug_count)%HOTPLUG_QUEUE_SIZE];
+    item[0] = (int)(long)user_data;
+    item[1] = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? 1 : -1);
+    item[2] = libusb_get_bus_number(device);
+    item[3] = libusb_get_port_number(device);
+    item[4] = libusb_get_device_address(device);
+    item[5] = desc.idVendor;
+    item[6] = desc.idProduct;
+    ++hotplug_count;
+  }
+  pthread_mutex_unlock(&hotplug_mutex);
+  return 0; /* keep the callback registered */
 }
+#endif
 
-void Y_usb_interrupt_transfer(int argc)
+void Y__usb_hotplug_register(int argc)
+{
+  int vendor, product, id, ret;
+
+  if (argc != 2) {
+    y_error("expecting exactly 2 arguments");
+  }
+  vendor = (yarg_nil(1) ? -1 : ygets_i(1));
+  product = (yarg_nil(0) ? -1 : ygets_i(0));
+  INITIALIZE;
+  if (! default_context.hotplug_supported) {
+    failure("hotplug notifications not available", LIBUSB_ERROR_NOT_SUPPORTED);
+  }
+  for (id = 0; id < HOTPLUG_MAX_CALLBACKS; ++id) {
+    if (! hotplug_registered[id]) {
+      break;
+    }
+  }
+  if (id >= HOTPLUG_MAX_CALLBACKS) {
+    y_error("too many hotplug callbacks");
+  }
+#ifdef HAVE_LIBUSB_HOTPLUG
+  ret = libusb_hotplug_register_callback(default_context.ctx,
+                                         LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                         LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                         LIBUSB_HOTPLUG_NO_FLAGS,
+                                         (vendor < 0 ? LIBUSB_HOTPLUG_MATCH_ANY
+                                          : (vendor & 0xffff)),
+                                         (product < 0 ? LIBUSB_HOTPLUG_MATCH_ANY
+                                          : (product & 0xffff)),
+                                         LIBUSB_HOTPLUG_MATCH_ANY,
+                                         queue_hotplug_event,
+                                         (void*)(long)(id + 1),
+                                         &hotplug_handles[id]);
+#else
+  ret = LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+  if (ret != 0) {
+    failure("failed to register hotplug callback", ret);
+  }
+  hotplug_registered[id] = TRUE;
+  ypush_int(id + 1);
+}
+
+void Y__usb_hotplug_deregister(int argc)
+{
+  int id;
+
+  if (argc != 1) {
+    y_error("expecting exactly one argument");
+  }
+  id = ygets_i(0) - 1;
+  if (id >= 0 && id < HOTPLUG_MAX_CALLBACKS && hotplug_registered[id]) {
+    hotplug_registered[id] = FALSE;
+#ifdef HAVE_LIBUSB_HOTPLUG
+    libusb_hotplug_deregister_callback(default_context.ctx,
+                                       hotplug_handles[id]);
+#endif
+  }
+  ypush_nil();
+}
+
+void Y__usb_hotplug_events(int argc)
 {
-  do_transfer(argc, libusb_interrupt_transfer);
+  long dims[3];
+  int* data;
+  int i, n;
+
+  if (argc != 1 || ! yarg_nil(0)) {
+    y_error("expecting exactly one nil argument");
+  }
+  if (default_context.hotplug_supported &&
+      ! default_context.event_thread_started) {
+    /* Deliver pending hotplug notifications. */
+    handle_events(&default_context, 0, NULL);
+  }
+  pthread_mutex_lock(&hotplug_mutex);
+  n = hotplug_count;
+  pthread_mutex_unlock(&hotplug_mutex);
+  if (n <= 0) {
+    ypush_nil();
+    return;
+  }
+
+  /* Events can only be appended to the queue by the callback, so the N
+     first events are still there once the result has been allocated. */
+  dims[0] = 2;
+  dims[1] = HOTPLUG_EVENT_SIZE;
+  dims[2] = n;
+  data = ypush_i(dims);
+  pthread_mutex_lock(&hotplug_mutex);
+  for (i = 0; i < n; ++i) {
+    memcpy(data + i*HOTPLUG_EVENT_SIZE,
+           hotplug_queue[(hotplug_first + i)%HOTPLUG_QUEUE_SIZE],
+           HOTPLUG_EVENT_SIZE*sizeof(int));
+  }
+  hotplug_first = (hotplug_first + n)%HOTPLUG_QUEUE_SIZE;
+  hotplug_count -= n;
+  pthread_mutex_unlock(&hotplug_mutex);
 }